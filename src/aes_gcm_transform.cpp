@@ -0,0 +1,143 @@
+#include "aes_gcm_transform.h"
+#include "random.h"
+#include "log.h"
+#include "util.h"
+
+#include <memory>
+
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+namespace {
+
+struct CipherCtxDeleter
+{
+    void operator()(EVP_CIPHER_CTX *ctx) const { EVP_CIPHER_CTX_free(ctx); }
+};
+
+// cipher contexts are reused by the worker threads
+thread_local std::unique_ptr<EVP_CIPHER_CTX, CipherCtxDeleter> local_ctx;
+
+const char header_magic[8] = { 'A', 'W', 'S', 'U', 'G', 'C', 'M', '1' };
+
+void
+put_be(unsigned char *p, uint64_t value, int size)
+{
+    for (int i = size - 1; i >= 0; --i) {
+        p[i] = value;
+        value >>= 8;
+    }
+}
+
+}
+
+AesGcmTransform::AesGcmTransform(const unsigned char *key, uint32_t chunk_size, uint64_t input_size)
+{
+    memcpy(key_, key, key_size);
+    memcpy(header_, header_magic, sizeof(header_magic));
+    memset(header_ + 8, 0, 8);
+    put_be(header_ + 16, chunk_size, 4);
+    put_be(header_ + 20, input_size, 8);
+}
+
+AesGcmTransform::~AesGcmTransform()
+{
+    OPENSSL_cleanse(key_, sizeof(key_));
+}
+
+bool
+AesGcmTransform::init()
+{
+    if (random_bytes(header_ + 8, 8) < 0) {
+        log_error("cannot generate nonce prefix");
+        return false;
+    }
+    return true;
+}
+
+std::string
+AesGcmTransform::header() const
+{
+    return std::string((const char *) header_, sizeof(header_));
+}
+
+ssize_t
+AesGcmTransform::apply(uint64_t chunk_index, const char *in, size_t in_size, char *out, size_t out_size)
+{
+    if (out_size < bound(in_size) || in_size > 0xffffffffU || chunk_index > 0xffffffffU) {
+        return -1;
+    }
+    if (!local_ctx) {
+        local_ctx.reset(EVP_CIPHER_CTX_new());
+        if (!local_ctx) {
+            log_error("EVP_CIPHER_CTX_new failed");
+            return -1;
+        }
+    }
+    EVP_CIPHER_CTX *ctx = local_ctx.get();
+
+    unsigned char nonce[12];
+    memcpy(nonce, header_ + 8, 8);
+    put_be(nonce + 8, chunk_index, 4);
+
+    unsigned char *dst = (unsigned char *) out;
+    put_be(dst, in_size, 4);
+
+    int len = 0;
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key_, nonce) != 1
+        || EVP_EncryptUpdate(ctx, NULL, &len, header_, sizeof(header_)) != 1
+        || EVP_EncryptUpdate(ctx, NULL, &len, dst, 4) != 1) {
+        log_error("AES-GCM initialization failed");
+        return -1;
+    }
+    // EVP_EncryptUpdate takes an int length
+    size_t done = 0;
+    while (done < in_size) {
+        int n = std::min<size_t>(in_size - done, 1 << 30);
+        if (EVP_EncryptUpdate(ctx, dst + 4 + done, &len, (const unsigned char *) in + done, n) != 1) {
+            log_error("AES-GCM encryption failed");
+            return -1;
+        }
+        done += len;
+    }
+    if (EVP_EncryptFinal_ex(ctx, dst + 4 + done, &len) != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_size, dst + 4 + done + len) != 1) {
+        log_error("AES-GCM finalization failed");
+        return -1;
+    }
+    return 4 + done + len + tag_size;
+}
+
+bool
+AesGcmTransform::load_key(const std::string &path, unsigned char *key)
+{
+    FILE *f = fopen(path.c_str(), "re");
+    if (!f) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    unsigned char buf[key_size * 2 + 2];
+    size_t size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    bool ok = false;
+    if (size == key_size) {
+        memcpy(key, buf, key_size);
+        ok = true;
+    } else {
+        while (size > 0 && isspace(buf[size - 1])) --size;
+        if (size == key_size * 2) {
+            ok = hex_decode(key, key_size, (const char *) buf) >= 0;
+        }
+    }
+    OPENSSL_cleanse(buf, sizeof(buf));
+    if (!ok) {
+        log_error("'%s': key must be %zu bytes or %zu hex digits", path.c_str(), key_size, key_size * 2);
+    }
+    return ok;
+}
@@ -0,0 +1,36 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "transform.h"
+
+// encrypts every chunk with AES-256-GCM, the output stream is
+//   header: "AWSUGCM1", nonce prefix (8), chunk size (4), input size (8)
+//   records: ciphertext length (4), ciphertext, tag (16)
+// all integers are big-endian; the nonce of a chunk is the prefix followed by
+// the chunk index (4), the header and the record length are authenticated
+class AesGcmTransform : public ChunkTransform
+{
+public:
+    static constexpr size_t key_size = 32;
+    static constexpr size_t tag_size = 16;
+    static constexpr size_t header_size = 28;
+
+private:
+    unsigned char key_[key_size];
+    unsigned char header_[header_size];
+
+public:
+    AesGcmTransform(const unsigned char *key, uint32_t chunk_size, uint64_t input_size);
+    ~AesGcmTransform();
+
+    // initialize the nonce prefix, must be called before use
+    bool init();
+
+    const char *name() const override { return "aes-256-gcm"; }
+    size_t bound(size_t size) const override { return size + 4 + tag_size; }
+    ssize_t apply(uint64_t chunk_index, const char *in, size_t in_size, char *out, size_t out_size) override;
+    std::string header() const override;
+
+    // the key file contains either 32 raw bytes or 64 hex digits
+    static bool load_key(const std::string &path, unsigned char *key);
+};
@@ -0,0 +1,170 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "aes_gcm_transform.h"
+#include "transform.h"
+#include "staging.h"
+#include "util.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static uint64_t
+get_be(const std::string &s, size_t pos, int size)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < size; ++i) {
+        value = value << 8 | (unsigned char) s[pos + i];
+    }
+    return value;
+}
+
+// decrypt the record of chunk 'index' at 'pos' of the stream, advances 'pos'
+static bool
+decrypt_record(const unsigned char *key, const std::string &stream, size_t &pos, uint32_t index, std::string &plain)
+{
+    const std::string header = stream.substr(0, AesGcmTransform::header_size);
+    if (pos + 4 > stream.size()) return false;
+    size_t len = get_be(stream, pos, 4);
+    if (pos + 4 + len + AesGcmTransform::tag_size > stream.size()) return false;
+    const unsigned char *rec = (const unsigned char *) stream.data() + pos;
+
+    unsigned char nonce[12];
+    memcpy(nonce, header.data() + 8, 8);
+    for (int i = 0; i < 4; ++i) nonce[8 + i] = index >> (24 - i * 8);
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    assert(ctx);
+    plain.assign(len, 0);
+    int n = 0;
+    bool ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, nonce) == 1
+        && EVP_DecryptUpdate(ctx, NULL, &n, (const unsigned char *) header.data(), header.size()) == 1
+        && EVP_DecryptUpdate(ctx, NULL, &n, rec, 4) == 1
+        && EVP_DecryptUpdate(ctx, (unsigned char *) &plain[0], &n, rec + 4, len) == 1
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, AesGcmTransform::tag_size,
+                               (void *) (rec + 4 + len)) == 1
+        && EVP_DecryptFinal_ex(ctx, (unsigned char *) &plain[0] + n, &n) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    pos += 4 + len + AesGcmTransform::tag_size;
+    return ok;
+}
+
+// decrypt the whole stream, checking the header against the expected values
+static bool
+decrypt_stream(const unsigned char *key, const std::string &stream, uint32_t chunk_size, std::string &plain, std::vector<size_t> &sizes)
+{
+    if (stream.size() < AesGcmTransform::header_size || stream.compare(0, 8, "AWSUGCM1")) return false;
+    if (get_be(stream, 16, 4) != chunk_size) return false;
+    uint64_t input_size = get_be(stream, 20, 8);
+
+    plain.clear();
+    sizes.clear();
+    size_t pos = AesGcmTransform::header_size;
+    for (uint32_t index = 0; pos < stream.size(); ++index) {
+        std::string chunk;
+        if (!decrypt_record(key, stream, pos, index, chunk)) return false;
+        plain += chunk;
+        sizes.push_back(chunk.size());
+    }
+    return plain.size() == input_size;
+}
+
+int main()
+{
+    char dir[] = "/tmp/aes_gcm_transform_test.XXXXXX";
+    char *dir_ok = mkdtemp(dir);
+    assert(dir_ok);
+    std::string base = dir;
+
+    unsigned char key[AesGcmTransform::key_size];
+    for (size_t i = 0; i < sizeof(key); ++i) key[i] = i * 7 + 1;
+
+    // the key file may hold hex digits
+    std::string key_path = base + "/key";
+    char key_hex[AesGcmTransform::key_size * 2 + 1];
+    hex_encode(key_hex, key, sizeof(key));
+    FILE *kf = fopen(key_path.c_str(), "w");
+    assert(kf);
+    fprintf(kf, "%s\n", key_hex);
+    fclose(kf);
+    unsigned char loaded[AesGcmTransform::key_size];
+    bool loaded_ok = AesGcmTransform::load_key(key_path, loaded);
+    assert(loaded_ok);
+    assert(!memcmp(loaded, key, sizeof(key)));
+
+    // three full chunks and a short one
+    const uint32_t chunk_size = 1000;
+    std::string input;
+    for (int i = 0; i < 3 * 1000 + 337; ++i) input.push_back("abcdefghijklmnopqrstuvwxyz"[i % 26] ^ (i / 26));
+    std::string input_path = base + "/input";
+    int fd = open(input_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    assert(fd >= 0);
+    int written = write_full(fd, input.data(), input.size());
+    assert(written == 0);
+
+    AesGcmTransform aes(key, chunk_size, input.size());
+    bool init_ok = aes.init();
+    assert(init_ok);
+
+    StagingArea staging(base, 0);
+    std::string stream;
+    {
+        TransformPipeline pipeline(staging, fd, 0, input.size(), { &aes }, chunk_size, 1 << 20, 2);
+        StagedFile file;
+        std::string md5;
+        int r = pipeline.next(file, md5);
+        assert(r == 1);
+        stream.resize(file.size());
+        ssize_t n = pread(file.fd(), &stream[0], stream.size(), 0);
+        assert(n == (ssize_t) stream.size());
+        StagedFile rest;
+        r = pipeline.next(rest, md5);
+        assert(r == 0);
+    }
+    close(fd);
+    assert(stream.size() == AesGcmTransform::header_size + 4 * (4 + AesGcmTransform::tag_size) + input.size());
+
+    std::string plain;
+    std::vector<size_t> sizes;
+    bool ok = decrypt_stream(key, stream, chunk_size, plain, sizes);
+    assert(ok);
+    assert(plain == input);
+    assert((sizes == std::vector<size_t>{ 1000, 1000, 1000, 337 }));
+
+    // a flipped byte of a tag, a ciphertext, a length or the header fails
+    size_t second = AesGcmTransform::header_size + 4 + chunk_size + AesGcmTransform::tag_size;
+    const size_t flips[] = {
+        second - 1,
+        second + 4 + 10,
+        stream.size() - AesGcmTransform::tag_size - 1,
+        second + 3,
+        20,
+    };
+    for (size_t pos : flips) {
+        std::string bad = stream;
+        bad[pos] ^= 1;
+        ok = decrypt_stream(key, bad, chunk_size, plain, sizes);
+        assert(!ok);
+    }
+
+    // the wrong key fails
+    unsigned char other[AesGcmTransform::key_size];
+    memcpy(other, key, sizeof(other));
+    other[0] ^= 0x80;
+    ok = decrypt_stream(other, stream, chunk_size, plain, sizes);
+    assert(!ok);
+
+    unlink(key_path.c_str());
+    unlink(input_path.c_str());
+    rmdir(dir);
+    printf("aes_gcm_transform_test: ok\n");
+}
@@ -0,0 +1,89 @@
+#include "aimd.h"
+#include "timeutil.h"
+#include "log.h"
+
+#include <algorithm>
+
+namespace {
+
+constexpr double improvement_factor = 1.05;
+constexpr double decrease_factor = 0.5;
+constexpr double latency_spike_factor = 3.0;
+constexpr double latency_ewma_weight = 0.2;
+
+}
+
+ConcurrencyLimiter::ConcurrencyLimiter(int initial, int max)
+    : limit_(std::max(1, std::min(initial, max))), max_(std::max(1, max))
+{
+    reset_window();
+}
+
+void
+ConcurrencyLimiter::reset_window()
+{
+    window_start_us_ = monotonic_us();
+    window_bytes_ = 0;
+    window_parts_ = 0;
+}
+
+void
+ConcurrencyLimiter::decrease(const char *reason)
+{
+    int old_limit = limit_;
+    limit_ = std::max(1, (int) (limit_ * decrease_factor));
+    ++epoch_;
+    // probe upwards again from the new level
+    prev_mbps_ = 0;
+    reset_window();
+    log_info("concurrency %d -> %d: %s", old_limit, limit_, reason);
+}
+
+uint64_t
+ConcurrencyLimiter::acquire()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return in_flight_ < limit_; });
+    ++in_flight_;
+    return epoch_;
+}
+
+void
+ConcurrencyLimiter::release(uint64_t ticket, off_t bytes, uint64_t duration_us, bool success, bool throttled)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --in_flight_;
+        if (throttled) {
+            if (ticket == epoch_) decrease("throttled");
+        } else if (success && bytes > 0 && duration_us > 0) {
+            double spm = duration_us / 1e6 / (bytes / 1048576.0);
+            if (latency_ewma_ > 0 && spm > latency_ewma_ * latency_spike_factor && ticket == epoch_) {
+                decrease("latency spike");
+            }
+            latency_ewma_ = latency_ewma_ > 0
+                ? latency_ewma_ * (1 - latency_ewma_weight) + spm * latency_ewma_weight
+                : spm;
+
+            window_bytes_ += bytes;
+            if (++window_parts_ >= limit_) {
+                uint64_t now = monotonic_us();
+                double mbps = window_bytes_ / 1048576.0 / ((now - window_start_us_ + 1) / 1e6);
+                if (mbps > prev_mbps_ * improvement_factor && limit_ < max_) {
+                    ++limit_;
+                    log_info("concurrency %d -> %d: %.1f MiB/s", limit_ - 1, limit_, mbps);
+                }
+                prev_mbps_ = mbps;
+                reset_window();
+            }
+        }
+    }
+    cond_.notify_all();
+}
+
+int
+ConcurrencyLimiter::limit() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return limit_;
+}
@@ -0,0 +1,43 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <sys/types.h>
+
+// adaptive limit on the number of parts in flight: the limit grows by one
+// while the aggregate throughput improves from window to window and is
+// halved on throttling or on a latency spike
+class ConcurrencyLimiter
+{
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+
+    int limit_;
+    int max_;
+    int in_flight_ = 0;
+    // decreases caused by parts started before the last decrease are ignored
+    uint64_t epoch_ = 0;
+
+    uint64_t window_start_us_ = 0;
+    uint64_t window_bytes_ = 0;
+    int window_parts_ = 0;
+    double prev_mbps_ = 0;
+    double latency_ewma_ = 0;           // seconds per MiB
+
+    void decrease(const char *reason);
+    void reset_window();
+
+public:
+    ConcurrencyLimiter(int initial, int max);
+
+    ConcurrencyLimiter(const ConcurrencyLimiter &) = delete;
+    ConcurrencyLimiter &operator= (const ConcurrencyLimiter &) = delete;
+
+    // wait for a free slot, returns the ticket to pass to release()
+    uint64_t acquire();
+    void release(uint64_t ticket, off_t bytes, uint64_t duration_us, bool success, bool throttled);
+
+    int limit() const;
+};
@@ -0,0 +1,100 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "aimd.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static const off_t MB = 1024 * 1024;
+
+// complete one full window of parts of 'bytes' each, taking 'ms' of wall time
+// at a steady latency of 1 ms per MiB
+static void
+run_window(ConcurrencyLimiter &limiter, off_t bytes, int ms)
+{
+    std::vector<uint64_t> tickets;
+    for (int i = limiter.limit(); i > 0; --i) {
+        tickets.push_back(limiter.acquire());
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    for (uint64_t ticket : tickets) {
+        limiter.release(ticket, bytes, bytes / MB * 1000, true, false);
+    }
+}
+
+int main()
+{
+    // the limits are clamped to [1, max]
+    assert(ConcurrencyLimiter(0, 4).limit() == 1);
+    assert(ConcurrencyLimiter(10, 4).limit() == 4);
+    assert(ConcurrencyLimiter(3, 0).limit() == 1);
+
+    // additive increase while the throughput improves, capped at max
+    {
+        ConcurrencyLimiter limiter(2, 4);
+        run_window(limiter, MB, 20);
+        assert(limiter.limit() == 3);
+        // the same parts at half the throughput
+        run_window(limiter, MB, 40);
+        assert(limiter.limit() == 3);
+        run_window(limiter, 16 * MB, 20);
+        assert(limiter.limit() == 4);
+        run_window(limiter, 256 * MB, 20);
+        assert(limiter.limit() == 4);
+    }
+
+    // multiplicative decrease on throttling, once per epoch, down to 1
+    {
+        ConcurrencyLimiter limiter(5, 8);
+        uint64_t a = limiter.acquire();
+        uint64_t b = limiter.acquire();
+        limiter.release(a, 0, 0, false, true);
+        assert(limiter.limit() == 2);
+        // b was started before the decrease
+        limiter.release(b, 0, 0, false, true);
+        assert(limiter.limit() == 2);
+        uint64_t c = limiter.acquire();
+        limiter.release(c, 0, 0, false, true);
+        assert(limiter.limit() == 1);
+        c = limiter.acquire();
+        limiter.release(c, 0, 0, false, true);
+        assert(limiter.limit() == 1);
+    }
+
+    // multiplicative decrease on a latency spike
+    {
+        ConcurrencyLimiter limiter(4, 8);
+        for (int i = 0; i < 3; ++i) {
+            uint64_t t = limiter.acquire();
+            limiter.release(t, MB, 1000, true, false);
+        }
+        assert(limiter.limit() == 4);
+        uint64_t t = limiter.acquire();
+        limiter.release(t, MB, 10000, true, false);
+        assert(limiter.limit() == 2);
+    }
+
+    // acquire blocks while the limit is reached
+    {
+        ConcurrencyLimiter limiter(1, 1);
+        uint64_t t = limiter.acquire();
+        std::atomic<bool> acquired{false};
+        std::thread waiter([&] {
+            uint64_t t2 = limiter.acquire();
+            acquired = true;
+            limiter.release(t2, 0, 0, false, false);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        assert(!acquired);
+        limiter.release(t, 0, 0, false, false);
+        waiter.join();
+        assert(acquired);
+    }
+
+    printf("aimd_test: ok\n");
+}
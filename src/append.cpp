@@ -0,0 +1,241 @@
+#include "append.h"
+#include "upload_state.h"
+#include "metrics.h"
+#include "trace.h"
+#include "log.h"
+#include "md5_base64_file.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <openssl/md5.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace {
+
+// the prefix check hashes at most this much of the end of the previous data
+constexpr off_t tail_check_size = 1024*1024;
+
+bool
+md5_update_range(MD5_CTX *ctx, int fd, off_t beg, off_t end)
+{
+    std::string buf(std::min<off_t>(end - beg, 4*1024*1024), 0);
+    while (beg < end) {
+        ssize_t r = pread(fd, &buf[0], std::min<off_t>(buf.size(), end - beg), beg);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            log_error("read failed: %s", r < 0?strerror(errno):"unexpected end of file");
+            return false;
+        }
+        MD5_Update(ctx, buf.data(), r);
+        beg += r;
+    }
+    return true;
+}
+
+bool
+md5_range(int fd, off_t beg, off_t end, std::string &md5)
+{
+    unsigned char digest[MD5_DIGEST_SIZE];
+    if (md5_fd_offsets(fd, beg, end, digest) < 0) return false;
+    md5.assign((const char *) digest, sizeof(digest));
+    return true;
+}
+
+// the previous upload is usable if it is of the same file, the object is
+// still the one uploaded, and the end of the uploaded data is unchanged
+bool
+prefix_usable(
+        const UploadState &st,
+        const std::string &bucket,
+        const std::string &key,
+        int fd,
+        const struct stat &stb,
+        bool verify_prefix,
+        Metrics *metrics)
+{
+    if (st.bucket != bucket || st.key != key || st.size <= 0 || st.parts.empty()) return false;
+    if (st.dev != (uint64_t) stb.st_dev || st.ino != (uint64_t) stb.st_ino) {
+        log_info("append: a different file, uploading it whole");
+        return false;
+    }
+    if (stb.st_size < st.size) {
+        log_info("append: the file shrank, uploading it whole");
+        return false;
+    }
+    if (st.midstate.size() != sizeof(MD5_CTX)) return false;
+
+    std::string md5;
+    if (!md5_range(fd, st.tail_beg, st.size, md5) || md5 != st.tail_md5) {
+        log_info("append: the uploaded data changed, uploading the file whole");
+        return false;
+    }
+    if (verify_prefix) {
+        for (const UploadState::Part &p : st.parts) {
+            trace::Scope ts("md5_fd_offsets");
+            if (!md5_range(fd, p.beg, p.end, md5) || md5 != p.md5) {
+                log_info("append: part at %lld changed, uploading the file whole", (long long) p.beg);
+                return false;
+            }
+        }
+    }
+
+    aws::s3::Result res = aws::s3::head_object(bucket, key);
+    if (metrics) metrics->record_call(res);
+    if (!res.success || res.etag != st.etag || res.content_length != st.size) {
+        log_info("append: s3://%s/%s changed since the last upload, uploading the file whole",
+                 bucket.c_str(), key.c_str());
+        return false;
+    }
+    return true;
+}
+
+}
+
+bool
+upload_append(
+        const UploadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &path,
+        const std::string &state_file,
+        bool verify_prefix)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    auto fail = [fd]() -> bool {
+        close(fd);
+        return false;
+    };
+    struct stat stb;
+    if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode)) {
+        log_error("'%s' is not a regular file", path.c_str());
+        return fail();
+    }
+    // the data beyond this size is left to the next run
+    off_t size = stb.st_size;
+    if (size <= 0) {
+        log_error("'%s' is empty", path.c_str());
+        return fail();
+    }
+
+    UploadState st;
+    st.set_file(state_file);
+    bool reuse = st.load() && prefix_usable(st, bucket, key, fd, stb, verify_prefix, options.metrics);
+    if (reuse && size == st.size) {
+        log_info("append: s3://%s/%s is up to date", bucket.c_str(), key.c_str());
+        close(fd);
+        return true;
+    }
+
+    // a short last part cannot stay in the middle of the object,
+    // it is uploaded again together with the new data
+    std::vector<PartSource> parts;
+    off_t local_beg = 0;
+    if (reuse) {
+        std::string copy_source = bucket + "/" + key;
+        for (size_t i = 0; i < st.parts.size(); ++i) {
+            const UploadState::Part &p = st.parts[i];
+            if (i + 1 == st.parts.size() && p.end - p.beg < s3_min_part_size) break;
+            PartSource ps;
+            ps.copy_source = copy_source;
+            ps.copy_if_match = st.etag;
+            ps.beg = p.beg;
+            ps.end = p.end;
+            ps.md5 = p.md5;
+            parts.push_back(std::move(ps));
+            local_beg = p.end;
+        }
+        plan_parts(parts, fd, std::string(), local_beg, size);
+        if (!check_parts(parts)) {
+            log_info("append: the reused layout is not valid any more, uploading the file whole");
+            parts.clear();
+            reuse = false;
+            local_beg = 0;
+        }
+    }
+    if (!reuse) {
+        plan_parts(parts, fd, std::string(), 0, size);
+        if (!check_parts(parts)) return fail();
+    }
+
+    // the MD5 of the whole file continues from the checkpoint
+    MD5_CTX ctx;
+    off_t hashed = 0;
+    if (reuse) {
+        memcpy(&ctx, st.midstate.data(), sizeof(ctx));
+        hashed = st.size;
+    } else {
+        MD5_Init(&ctx);
+    }
+    {
+        trace::Scope ts("file_md5");
+        if (!md5_update_range(&ctx, fd, hashed, size)) return fail();
+    }
+    std::string midstate((const char *) &ctx, sizeof(ctx));
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, &ctx);
+    char hex[MD5_DIGEST_LENGTH * 2 + 1];
+    hex_encode(hex, digest, MD5_DIGEST_LENGTH);
+    aws::s3::Metadata metadata;
+    metadata.emplace_back("file-md5", hex);
+
+    size_t reused = 0;
+    for (const PartSource &ps : parts) {
+        if (ps.copy_source.length()) ++reused;
+    }
+    log_info("append: %zu parts reused, uploading [%lld, %lld)", reused, (long long) local_beg, (long long) size);
+
+    // the parts are copied only while the object has the recorded ETag,
+    // if it was replaced in the meantime the file is uploaded whole
+    MultipartUpload upload(options, bucket, key);
+    while (1) {
+        if (!upload.create(metadata)) {
+            return fail();
+        }
+        if (upload.upload_parts(parts) && upload.complete()) break;
+        upload.abort();
+        if (!reused || !upload.source_changed()) return fail();
+        log_warning("append: s3://%s/%s has changed since the last upload, uploading the file whole",
+                    bucket.c_str(), key.c_str());
+        parts.clear();
+        plan_parts(parts, fd, std::string(), 0, size);
+        if (!check_parts(parts)) return fail();
+        reused = 0;
+    }
+
+    UploadState next;
+    next.set_file(state_file);
+    next.bucket = bucket;
+    next.key = key;
+    next.etag = upload.etag();
+    next.dev = stb.st_dev;
+    next.ino = stb.st_ino;
+    next.size = size;
+    next.tail_beg = size > tail_check_size?size - tail_check_size:0;
+    next.midstate = midstate;
+    const std::vector<std::string> &md5s = upload.part_md5s();
+    for (size_t i = 0; i < parts.size(); ++i) {
+        UploadState::Part p;
+        p.beg = parts[i].beg;
+        p.end = parts[i].end;
+        p.md5 = parts[i].copy_source.length()?parts[i].md5:md5s[i];
+        next.parts.push_back(std::move(p));
+    }
+    bool ok = md5_range(fd, next.tail_beg, size, next.tail_md5) && next.save();
+    close(fd);
+    if (!ok) {
+        log_warning("append: state not saved, the next upload will be whole");
+    }
+    printf("file_md5: %s\n", hex);
+    return true;
+}
@@ -0,0 +1,21 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "multipart.h"
+
+#include <string>
+
+// upload a file that only grows (logs, WAL archives): the parts of the object
+// uploaded from a shorter version of the file are copied server-side and only
+// the new data is read and uploaded; the state of the previous upload is kept
+// in 'state_file', including the MD5 context of the whole file, so the
+// "file-md5" metadata is extended with the new data only;
+// with verify_prefix all reused parts are hashed and compared
+bool
+upload_append(
+        const UploadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &path,
+        const std::string &state_file,
+        bool verify_prefix);
@@ -1,5 +1,25 @@
 #include "awss3api.h"
 #include "extract_file.h"
+#include "metrics.h"
+#include "multipart.h"
+#include "download.h"
+#include "spool.h"
+#include "sync.h"
+#include "pack.h"
+#include "dedup.h"
+#include "append.h"
+#include "cluster.h"
+#include "aimd.h"
+#include "checksum_cache.h"
+#include "remote_index.h"
+#include "shard.h"
+#include "trace.h"
+#include "staging.h"
+#include "transform.h"
+#include "zstd_transform.h"
+#include "aes_gcm_transform.h"
+#include "qos.h"
+#include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,31 +29,215 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <limits.h>
 #include <vector>
+#include <memory>
+#include <thread>
 
-constexpr off_t part_size = 512*1024*1024;
-constexpr off_t min_part_size = 128*1024*1024;
+#include <openssl/crypto.h>
+
+// parses a byte count with an optional K, M, G or T suffix
+static bool
+parse_size(const char *str, uint64_t *psize)
+{
+    char *eptr = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(str, &eptr, 10);
+    if (errno || eptr == str) return false;
+    int shift = 0;
+    switch (*eptr) {
+    case 'K': case 'k': shift = 10; ++eptr; break;
+    case 'M': case 'm': shift = 20; ++eptr; break;
+    case 'G': case 'g': shift = 30; ++eptr; break;
+    case 'T': case 't': shift = 40; ++eptr; break;
+    }
+    if (*eptr) return false;
+    if (shift && v > (~0ULL >> shift)) return false;
+    *psize = v << shift;
+    return true;
+}
+
+static bool
+parse_int(const char *str, int min_value, int max_value, int *pvalue)
+{
+    char *eptr = NULL;
+    errno = 0;
+    long v = strtol(str, &eptr, 10);
+    if (errno || *eptr || eptr == str || v < min_value || v > max_value) return false;
+    *pvalue = v;
+    return true;
+}
+
+// a source of the copy mode: s3://bucket/key or a local file,
+// optionally followed by @BEG-END selecting the byte range [BEG, END)
+static bool
+add_copy_source(std::vector<PartSource> &parts, const char *arg, std::string &local_dir)
+{
+    std::string spec(arg);
+    off_t beg = 0;
+    off_t end = -1;
+
+    size_t at = spec.rfind('@');
+    if (at != std::string::npos) {
+        long long b = 0, e = 0;
+        int n = 0;
+        if (sscanf(spec.c_str() + at + 1, "%lld-%lld%n", &b, &e, &n) == 2
+            && !spec[at + 1 + n]) {
+            if (b < 0 || e <= b) {
+                log_error("invalid range in '%s'", arg);
+                return false;
+            }
+            beg = b;
+            end = e;
+            spec.erase(at);
+        }
+    }
+
+    if (!strncmp(spec.c_str(), "s3://", 5)) {
+        std::string copy_source = spec.substr(5);
+        size_t slash = copy_source.find('/');
+        if (slash == std::string::npos || !slash || slash + 1 == copy_source.size()) {
+            log_error("invalid object '%s'", arg);
+            return false;
+        }
+        if (end < 0) {
+            aws::s3::Result res = aws::s3::head_object(copy_source.substr(0, slash), copy_source.substr(slash + 1));
+            if (!res.success) {
+                log_error("cannot get size of '%s'", arg);
+                return false;
+            }
+            end = res.content_length;
+        }
+        plan_parts(parts, -1, copy_source, beg, end);
+        return true;
+    }
+
+    int fd = open(spec.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("cannot open '%s': %s", spec.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat stb;
+    if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode)) {
+        log_error("'%s' is not a regular file", spec.c_str());
+        close(fd);
+        return false;
+    }
+    if (end < 0) end = stb.st_size;
+    if (end > stb.st_size) {
+        log_error("range is beyond the end of '%s'", spec.c_str());
+        close(fd);
+        return false;
+    }
+    if (!local_dir.length()) {
+        char dir_buf[PATH_MAX];
+        extract_dirname(dir_buf, sizeof(dir_buf), spec.c_str());
+        local_dir.assign(dir_buf);
+    }
+    plan_parts(parts, fd, std::string(), beg, end);
+    return true;
+}
 
 int main(int argc, char *argv[])
 {
     std::string bucket_name;
+    std::vector<std::string> bucket_names;
     std::string bucket_key;
     std::string input_file;
+    std::string metrics_json_file;
+    std::string metrics_prom_file;
+    std::string trace_file;
+    std::string staging_dir;
+    std::string checksum_cache_dir;
+    std::string index_file;
+    std::string key_prefix;
+    std::string state_file;
+    int workers = 1;
+    int walkers = 4;
+    bool extent_order = false;
+    int shards = 0;
+    std::string shard_manifest_file;
+    int prefix_rate = 0;
+    std::string index_key;
+    std::string member;
+    bool dedup_mode = false;
+    DedupOptions dedup;
+    std::string known_file;
+    std::string append_state_file;
+    bool verify_prefix = false;
+    std::string listen_address;
+    std::string connect_address;
+    std::string token_file;
+    struct qos_settings qos;
+    memset(&qos, 0, sizeof(qos));
+    std::string cgroup_dir;
+    uint64_t staging_budget = 0;
+    int retries = 0;
+    int jobs = 1;
+    int log_rate = 0;
+    bool skip_identical = false;
+    bool adaptive = false;
+    CacheMode cache_mode = CacheMode::keep;
+    int compress_level = 0;
+    std::string encrypt_key_file;
+    int transform_threads = std::thread::hardware_concurrency();
+    SpoolOptions spool;
 
     if (sizeof(off_t) != sizeof(long long)) {
         fprintf(stderr, "long file support disabled\n");
         return 1;
     }
 
+    // copy mode assembles the object from ranges of existing objects and local files,
+    // download mode restores an object into a local file,
+    // daemon mode uploads the files appearing in spool directories,
+    // index mode refreshes the local index of the objects under --key-prefix,
+    // sync mode uploads the new and changed files of a directory tree,
+    // pack mode stores many files as members of one object with an index object,
+    // coordinate mode hands the parts of one file out to the workers on other hosts,
+    // work mode uploads the parts given by a coordinator
+    bool copy_mode = false;
+    bool download_mode = false;
+    bool daemon_mode = false;
+    bool index_mode = false;
+    bool sync_mode = false;
+    bool pack_mode = false;
+    bool coordinate_mode = false;
+    bool work_mode = false;
     int argi = 1;
+    if (argi < argc && !strcmp(argv[argi], "copy")) {
+        copy_mode = true;
+        ++argi;
+    } else if (argi < argc && !strcmp(argv[argi], "download")) {
+        download_mode = true;
+        ++argi;
+    } else if (argi < argc && !strcmp(argv[argi], "daemon")) {
+        daemon_mode = true;
+        ++argi;
+    } else if (argi < argc && !strcmp(argv[argi], "index")) {
+        index_mode = true;
+        ++argi;
+    } else if (argi < argc && !strcmp(argv[argi], "sync")) {
+        sync_mode = true;
+        ++argi;
+    } else if (argi < argc && !strcmp(argv[argi], "pack")) {
+        pack_mode = true;
+        ++argi;
+    } else if (argi < argc && !strcmp(argv[argi], "coordinate")) {
+        coordinate_mode = true;
+        ++argi;
+    } else if (argi < argc && !strcmp(argv[argi], "work")) {
+        work_mode = true;
+        ++argi;
+    }
     while (argi < argc) {
         if (!strcmp(argv[argi], "--bucket")) {
             if (argi + 1 >= argc) {
                 fprintf(stderr, "argument expected after --bucket\n");
                 return 1;
             }
-            bucket_name.assign(argv[argi + 1]);
+            bucket_names.push_back(argv[argi + 1]);
             argi += 2;
         } else if (!strcmp(argv[argi], "--key")) {
             if (argi + 1 >= argc) {
@@ -42,6 +246,342 @@ int main(int argc, char *argv[])
             }
             bucket_key.assign(argv[argi + 1]);
             argi += 2;
+        } else if (!strcmp(argv[argi], "--metrics-json")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --metrics-json\n");
+                return 1;
+            }
+            metrics_json_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--metrics-prom")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --metrics-prom\n");
+                return 1;
+            }
+            metrics_prom_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--trace")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --trace\n");
+                return 1;
+            }
+            trace_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--retries")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --retries\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], 0, 100, &retries)) {
+                fprintf(stderr, "invalid value of --retries\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--log-level")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --log-level\n");
+                return 1;
+            }
+            int level = log_parse_level(argv[argi + 1]);
+            if (level < 0) {
+                fprintf(stderr, "invalid value of --log-level\n");
+                return 1;
+            }
+            log_set_level(level);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--log-rate")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --log-rate\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], 0, 1000000, &log_rate)) {
+                fprintf(stderr, "invalid value of --log-rate\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--page-cache")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --page-cache\n");
+                return 1;
+            }
+            if (!strcmp(argv[argi + 1], "keep")) {
+                cache_mode = CacheMode::keep;
+            } else if (!strcmp(argv[argi + 1], "drop")) {
+                cache_mode = CacheMode::drop;
+            } else if (!strcmp(argv[argi + 1], "direct")) {
+                cache_mode = CacheMode::direct;
+            } else {
+                fprintf(stderr, "invalid value of --page-cache\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--checksum-cache")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --checksum-cache\n");
+                return 1;
+            }
+            checksum_cache_dir.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--index")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --index\n");
+                return 1;
+            }
+            index_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--adaptive")) {
+            adaptive = true;
+            ++argi;
+        } else if (!strcmp(argv[argi], "--skip-identical")) {
+            skip_identical = true;
+            ++argi;
+        } else if (!strcmp(argv[argi], "--jobs")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --jobs\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], 1, 256, &jobs)) {
+                fprintf(stderr, "invalid value of --jobs\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--compress")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --compress\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], 1, 22, &compress_level)) {
+                fprintf(stderr, "invalid value of --compress\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--encrypt-key-file")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --encrypt-key-file\n");
+                return 1;
+            }
+            encrypt_key_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--transform-threads")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --transform-threads\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], 1, 1024, &transform_threads)) {
+                fprintf(stderr, "invalid value of --transform-threads\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--spool")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --spool\n");
+                return 1;
+            }
+            spool.dirs.push_back(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--queue")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --queue\n");
+                return 1;
+            }
+            spool.queue_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--done-dir")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --done-dir\n");
+                return 1;
+            }
+            spool.done_dir.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--key-prefix")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --key-prefix\n");
+                return 1;
+            }
+            key_prefix.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--workers")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --workers\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], 1, 256, &workers)) {
+                fprintf(stderr, "invalid value of --workers\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--walkers")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --walkers\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], 1, 256, &walkers)) {
+                fprintf(stderr, "invalid value of --walkers\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--extent-order")) {
+            extent_order = true;
+            ++argi;
+        } else if (!strcmp(argv[argi], "--shards")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --shards\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], 1, 4096, &shards)) {
+                fprintf(stderr, "invalid value of --shards\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--shard-manifest")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --shard-manifest\n");
+                return 1;
+            }
+            shard_manifest_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--prefix-rate")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --prefix-rate\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], 1, 1000000, &prefix_rate)) {
+                fprintf(stderr, "invalid value of --prefix-rate\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--state")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --state\n");
+                return 1;
+            }
+            state_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--index-key")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --index-key\n");
+                return 1;
+            }
+            index_key.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--member")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --member\n");
+                return 1;
+            }
+            member.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--dedup")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --dedup\n");
+                return 1;
+            }
+            dedup_mode = true;
+            dedup.prefix.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--known")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --known\n");
+                return 1;
+            }
+            known_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--manifest")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --manifest\n");
+                return 1;
+            }
+            dedup.manifest_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--append-state")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --append-state\n");
+                return 1;
+            }
+            append_state_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--listen")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --listen\n");
+                return 1;
+            }
+            listen_address.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--connect")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --connect\n");
+                return 1;
+            }
+            connect_address.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--token-file")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --token-file\n");
+                return 1;
+            }
+            token_file.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--verify-prefix")) {
+            verify_prefix = true;
+            ++argi;
+        } else if (!strcmp(argv[argi], "--probe")) {
+            dedup.probe = true;
+            ++argi;
+        } else if (!strcmp(argv[argi], "--io-priority")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --io-priority\n");
+                return 1;
+            }
+            if (qos_parse_io(argv[argi + 1], &qos) < 0) {
+                fprintf(stderr, "invalid value of --io-priority\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--nice")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --nice\n");
+                return 1;
+            }
+            if (!parse_int(argv[argi + 1], -20, 19, &qos.nice)) {
+                fprintf(stderr, "invalid value of --nice\n");
+                return 1;
+            }
+            qos.nice_set = 1;
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--cpus")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --cpus\n");
+                return 1;
+            }
+            if (qos_parse_cpus(argv[argi + 1], &qos) < 0) {
+                fprintf(stderr, "invalid value of --cpus\n");
+                return 1;
+            }
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--cgroup")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --cgroup\n");
+                return 1;
+            }
+            cgroup_dir.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--staging-dir")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --staging-dir\n");
+                return 1;
+            }
+            staging_dir.assign(argv[argi + 1]);
+            argi += 2;
+        } else if (!strcmp(argv[argi], "--staging-budget")) {
+            if (argi + 1 >= argc) {
+                fprintf(stderr, "argument expected after --staging-budget\n");
+                return 1;
+            }
+            if (!parse_size(argv[argi + 1], &staging_budget)) {
+                fprintf(stderr, "invalid value of --staging-budget\n");
+                return 1;
+            }
+            argi += 2;
         } else if (!strcmp(argv[argi], "--")) {
             ++argi;
             break;
@@ -52,119 +592,465 @@ int main(int argc, char *argv[])
             break;
         }
     }
-    if (argi >= argc) {
+    spool.key_prefix = key_prefix;
+    spool.workers = workers;
+    SyncOptions sync;
+    if (sync_mode) {
+        // sync DIR s3://bucket[/prefix]
+        if (argi + 2 != argc) {
+            fprintf(stderr, "directory and s3://bucket/prefix expected in sync mode\n");
+            return 1;
+        }
+        sync.dir.assign(argv[argi]);
+        const char *target = argv[argi + 1];
+        if (strncmp(target, "s3://", 5) || !target[5] || target[5] == '/') {
+            fprintf(stderr, "invalid target '%s'\n", target);
+            return 1;
+        }
+        std::string bucket(target + 5);
+        size_t slash = bucket.find('/');
+        if (slash != std::string::npos) {
+            sync.prefix = bucket.substr(slash + 1);
+            bucket.erase(slash);
+        }
+        if (!bucket_names.empty()) {
+            fprintf(stderr, "--bucket is not used in sync mode\n");
+            return 1;
+        }
+        bucket_names.push_back(bucket);
+        sync.bucket = bucket;
+        sync.walkers = walkers;
+        sync.workers = workers;
+        sync.extent_order = extent_order;
+        if (!state_file.length() && !index_file.length()) {
+            fprintf(stderr, "--state or --index option is required in sync mode\n");
+            return 1;
+        }
+        argi = argc;
+    } else if (daemon_mode || index_mode) {
+        if (argi < argc) {
+            fprintf(stderr, "no file arguments expected in %s mode\n", daemon_mode?"daemon":"index");
+            return 1;
+        }
+        if (daemon_mode && (spool.dirs.empty() || !spool.queue_file.length())) {
+            fprintf(stderr, "--spool and --queue options are required\n");
+            return 1;
+        }
+        if (index_mode && !index_file.length()) {
+            fprintf(stderr, "--index option is required\n");
+            return 1;
+        }
+    } else if (argi >= argc) {
         fprintf(stderr, "filename expected\n");
         return 1;
     }
-    if (argi + 1 < argc) {
+    if (!copy_mode && !sync_mode && !pack_mode && argi + 1 < argc) {
         fprintf(stderr, "only single file upload supported\n");
         return 1;
     }
-    input_file.assign(argv[argi]);
-
-    if (!bucket_name.length()) {
-        fprintf(stderr, "--bucket option is required");
+    if (work_mode) {
+        // the object is chosen by the coordinator
+        if (!bucket_names.empty() || bucket_key.length()) {
+            fprintf(stderr, "--bucket and --key are not used in work mode\n");
+            return 1;
+        }
+        if (!connect_address.length()) {
+            fprintf(stderr, "--connect option is required in work mode\n");
+            return 1;
+        }
+        bucket_names.push_back(std::string());
+    }
+    if (coordinate_mode && !listen_address.length()) {
+        fprintf(stderr, "--listen option is required in coordinate mode\n");
+        return 1;
     }
-    if (!input_file.length()) {
-        fprintf(stderr, "input file name is required");
+    if ((listen_address.length() && !coordinate_mode) || (connect_address.length() && !work_mode)) {
+        fprintf(stderr, "--listen and --connect are supported only in coordinate and work modes\n");
+        return 1;
     }
-    if (!bucket_key.length()) {
-        bucket_key = input_file;
+    std::string token;
+    if (token_file.length()) {
+        if (!coordinate_mode && !work_mode) {
+            fprintf(stderr, "--token-file is supported only in coordinate and work modes\n");
+            return 1;
+        }
+        if (!load_token(token_file, token)) return 1;
     }
-
-    int fd = open(input_file.c_str(), O_RDONLY, 0);
-    if (fd < 0) {
-        fprintf(stderr, "cannot open '%s': %s\n", input_file.c_str(), strerror(errno));
+    if (bucket_names.empty()) {
+        fprintf(stderr, "--bucket option is required\n");
         return 1;
     }
-    struct stat stb;
-    if (fstat(fd, &stb) < 0) {
-        fprintf(stderr, "fstat failed: %s\n", strerror(errno));
+    bucket_name = bucket_names.front();
+    // several --bucket options fan the upload out to all of them
+    bool fanout = bucket_names.size() > 1;
+    if ((copy_mode || download_mode || pack_mode) && !bucket_key.length()) {
+        fprintf(stderr, "--key option is required\n");
+        return 1;
+    }
+    bool transformed = compress_level > 0 || encrypt_key_file.length() > 0;
+    if (transformed && (copy_mode || download_mode || daemon_mode || index_mode || sync_mode || pack_mode)) {
+        fprintf(stderr, "--compress and --encrypt-key-file are supported only for uploads\n");
+        return 1;
+    }
+    if (fanout && (copy_mode || download_mode || daemon_mode || index_mode || sync_mode || pack_mode || transformed)) {
+        fprintf(stderr, "several --bucket options are supported only for plain file uploads\n");
         return 1;
     }
-    if (!S_ISREG(stb.st_mode)) {
-        fprintf(stderr, "not a regular file\n");
+    if (transformed && skip_identical) {
+        fprintf(stderr, "--skip-identical is incompatible with --compress and --encrypt-key-file\n");
         return 1;
     }
-    if (stb.st_size <= 0) {
-        fprintf(stderr, "empty file\n");
+    if ((known_file.length() || dedup.manifest_file.length() || dedup.probe) && !dedup_mode) {
+        fprintf(stderr, "--known, --manifest and --probe require --dedup\n");
         return 1;
     }
+    if (dedup_mode && (copy_mode || download_mode || daemon_mode || index_mode || sync_mode || pack_mode
+                       || transformed || fanout)) {
+        fprintf(stderr, "--dedup is supported only for plain file uploads\n");
+        return 1;
+    }
+    if (append_state_file.length() && (copy_mode || download_mode || daemon_mode || index_mode || sync_mode
+                                       || pack_mode || transformed || fanout || dedup_mode)) {
+        fprintf(stderr, "--append-state is supported only for plain file uploads\n");
+        return 1;
+    }
+    if (verify_prefix && !append_state_file.length()) {
+        fprintf(stderr, "--verify-prefix requires --append-state\n");
+        return 1;
+    }
+    if ((coordinate_mode || work_mode) && (transformed || fanout || dedup_mode || append_state_file.length()
+                                           || skip_identical)) {
+        fprintf(stderr, "coordinate and work modes support plain uploads only\n");
+        return 1;
+    }
+    if (extent_order && !sync_mode && !pack_mode) {
+        fprintf(stderr, "--extent-order is supported only in sync and pack modes\n");
+        return 1;
+    }
+    if (shards && !sync_mode && !daemon_mode) {
+        fprintf(stderr, "--shards is supported only in sync and daemon modes\n");
+        return 1;
+    }
+    if (shard_manifest_file.length() && !shards) {
+        fprintf(stderr, "--shard-manifest requires --shards\n");
+        return 1;
+    }
+    if (prefix_rate && (download_mode || index_mode)) {
+        fprintf(stderr, "--prefix-rate is supported only for uploads\n");
+        return 1;
+    }
+    if (member.length() && !download_mode) {
+        fprintf(stderr, "--member is supported only in download mode\n");
+        return 1;
+    }
+    if (!index_key.length()) index_key = bucket_key + ".index";
+    if (transform_threads < 1) transform_threads = 1;
 
-    char test_dir[PATH_MAX];
-    extract_dirname(test_dir, sizeof(test_dir), input_file.c_str());
-    fprintf(stderr, "tmpdir: %s\n", test_dir);
-    std::string test_dirs(test_dir);
+    if (daemon_mode) {
+        // blocked in all threads, the daemon receives them through a signalfd
+        sigset_t ss;
+        sigemptyset(&ss);
+        sigaddset(&ss, SIGINT);
+        sigaddset(&ss, SIGTERM);
+        sigprocmask(SIG_BLOCK, &ss, NULL);
+    }
 
-    aws::s3::Result res = aws::s3::create_multipart_upload(bucket_name, bucket_key);
-    printf("res.success: %d\n", res.success);
-    printf("res.bucket: %s\n", res.bucket.c_str());
-    printf("res.key: %s\n", res.key.c_str());
-    printf("res.upload_id: %s\n", res.upload_id.c_str());
-    if (!res.success) {
+    // applied before any thread is started, the threads and the aws children inherit them
+    bool qos_ok = (!cgroup_dir.length() || qos_enter_cgroup(cgroup_dir.c_str()) >= 0) && qos_set(&qos) >= 0;
+
+    log_set_rate_limit(log_rate);
+    log_start();
+    if (!qos_ok) {
+        log_stop();
         return 1;
     }
 
-    std::vector<std::string> parts;
-    off_t cur_beg = 0;
-    off_t end = stb.st_size;
-    int part_number = 0;
+    if (trace_file.length()) {
+        trace::open(trace_file);
+    }
 
-    while (cur_beg < end) {
-        off_t upload_size = 0;
-        if (cur_beg + part_size + min_part_size >= end) {
-            upload_size = end - cur_beg;
-        } else if (cur_beg + part_size >= end) {
-            upload_size = end - cur_beg;
-        } else {
-            upload_size = part_size;
+    // with sharding the requests are accounted per prefix even if not paced
+    std::unique_ptr<PrefixRates> prefix_rates;
+    if (shards || prefix_rate) {
+        prefix_rates.reset(new PrefixRates(prefix_rate));
+    }
+
+    Metrics metrics;
+    metrics.start();
+    auto finish = [&](bool success) -> int {
+        metrics.finish(success);
+        if (prefix_rates) prefix_rates->report();
+        trace::write();
+        if (metrics_json_file.length()) metrics.write_json(metrics_json_file);
+        if (metrics_prom_file.length()) metrics.write_prometheus(metrics_prom_file);
+        log_stop();
+        return success?0:1;
+    };
+
+    if (download_mode) {
+        DownloadOptions options;
+        options.jobs = jobs;
+        options.retries = retries;
+        options.metrics = &metrics;
+        if (member.length()) {
+            return finish(fetch_packed(options, bucket_name, bucket_key, index_key, member, argv[argi]));
         }
-        ++part_number;
+        return finish(download_object(options, bucket_name, bucket_key, argv[argi]));
+    }
 
-        aws::s3::Result res2 = aws::s3::upload_part(bucket_name, bucket_key, res.upload_id, test_dirs,
-                                                    part_number, fd, cur_beg, cur_beg + upload_size);
-        printf("res2.success: %d\n", res2.success);
-        printf("res2.ETag: %s\n", res2.etag.c_str());
-        if (!res2.success) {
-            aws::s3::abort_multipart_upload(bucket_name, bucket_key, res.upload_id);
-            return 1;
+    // the objects completed by this run are added to the index
+    std::unique_ptr<RemoteIndex> remote_index;
+    if (index_file.length()) {
+        remote_index.reset(new RemoteIndex());
+        if (!remote_index->open(index_file)) {
+            return finish(false);
+        }
+        if (index_mode) {
+            return finish(remote_index->refresh(bucket_name, key_prefix, jobs, retries, &metrics));
+        }
+        if (!remote_index->bucket().length()) {
+            log_warning("index %s is empty, run the index mode to fill it", index_file.c_str());
         }
+    }
+    // with --adaptive, --jobs is the upper bound of the parts in flight
+    std::unique_ptr<ConcurrencyLimiter> limiter;
+    if (adaptive) {
+        limiter.reset(new ConcurrencyLimiter(std::min(jobs, 2), jobs));
+    }
 
-        parts.push_back(std::move(res2.etag));
-        cur_beg += upload_size;
+    std::unique_ptr<ChecksumCache> checksum_cache;
+    if (checksum_cache_dir.length()) {
+        checksum_cache.reset(new ChecksumCache(checksum_cache_dir));
     }
 
-    char parts_path_buf[PATH_MAX];
-    int pfd = create_temporary_fd(parts_path_buf, sizeof(parts_path_buf), test_dirs.c_str());
-    if (pfd < 0) {
-        aws::s3::abort_multipart_upload(bucket_name, bucket_key, res.upload_id);
-        return 1;
+    std::unique_ptr<KeySharder> sharder;
+    if (shards) {
+        sharder.reset(new KeySharder(shards));
+        if (shard_manifest_file.length() && !sharder->open_manifest(shard_manifest_file)) {
+            return finish(false);
+        }
     }
-    FILE *pf = fdopen(pfd, "w"); pfd = -1;
-    fprintf(pf, "{\n  \"Parts\": [\n");
-    for (size_t i = 0; i < parts.size(); ++i) {
-        fprintf(pf, "    {\n      \"ETag\": %s,\n      \"PartNumber\": %d\n    }",
-                parts[i].c_str(), (int) i + 1);
-        if (i + 1 < parts.size()) fprintf(pf, ",");
-        fprintf(pf, "\n");
+
+    if (daemon_mode) {
+        if (!staging_dir.length()) staging_dir = spool.dirs.front();
+        StagingArea staging(staging_dir, staging_budget);
+        staging.set_direct(cache_mode == CacheMode::direct);
+        // per-part metrics would grow without bound in a long-running process
+        UploadOptions options;
+        options.jobs = jobs;
+        options.retries = retries;
+        options.skip_identical = skip_identical;
+        options.cache_mode = cache_mode;
+        options.staging = &staging;
+        options.limiter = limiter.get();
+        options.prefix_rates = prefix_rates.get();
+        options.checksum_cache = checksum_cache.get();
+        options.remote_index = remote_index.get();
+        options.sharder = sharder.get();
+        int r = run_spool_daemon(spool, options, bucket_name);
+        return finish(!r);
     }
-    fprintf(pf, "  ]\n}\n");
-    fflush(pf);
-    if (ferror(pf)) {
-        unlink(parts_path_buf);
-        aws::s3::abort_multipart_upload(bucket_name, bucket_key, res.upload_id);
-        return 1;
+
+    if (sync_mode) {
+        std::unique_ptr<SyncState> state;
+        if (state_file.length()) {
+            state.reset(new SyncState());
+            if (!state->open(state_file)) {
+                return finish(false);
+            }
+        }
+        if (!staging_dir.length()) staging_dir = sync.dir;
+        StagingArea staging(staging_dir, staging_budget);
+        staging.set_direct(cache_mode == CacheMode::direct);
+        // per-part metrics of millions of files are not kept
+        UploadOptions options;
+        options.jobs = jobs;
+        options.retries = retries;
+        options.skip_identical = skip_identical;
+        options.cache_mode = cache_mode;
+        options.staging = &staging;
+        options.limiter = limiter.get();
+        options.prefix_rates = prefix_rates.get();
+        options.checksum_cache = checksum_cache.get();
+        options.remote_index = remote_index.get();
+        options.sharder = sharder.get();
+        return finish(run_sync(sync, options, state.get(), remote_index.get()));
     }
-    fclose(pf);
 
-    aws::s3::Result res3 = aws::s3::complete_multipart_upload(bucket_name, bucket_key, res.upload_id, parts_path_buf);
-    printf("res3.success: %d\n", res3.success);
-    if (!res3.success) {
-        aws::s3::abort_multipart_upload(bucket_name, bucket_key, res.upload_id);
-        unlink(parts_path_buf);
+    if (pack_mode) {
+        if (!staging_dir.length()) {
+            char dir_buf[PATH_MAX];
+            extract_dirname(dir_buf, sizeof(dir_buf), argv[argi]);
+            staging_dir.assign(dir_buf);
+        }
+        StagingArea staging(staging_dir, staging_budget);
+        Packer packer(staging, part_size);
+        for (; argi < argc; ++argi) {
+            if (!packer.add(argv[argi], argv[argi])) {
+                return finish(false);
+            }
+        }
+        if (extent_order) packer.order_by_extent();
+        UploadOptions options;
+        options.jobs = jobs;
+        options.retries = retries;
+        options.staging = &staging;
+        options.metrics = &metrics;
+        options.limiter = limiter.get();
+        options.prefix_rates = prefix_rates.get();
+        options.remote_index = remote_index.get();
+        return finish(upload_packed(options, bucket_name, bucket_key, index_key, packer));
+    }
+
+    if (work_mode) {
+        if (!staging_dir.length()) {
+            char dir_buf[PATH_MAX];
+            extract_dirname(dir_buf, sizeof(dir_buf), argv[argi]);
+            staging_dir.assign(dir_buf);
+        }
+        StagingArea staging(staging_dir, staging_budget);
+        staging.set_direct(cache_mode == CacheMode::direct);
+        UploadOptions options;
+        options.jobs = jobs;
+        options.retries = retries;
+        options.cache_mode = cache_mode;
+        options.staging = &staging;
+        options.metrics = &metrics;
+        options.limiter = limiter.get();
+        options.prefix_rates = prefix_rates.get();
+        return finish(run_worker(options, connect_address, token, argv[argi]));
+    }
+
+    std::vector<PartSource> parts;
+    std::string local_dir;
+    if (copy_mode) {
+        for (; argi < argc; ++argi) {
+            if (!add_copy_source(parts, argv[argi], local_dir)) {
+                return 1;
+            }
+        }
+    } else {
+        input_file.assign(argv[argi]);
+        if (!input_file.length()) {
+            fprintf(stderr, "input file name is required\n");
+            return 1;
+        }
+        if (!bucket_key.length()) {
+            bucket_key = input_file;
+        }
+
+        int fd = open(input_file.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            fprintf(stderr, "cannot open '%s': %s\n", input_file.c_str(), strerror(errno));
+            return 1;
+        }
+        struct stat stb;
+        if (fstat(fd, &stb) < 0) {
+            fprintf(stderr, "fstat failed: %s\n", strerror(errno));
+            return 1;
+        }
+        if (!S_ISREG(stb.st_mode)) {
+            fprintf(stderr, "not a regular file\n");
+            return 1;
+        }
+        if (stb.st_size <= 0) {
+            fprintf(stderr, "empty file\n");
+            return 1;
+        }
+
+        char test_dir[PATH_MAX];
+        extract_dirname(test_dir, sizeof(test_dir), input_file.c_str());
+        local_dir.assign(test_dir);
+        plan_parts(parts, fd, std::string(), 0, stb.st_size);
+    }
+    if (!check_parts(parts)) {
         return 1;
     }
-    unlink(parts_path_buf);
 
-    return 0;
+    if (!staging_dir.length()) {
+        // staging next to the input allows reflinks on copy-on-write file systems
+        staging_dir = local_dir;
+    }
+    log_info("tmpdir: %s", staging_dir.c_str());
+    StagingArea staging(staging_dir, staging_budget);
+    staging.set_direct(cache_mode == CacheMode::direct);
+
+    UploadOptions options;
+    options.jobs = jobs;
+    options.retries = retries;
+    options.skip_identical = skip_identical && !copy_mode;
+    options.cache_mode = cache_mode;
+    options.staging = &staging;
+    options.metrics = &metrics;
+    options.limiter = limiter.get();
+    options.checksum_cache = checksum_cache.get();
+    options.remote_index = remote_index.get();
+    options.prefix_rates = prefix_rates.get();
+
+    if (coordinate_mode) {
+        return finish(run_coordinator(options, listen_address, token, bucket_name, bucket_key, parts));
+    }
+
+    // the transformed data is produced part by part while the previous parts are uploaded
+    std::vector<std::unique_ptr<ChunkTransform>> transforms;
+    aws::s3::Metadata metadata;
+    if (compress_level > 0) {
+        transforms.emplace_back(new ZstdTransform(compress_level));
+        metadata.emplace_back("compression", "zstd");
+        metadata.emplace_back("uncompressed-size", std::to_string((long long) parts.back().end));
+    }
+    if (encrypt_key_file.length()) {
+        // encryption goes last, compressed data is encrypted
+        unsigned char key[AesGcmTransform::key_size];
+        if (!AesGcmTransform::load_key(encrypt_key_file, key)) {
+            OPENSSL_cleanse(key, sizeof(key));
+            return finish(false);
+        }
+        AesGcmTransform *aes = new AesGcmTransform(key, transform_chunk_size, parts.back().end);
+        // a plain memset of a buffer not read again may be optimized out
+        OPENSSL_cleanse(key, sizeof(key));
+        transforms.emplace_back(aes);
+        if (!aes->init()) {
+            return finish(false);
+        }
+        metadata.emplace_back("encryption", "aes-256-gcm");
+    }
+    if (!transforms.empty()) {
+        std::vector<ChunkTransform *> chain;
+        for (auto &t : transforms) chain.push_back(t.get());
+        TransformPipeline pipeline(staging, parts.front().fd, 0, parts.back().end, chain,
+                                   transform_chunk_size, part_size, transform_threads);
+        // the transform stage reads through the cache, direct mode drops behind
+        pipeline.set_drop_behind(cache_mode != CacheMode::keep);
+        MultipartUpload upload(options, bucket_name, bucket_key);
+        if (!upload.create(metadata)) {
+            return finish(false);
+        }
+        auto next = [&pipeline](StagedFile &file, std::string &md5) { return pipeline.next(file, md5); };
+        if (!upload.upload_stream(next) || !upload.complete()) {
+            upload.abort();
+            return finish(false);
+        }
+        log_info("transformed %llu bytes into %llu bytes",
+                 (unsigned long long) pipeline.input_bytes(), (unsigned long long) pipeline.output_bytes());
+        return finish(true);
+    }
+
+    if (append_state_file.length()) {
+        return finish(upload_append(options, bucket_name, bucket_key, input_file, append_state_file, verify_prefix));
+    }
+    if (fanout) {
+        return finish(upload_fanout(options, bucket_names, bucket_key, parts));
+    }
+    if (dedup_mode) {
+        KnownSet known;
+        if (known_file.length()) {
+            if (!known.open(known_file)) {
+                return finish(false);
+            }
+            dedup.known = &known;
+        }
+        return finish(upload_dedup(options, dedup, bucket_name, bucket_key, parts));
+    }
+    return finish(upload_object(options, bucket_name, bucket_key, parts));
 }
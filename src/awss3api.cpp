@@ -2,19 +2,345 @@
 #include "subprocess.h"
 #include "md5_base64_file.h"
 #include "extract_file.h"
+#include "staging.h"
+#include "timeutil.h"
+#include "trace.h"
+#include "log.h"
 
-#include <rapidjson/document.h>
+#include <rapidjson/reader.h>
 #include <rapidjson/error/en.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+namespace {
+
+// a field of the aws JSON output to be stored into Result;
+// 'object' is the enclosing top-level member for nested fields
+struct FieldDesc
+{
+    const char *object;
+    const char *name;
+    std::string aws::s3::Result::*string_field;
+    int64_t aws::s3::Result::*int_field;
+};
+
+constexpr FieldDesc create_multipart_upload_fields[] =
+{
+    { nullptr, "Bucket", &aws::s3::Result::bucket },
+    { nullptr, "Key", &aws::s3::Result::key },
+    { nullptr, "UploadId", &aws::s3::Result::upload_id },
+};
+
+constexpr FieldDesc complete_multipart_upload_fields[] =
+{
+    { nullptr, "Bucket", &aws::s3::Result::bucket },
+    { nullptr, "Key", &aws::s3::Result::key },
+    { nullptr, "Location", &aws::s3::Result::location },
+    { nullptr, "ETag", &aws::s3::Result::etag },
+};
+
+constexpr FieldDesc upload_part_fields[] =
+{
+    { nullptr, "ETag", &aws::s3::Result::etag },
+};
+
+constexpr FieldDesc upload_part_copy_fields[] =
+{
+    { "CopyPartResult", "ETag", &aws::s3::Result::etag },
+};
+
+constexpr FieldDesc head_object_fields[] =
+{
+    { nullptr, "ETag", &aws::s3::Result::etag },
+    { nullptr, "ContentLength", nullptr, &aws::s3::Result::content_length },
+};
+
+bool
+name_equal(const char *name, const char *str, rapidjson::SizeType len)
+{
+    return !strncmp(name, str, len) && !name[len];
+}
+
+// SAX handler storing the described fields directly into Result,
+// all other values are skipped without building a DOM
+class FieldDecoder : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, FieldDecoder>
+{
+    const FieldDesc *fields_;
+    size_t count_;
+    aws::s3::Result &res_;
+
+    int depth_ = 0;
+    const char *object_ = nullptr;      // current top-level object member
+    rapidjson::SizeType object_len_ = 0;
+    const char *key_ = nullptr;         // last top-level key
+    rapidjson::SizeType key_len_ = 0;
+    int pending_ = -1;                  // field expected as the next value
+
+public:
+    uint32_t found = 0;
+
+    FieldDecoder(const FieldDesc *fields, size_t count, aws::s3::Result &res)
+        : fields_(fields), count_(count), res_(res)
+    {
+    }
+
+    bool Default()
+    {
+        pending_ = -1;
+        return true;
+    }
+    bool String(const char *str, rapidjson::SizeType len, bool)
+    {
+        if (pending_ >= 0 && fields_[pending_].string_field) {
+            (res_.*(fields_[pending_].string_field)).assign(str, len);
+            found |= 1U << pending_;
+        }
+        pending_ = -1;
+        return true;
+    }
+    bool Int64(int64_t value)
+    {
+        if (pending_ >= 0 && fields_[pending_].int_field) {
+            res_.*(fields_[pending_].int_field) = value;
+            found |= 1U << pending_;
+        }
+        pending_ = -1;
+        return true;
+    }
+    bool Int(int value) { return Int64(value); }
+    bool Uint(unsigned value) { return Int64(value); }
+    bool Uint64(uint64_t value) { return Int64(value); }
+    bool Key(const char *str, rapidjson::SizeType len, bool)
+    {
+        pending_ = -1;
+        if (depth_ == 1) {
+            key_ = str;
+            key_len_ = len;
+        }
+        if (depth_ != 1 && (depth_ != 2 || !object_)) return true;
+        for (size_t i = 0; i < count_; ++i) {
+            const FieldDesc &fd = fields_[i];
+            if (depth_ == 1 && fd.object) continue;
+            if (depth_ == 2 && (!fd.object || !name_equal(fd.object, object_, object_len_))) continue;
+            if (name_equal(fd.name, str, len)) {
+                pending_ = i;
+                break;
+            }
+        }
+        return true;
+    }
+    bool StartObject()
+    {
+        pending_ = -1;
+        if (depth_ == 1) {
+            object_ = key_;
+            object_len_ = key_len_;
+        }
+        ++depth_;
+        return true;
+    }
+    bool EndObject(rapidjson::SizeType)
+    {
+        --depth_;
+        if (depth_ == 1) object_ = nullptr;
+        return true;
+    }
+    bool StartArray()
+    {
+        pending_ = -1;
+        if (depth_ == 1) object_ = nullptr;
+        ++depth_;
+        return true;
+    }
+    bool EndArray(rapidjson::SizeType)
+    {
+        --depth_;
+        return true;
+    }
+};
+
+// parses the output in place in a single pass, the reader (and its parse stack)
+// is kept per thread so repeated calls do not allocate
+template <size_t N>
+bool
+decode_fields(std::string &output, const FieldDesc (&fields)[N], aws::s3::Result &res)
+{
+    static_assert(N <= 32, "too many fields");
+    thread_local rapidjson::Reader reader;
+
+    trace::Scope tp("json_parse");
+    FieldDecoder decoder(fields, N, res);
+    rapidjson::InsituStringStream is(&output[0]);
+    rapidjson::ParseResult pr = reader.Parse<rapidjson::kParseInsituFlag>(is, decoder);
+    if (!pr) {
+        res.message = "json parse failed";
+        res.errors = rapidjson::GetParseError_En(pr.Code());
+        return false;
+    }
+    for (size_t i = 0; i < N; ++i) {
+        if (!(decoder.found & (1U << i))) {
+            res.message = "json parse failed";
+            res.errors = std::string("'") + fields[i].name + "' field is missing or not "
+                + (fields[i].string_field?"String":"Number");
+            return false;
+        }
+    }
+    return true;
+}
+
+// "2024-05-01T12:34:56+00:00" or "2024-05-01T12:34:56.000Z", always UTC
+int64_t
+parse_timestamp(const char *str, size_t len)
+{
+    std::string s(str, len);
+    struct tm tt = {};
+    if (sscanf(s.c_str(), "%d-%d-%dT%d:%d:%d", &tt.tm_year, &tt.tm_mon, &tt.tm_mday,
+               &tt.tm_hour, &tt.tm_min, &tt.tm_sec) != 6) {
+        return 0;
+    }
+    tt.tm_year -= 1900;
+    tt.tm_mon -= 1;
+    return timegm(&tt);
+}
+
+// SAX handler of the list-objects-v2 output: the members of the objects
+// of the top-level "Contents" array and the "IsTruncated" flag
+class ListDecoder : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, ListDecoder>
+{
+    enum { NONE, KEY, SIZE, ETAG, MTIME, TRUNCATED };
+
+    std::vector<aws::s3::ObjectInfo> &objects_;
+    int depth_ = 0;
+    bool contents_key_ = false;         // "Contents" is the last top-level key
+    bool in_contents_ = false;
+    int pending_ = NONE;
+
+public:
+    bool truncated = false;
+
+    explicit ListDecoder(std::vector<aws::s3::ObjectInfo> &objects)
+        : objects_(objects)
+    {
+    }
+
+    bool Default()
+    {
+        pending_ = NONE;
+        return true;
+    }
+    bool String(const char *str, rapidjson::SizeType len, bool)
+    {
+        if (pending_ == KEY) objects_.back().key.assign(str, len);
+        else if (pending_ == ETAG) objects_.back().etag.assign(str, len);
+        else if (pending_ == MTIME) objects_.back().mtime = parse_timestamp(str, len);
+        pending_ = NONE;
+        return true;
+    }
+    bool Int64(int64_t value)
+    {
+        if (pending_ == SIZE) objects_.back().size = value;
+        pending_ = NONE;
+        return true;
+    }
+    bool Int(int value) { return Int64(value); }
+    bool Uint(unsigned value) { return Int64(value); }
+    bool Uint64(uint64_t value) { return Int64(value); }
+    bool Bool(bool value)
+    {
+        if (pending_ == TRUNCATED) truncated = value;
+        pending_ = NONE;
+        return true;
+    }
+    bool Key(const char *str, rapidjson::SizeType len, bool)
+    {
+        pending_ = NONE;
+        if (depth_ == 1) {
+            contents_key_ = name_equal("Contents", str, len);
+            if (name_equal("IsTruncated", str, len)) pending_ = TRUNCATED;
+        } else if (depth_ == 3 && in_contents_) {
+            if (name_equal("Key", str, len)) pending_ = KEY;
+            else if (name_equal("Size", str, len)) pending_ = SIZE;
+            else if (name_equal("ETag", str, len)) pending_ = ETAG;
+            else if (name_equal("LastModified", str, len)) pending_ = MTIME;
+        }
+        return true;
+    }
+    bool StartObject()
+    {
+        pending_ = NONE;
+        ++depth_;
+        if (depth_ == 3 && in_contents_) objects_.emplace_back();
+        return true;
+    }
+    bool EndObject(rapidjson::SizeType)
+    {
+        --depth_;
+        return true;
+    }
+    bool StartArray()
+    {
+        pending_ = NONE;
+        if (depth_ == 1 && contents_key_) in_contents_ = true;
+        ++depth_;
+        return true;
+    }
+    bool EndArray(rapidjson::SizeType)
+    {
+        --depth_;
+        if (depth_ == 1) in_contents_ = false;
+        return true;
+    }
+};
+
+}
+
+// the copy source is sent URL-encoded, the '/' separating the bucket and the
+// key and the ones within the key are kept
+static std::string
+encode_copy_source(const std::string &copy_source)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(copy_source.size());
+    for (unsigned char c : copy_source) {
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+            || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+            out.push_back(c);
+        } else {
+            out.push_back('%');
+            out.push_back(digits[c >> 4]);
+            out.push_back(digits[c & 15]);
+        }
+    }
+    return out;
+}
+
+static void
+collect_stats(aws::s3::Result &res, const Subprocess &sp)
+{
+    res.stats.spawn_us += sp.spawn_us();
+    res.stats.transfer_us += sp.run_us() - sp.spawn_us();
+    res.stats.utime_ms += sp.utime_ms();
+    res.stats.stime_ms += sp.stime_ms();
+    if (sp.maxrss_kb() > res.stats.maxrss_kb) res.stats.maxrss_kb = sp.maxrss_kb();
+    res.stats.nvcsw += sp.nvcsw();
+    res.stats.nivcsw += sp.nivcsw();
+    ++res.stats.children;
+}
 
 aws::s3::Result
 aws::s3::create_multipart_upload(
         const std::string &bucket,
-        const std::string &key)
+        const std::string &key,
+        const Metadata &metadata)
 {
     Subprocess sp;
     Result res;
@@ -22,44 +348,39 @@ aws::s3::create_multipart_upload(
 
     sp.set_cmd("aws");
     sp.add_args({ "s3api", "create-multipart-upload", "--bucket", bucket, "--key", key });
-    if (!sp.run_and_wait()) {
+    if (!metadata.empty()) {
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+        writer.StartObject();
+        for (const auto &p : metadata) {
+            writer.Key(p.first.c_str(), p.first.size());
+            writer.String(p.second.c_str(), p.second.size());
+        }
+        writer.EndObject();
+        sp.add_args({ "--metadata", std::string(sb.GetString(), sb.GetSize()) });
+    }
+    bool ok;
+    {
+        trace::Scope ts("create_multipart_upload");
+        ok = sp.run_and_wait();
+    }
+    collect_stats(res, sp);
+    if (!ok) {
         res.message = "aws s3 execution failed";
         res.errors = sp.move_error();
-        fprintf(stderr, "errors: <%s>\n", res.errors.c_str());
+        log_error("%s: %s", res.message.c_str(), res.errors.c_str());
         return res;
     }
 
-    fprintf(stderr, "output: <%s>\n", csp.output().c_str());
-    fprintf(stderr, "error: <%s>\n", csp.error().c_str());
-
-    rapidjson::Document document;
-    rapidjson::ParseResult pr = document.Parse(csp.output().c_str());
-    if (!pr) {
-        res.message = "json parse failed";
-        res.errors = rapidjson::GetParseError_En(pr.Code());
-        return res;
-    }
+    log_debug("output: <%s>", csp.output().c_str());
+    log_debug("error: <%s>", csp.error().c_str());
 
-    if (!document.HasMember("Bucket") || !document["Bucket"].IsString()) {
-        res.message = "json parse failed";
-        res.errors = "'Bucket' field is missing or not String";
-        return res;
-    }
-    if (!document.HasMember("Key") || !document["Key"].IsString()) {
-        res.message = "json parse failed";
-        res.errors = "'Key' field is missing or not String";
-        return res;
-    }
-    if (!document.HasMember("UploadId") || !document["UploadId"].IsString()) {
-        res.message = "json parse failed";
-        res.errors = "'UploadId' field is missing or not String";
+    std::string output = sp.move_output();
+    if (!decode_fields(output, create_multipart_upload_fields, res)) {
         return res;
     }
 
     res.success = true;
-    res.bucket = document["Bucket"].GetString();
-    res.key = document["Key"].GetString();
-    res.upload_id = document["UploadId"].GetString();
 
     return res;
 }
@@ -75,15 +396,21 @@ aws::s3::abort_multipart_upload(
     const Subprocess &csp = sp;
 
     sp.set_cmd({ "aws", "s3api", "abort-multipart-upload", "--bucket", bucket, "--key", key, "--upload-id", upload_id });
-    if (!sp.run_and_wait()) {
+    bool ok;
+    {
+        trace::Scope ts("abort_multipart_upload");
+        ok = sp.run_and_wait();
+    }
+    collect_stats(res, sp);
+    if (!ok) {
         res.message = "aws s3 execution failed";
         res.errors = sp.move_error();
-        fprintf(stderr, "errors: <%s>\n", res.errors.c_str());
+        log_error("%s: %s", res.message.c_str(), res.errors.c_str());
         return res;
     }
 
-    fprintf(stderr, "output: <%s>\n", csp.output().c_str());
-    fprintf(stderr, "error: <%s>\n", csp.error().c_str());
+    log_debug("output: <%s>", csp.output().c_str());
+    log_debug("error: <%s>", csp.error().c_str());
     res.success = true;
     return res;
 }
@@ -93,141 +420,401 @@ aws::s3::complete_multipart_upload(
         const std::string &bucket,
         const std::string &key,
         const std::string &upload_id,
-        const std::string &multipart_upload_file)
+        const std::vector<std::string> &etags)
 {
     Result res;
     Subprocess sp;
     const Subprocess &csp = sp;
-    std::string upload_url = std::string("file://") + multipart_upload_file;
 
-    sp.set_cmd({ "aws", "s3api", "complete-multipart-upload", "--bucket", bucket, "--key", key, "--upload-id", upload_id, "--multipart-upload", upload_url });
+    // the parts document is passed through stdin, it may be too long for a command line argument
+    // an ETag is 34 characters with quotes, the rest is the JSON markup
+    rapidjson::StringBuffer sb(nullptr, etags.size() * 64 + 32);
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+    writer.StartObject();
+    writer.Key("Parts");
+    writer.StartArray();
+    for (size_t i = 0; i < etags.size(); ++i) {
+        writer.StartObject();
+        writer.Key("ETag");
+        writer.String(etags[i].c_str(), etags[i].size());
+        writer.Key("PartNumber");
+        writer.Int(i + 1);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
 
-    if (!sp.run_and_wait()) {
+    sp.set_cmd({ "aws", "s3api", "complete-multipart-upload", "--bucket", bucket, "--key", key, "--upload-id", upload_id, "--multipart-upload", "file:///dev/stdin" });
+    sp.set_input(std::string(sb.GetString(), sb.GetSize()));
+
+    bool ok;
+    {
+        trace::Scope ts("complete_multipart_upload");
+        ok = sp.run_and_wait();
+    }
+    collect_stats(res, sp);
+    if (!ok) {
         res.message = "aws s3 execution failed";
         res.errors = sp.move_error();
-        fprintf(stderr, "errors: <%s>\n", res.errors.c_str());
+        log_error("%s: %s", res.message.c_str(), res.errors.c_str());
         return res;
     }
 
-    fprintf(stderr, "output: <%s>\n", csp.output().c_str());
-    fprintf(stderr, "error: <%s>\n", csp.error().c_str());
+    log_debug("output: <%s>", csp.output().c_str());
+    log_debug("error: <%s>", csp.error().c_str());
 
-    rapidjson::Document document;
-    rapidjson::ParseResult pr = document.Parse(csp.output().c_str());
-    if (!pr) {
-        res.message = "json parse failed";
-        res.errors = rapidjson::GetParseError_En(pr.Code());
+    std::string output = sp.move_output();
+    if (!decode_fields(output, complete_multipart_upload_fields, res)) {
         return res;
     }
 
-    if (!document.HasMember("Bucket") || !document["Bucket"].IsString()) {
-        res.message = "json parse failed";
-        res.errors = "'Bucket' field is missing or not String";
-        return res;
+    res.success = true;
+
+    return res;
+}
+
+aws::s3::Result
+aws::s3::upload_part(
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &upload_id,
+        StagingArea &staging,
+        int part_number,
+        int fd,
+        off_t beg,
+        off_t end,
+        const std::string &md5)
+{
+    Result res;
+
+    uint64_t t0 = monotonic_us();
+    std::string md5_bin(md5);
+    if (md5_bin.size() != MD5_DIGEST_SIZE) {
+        unsigned char digest[MD5_DIGEST_SIZE];
+        trace::Scope ts("md5_fd_offsets", part_number);
+        if (md5_fd_offsets(fd, beg, end, digest) < 0) {
+            res.message = "md5 computation failed";
+            return res;
+        }
+        md5_bin.assign((const char *) digest, sizeof(digest));
     }
-    if (!document.HasMember("Key") || !document["Key"].IsString()) {
-        res.message = "json parse failed";
-        res.errors = "'Key' field is missing or not String";
+    res.stats.hash_us = monotonic_us() - t0;
+
+    t0 = monotonic_us();
+    StagedFile staged;
+    {
+        trace::Scope ts("extract_file_fd", part_number);
+        if (!staging.stage(staged, fd, beg, end)) {
+            res.message = "staging failed";
+            return res;
+        }
+    }
+    res.stats.stage_us = monotonic_us() - t0;
+
+    log_debug("temporary: %s", staged.path().c_str());
+
+    Result res2 = upload_part_file(bucket, key, upload_id, part_number, staged.path(), end - beg, md5_bin);
+    res2.stats.hash_us = res.stats.hash_us;
+    res2.stats.stage_us = res.stats.stage_us;
+    return res2;
+}
+
+aws::s3::Result
+aws::s3::upload_part_file(
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &upload_id,
+        int part_number,
+        const std::string &path,
+        off_t size,
+        const std::string &md5)
+{
+    char b64buf[64];
+    Result res;
+    Subprocess sp;
+    const Subprocess &csp = sp;
+
+    if (md5.size() != MD5_DIGEST_SIZE) {
+        res.message = "invalid md5";
         return res;
     }
-    if (!document.HasMember("Location") || !document["Location"].IsString()) {
-        res.message = "json parse failed";
-        res.errors = "'Location' field is missing or not String";
+    md5_digest_base64((const unsigned char *) md5.data(), b64buf, sizeof(b64buf));
+    std::string content_length_str = std::to_string(static_cast<long long>(size));
+    std::string part_number_str = std::to_string(part_number);
+
+    sp.set_cmd({ "aws", "s3api", "upload-part",
+                "--bucket", bucket,
+                "--key", key,
+                "--upload-id", upload_id,
+                "--part-number", part_number_str,
+                "--content-length", content_length_str,
+                "--content-md5", b64buf,
+                "--body", path });
+    bool ok;
+    {
+        trace::Scope ts("transfer", part_number);
+        ok = sp.run_and_wait();
+    }
+    collect_stats(res, sp);
+    if (!ok) {
+        res.message = "aws s3 execution failed";
+        res.errors = sp.move_error();
+        log_error("%s: %s", res.message.c_str(), res.errors.c_str());
         return res;
     }
-    if (!document.HasMember("ETag") || !document["ETag"].IsString()) {
-        res.message = "json parse failed";
-        res.errors = "'ETag' field is missing or not String";
+
+    log_debug("output: <%s>", csp.output().c_str());
+    log_debug("error: <%s>", csp.error().c_str());
+
+    std::string output = sp.move_output();
+    if (!decode_fields(output, upload_part_fields, res)) {
         return res;
     }
 
     res.success = true;
-    res.bucket = document["Bucket"].GetString();
-    res.key = document["Key"].GetString();
-    res.location = document["Location"].GetString();
-    res.etag = document["ETag"].GetString();
 
     return res;
 }
 
 aws::s3::Result
-aws::s3::upload_part(
+aws::s3::upload_part_copy(
         const std::string &bucket,
         const std::string &key,
         const std::string &upload_id,
-        const std::string &tmp_dir,
         int part_number,
-        int fd,
+        const std::string &copy_source,
         off_t beg,
-        off_t end)
+        off_t end,
+        const std::string &if_match)
 {
-    char b64buf[64];
-    std::string content_length_str;
-    std::string part_number_str;
     Result res;
     Subprocess sp;
     const Subprocess &csp = sp;
 
-    if (md5_base64_fd_offsets(fd, beg, end, b64buf, sizeof(b64buf)) < 0) {
+    // HTTP ranges are inclusive
+    std::string range_str = "bytes=" + std::to_string(static_cast<long long>(beg)) + "-"
+        + std::to_string(static_cast<long long>(end - 1));
+
+    sp.set_cmd({ "aws", "s3api", "upload-part-copy",
+                "--bucket", bucket,
+                "--key", key,
+                "--upload-id", upload_id,
+                "--part-number", std::to_string(part_number),
+                "--copy-source", encode_copy_source(copy_source),
+                "--copy-source-range", range_str });
+    if (if_match.length()) {
+        sp.add_args({ "--copy-source-if-match", if_match });
+    }
+    bool ok;
+    {
+        trace::Scope ts("transfer", part_number);
+        ok = sp.run_and_wait();
+    }
+    collect_stats(res, sp);
+    if (!ok) {
+        res.message = "aws s3 execution failed";
+        res.errors = sp.move_error();
+        log_error("%s: %s", res.message.c_str(), res.errors.c_str());
         return res;
     }
-    content_length_str = std::to_string(static_cast<long long>(end - beg));
-    part_number_str = std::to_string(part_number);
 
-    char tmp_name_buf[PATH_MAX];
-    int tfd = create_temporary_fd(tmp_name_buf, sizeof(tmp_name_buf), tmp_dir.c_str());
-    if (tfd < 0) {
-      return res;
-    }
-    if (extract_file_fd(tfd, fd, beg, end) < 0) {
-        close(tfd);
-        unlink(tmp_name_buf);
+    log_debug("output: <%s>", csp.output().c_str());
+    log_debug("error: <%s>", csp.error().c_str());
+
+    std::string output = sp.move_output();
+    if (!decode_fields(output, upload_part_copy_fields, res)) {
         return res;
     }
-    close(tfd); tfd = -1;
 
-    fprintf(stderr, "temporary: %s\n", tmp_name_buf);
+    res.success = true;
 
-    sp.set_cmd({ "aws", "s3api", "upload-part",
-                "--bucket", bucket,
-                "--key", key,
-                "--upload-id", upload_id,
-                "--part-number", part_number_str,
-                "--content-length", content_length_str,
-                "--content-md5", b64buf,
-                "--body", tmp_name_buf });
-    sp.set_input_file_range(fd, beg, end);
-    if (!sp.run_and_wait()) {
+    return res;
+}
+
+aws::s3::Result
+aws::s3::head_object(
+        const std::string &bucket,
+        const std::string &key,
+        int part_number)
+{
+    Result res;
+    Subprocess sp;
+    const Subprocess &csp = sp;
+
+    sp.set_cmd({ "aws", "s3api", "head-object", "--bucket", bucket, "--key", key });
+    if (part_number > 0) {
+        sp.add_args({ "--part-number", std::to_string(part_number) });
+    }
+    bool ok;
+    {
+        trace::Scope ts("head_object");
+        ok = sp.run_and_wait();
+    }
+    collect_stats(res, sp);
+    if (!ok) {
         res.message = "aws s3 execution failed";
         res.errors = sp.move_error();
-        fprintf(stderr, "errors: <%s>\n", res.errors.c_str());
-        unlink(tmp_name_buf);
+        log_error("%s: %s", res.message.c_str(), res.errors.c_str());
         return res;
     }
 
-    fprintf(stderr, "output: <%s>\n", csp.output().c_str());
-    fprintf(stderr, "error: <%s>\n", csp.error().c_str());
+    log_debug("output: <%s>", csp.output().c_str());
+    log_debug("error: <%s>", csp.error().c_str());
 
-    rapidjson::Document document;
-    rapidjson::ParseResult pr = document.Parse(csp.output().c_str());
-    if (!pr) {
-        res.message = "json parse failed";
-        res.errors = rapidjson::GetParseError_En(pr.Code());
-        unlink(tmp_name_buf);
+    std::string output = sp.move_output();
+    if (!decode_fields(output, head_object_fields, res)) {
         return res;
     }
 
-    if (!document.HasMember("ETag") || !document["ETag"].IsString()) {
-        res.message = "json parse failed";
-        res.errors = "'Bucket' field is missing or not String";
-        unlink(tmp_name_buf);
+    res.success = true;
+    res.bucket = bucket;
+    res.key = key;
+
+    return res;
+}
+
+aws::s3::Result
+aws::s3::get_object_range(
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &if_match,
+        off_t beg,
+        off_t end,
+        std::function<bool(const char *, size_t)> sink)
+{
+    Result res;
+    Subprocess sp;
+    const Subprocess &csp = sp;
+
+    // the body goes to stdout before the JSON response, so the first
+    // end - beg bytes of the output are the data
+    std::string range = "bytes=" + std::to_string((long long) beg) + "-" + std::to_string((long long) end - 1);
+    sp.set_cmd({ "aws", "s3api", "get-object", "--bucket", bucket, "--key", key, "--range", range });
+    if (if_match.length()) {
+        sp.add_args({ "--if-match", if_match });
+    }
+    sp.add_arg("/dev/stdout");
+    sp.set_output_sink(std::move(sink), end - beg);
+    bool ok;
+    {
+        trace::Scope ts("transfer");
+        ok = sp.run_and_wait();
+    }
+    collect_stats(res, sp);
+    if (!ok) {
+        res.message = "aws s3 execution failed";
+        res.errors = sp.move_error();
+        log_error("%s: %s", res.message.c_str(), res.errors.c_str());
+        return res;
+    }
+    if (!sp.output_sink_complete()) {
+        res.message = "short or unaccepted body";
+        log_error("%s: %s", res.message.c_str(), range.c_str());
+        return res;
+    }
+
+    log_debug("output: <%s>", csp.output().c_str());
+    log_debug("error: <%s>", csp.error().c_str());
+
+    std::string output = sp.move_output();
+    if (!decode_fields(output, head_object_fields, res)) {
+        return res;
+    }
+    if (res.content_length != end - beg) {
+        res.message = "unexpected content length";
+        log_error("%s: %lld instead of %lld", res.message.c_str(), (long long) res.content_length, (long long) (end - beg));
         return res;
     }
 
     res.success = true;
-    res.etag = document["ETag"].GetString();
 
-    unlink(tmp_name_buf);
+    return res;
+}
+
+bool
+aws::s3::throttled(const Result &res)
+{
+    if (res.success) return false;
+    static const char * const markers[] = { "SlowDown", "(503)", "ServiceUnavailable", "RequestLimitExceeded", "Throttling" };
+    for (const char *m : markers) {
+        if (res.errors.find(m) != std::string::npos) return true;
+    }
+    return false;
+}
+
+bool
+aws::s3::precondition_failed(const Result &res)
+{
+    if (res.success) return false;
+    return res.errors.find("PreconditionFailed") != std::string::npos
+        || res.errors.find("(412)") != std::string::npos;
+}
+
+aws::s3::Result
+aws::s3::list_objects_page(
+        const std::string &bucket,
+        const std::string &prefix,
+        const std::string &start_after,
+        int max_keys,
+        std::vector<ObjectInfo> &objects,
+        bool *ptruncated)
+{
+    Result res;
+    Subprocess sp;
+    const Subprocess &csp = sp;
+
+    *ptruncated = false;
+    // a single request, the pagination is driven by the caller
+    sp.set_cmd({ "aws", "s3api", "list-objects-v2", "--bucket", bucket,
+                "--max-keys", std::to_string(max_keys), "--no-paginate" });
+    if (prefix.length()) {
+        sp.add_args({ "--prefix", prefix });
+    }
+    if (start_after.length()) {
+        sp.add_args({ "--start-after", start_after });
+    }
+    bool ok;
+    {
+        trace::Scope ts("list_objects");
+        ok = sp.run_and_wait();
+    }
+    collect_stats(res, sp);
+    if (!ok) {
+        res.message = "aws s3 execution failed";
+        res.errors = sp.move_error();
+        log_error("%s: %s", res.message.c_str(), res.errors.c_str());
+        return res;
+    }
+
+    log_debug("error: <%s>", csp.error().c_str());
+
+    std::string output = sp.move_output();
+    size_t first = objects.size();
+    {
+        thread_local rapidjson::Reader reader;
+        trace::Scope tp("json_parse");
+        ListDecoder decoder(objects);
+        rapidjson::InsituStringStream is(&output[0]);
+        rapidjson::ParseResult pr = reader.Parse<rapidjson::kParseInsituFlag>(is, decoder);
+        if (!pr) {
+            objects.resize(first);
+            res.message = "json parse failed";
+            res.errors = rapidjson::GetParseError_En(pr.Code());
+            return res;
+        }
+        *ptruncated = decoder.truncated;
+    }
+    for (size_t i = first; i < objects.size(); ++i) {
+        if (!objects[i].key.length()) {
+            objects.resize(first);
+            res.message = "json parse failed";
+            res.errors = "'Key' field is missing";
+            return res;
+        }
+    }
+
+    res.success = true;
+    res.bucket = bucket;
 
     return res;
 }
@@ -2,9 +2,32 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <cstdint>
+#include <sys/types.h>
+
+class StagingArea;
 
 namespace aws { namespace s3 {
 
+// timings and resource usage of a single API call
+struct CallStats
+{
+    uint64_t hash_us = 0;       // Content-MD5 computation
+    uint64_t stage_us = 0;      // copying data to the temporary file
+    uint64_t spawn_us = 0;      // fork of the aws child
+    uint64_t transfer_us = 0;   // aws child run time
+
+    uint64_t utime_ms = 0;
+    uint64_t stime_ms = 0;
+    uint64_t maxrss_kb = 0;
+    uint64_t nvcsw = 0;
+    uint64_t nivcsw = 0;
+    int children = 0;
+};
+
 struct Result
 {
     bool success = false;
@@ -17,6 +40,9 @@ struct Result
     std::string key;
     std::string etag;
     std::string location;
+    int64_t content_length = -1;
+
+    CallStats stats;
 
     Result() = default;
     Result(const Result &other) = delete;
@@ -29,10 +55,23 @@ struct Result
     bool operator! () const { return !success; }
 };
 
+// an object of a bucket listing
+struct ObjectInfo
+{
+    std::string key;
+    int64_t size = 0;
+    std::string etag;
+    int64_t mtime = 0;          // LastModified, seconds since the epoch
+};
+
+// user-defined object metadata (x-amz-meta-*)
+using Metadata = std::vector<std::pair<std::string, std::string>>;
+
 Result
 create_multipart_upload(
         const std::string &bucket,
-        const std::string &key);
+        const std::string &key,
+        const Metadata &metadata = Metadata());
 
 Result
 abort_multipart_upload(
@@ -45,17 +84,79 @@ complete_multipart_upload(
         const std::string &bucket,
         const std::string &key,
         const std::string &upload_id,
-        const std::string &multipart_upload_file);
+        const std::vector<std::string> &etags);
 
 Result
 upload_part(
         const std::string &bucket,
         const std::string &key,
         const std::string &upload_id,
-        const std::string &tmp_dir,
+        StagingArea &staging,
         int part_number,
         int fd,
         off_t beg,
-        off_t end);
+        off_t end,
+        const std::string &md5 = std::string());   // binary MD5 of the range, if known
+
+// upload of a file prepared by the caller, e.g. a staged file with transformed data
+Result
+upload_part_file(
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &upload_id,
+        int part_number,
+        const std::string &path,
+        off_t size,
+        const std::string &md5);                    // binary MD5 of the file
+
+// server-side copy of [beg, end) of an existing object ("bucket/key", not encoded) as a part;
+// with a non-empty if_match the copy fails with 412 unless the source still has that ETag
+Result
+upload_part_copy(
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &upload_id,
+        int part_number,
+        const std::string &copy_source,
+        off_t beg,
+        off_t end,
+        const std::string &if_match = std::string());
+
+// part_number > 0 reports the size of that part of a multipart object
+Result
+head_object(
+        const std::string &bucket,
+        const std::string &key,
+        int part_number = 0);
+
+// download [beg, end) of an object, the data is passed to the sink as it arrives;
+// if_match (an ETag) guards against the object changing between ranges
+Result
+get_object_range(
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &if_match,
+        off_t beg,
+        off_t end,
+        std::function<bool(const char *, size_t)> sink);
+
+// one page of at most max_keys objects under 'prefix' with keys greater than
+// 'start_after' (if not empty), in key order; *ptruncated is set if more follow
+Result
+list_objects_page(
+        const std::string &bucket,
+        const std::string &prefix,
+        const std::string &start_after,
+        int max_keys,
+        std::vector<ObjectInfo> &objects,
+        bool *ptruncated);
+
+// the call failed because S3 asks to reduce the request rate (503 SlowDown)
+bool
+throttled(const Result &res);
+
+// the call failed because a precondition did not hold (412 PreconditionFailed)
+bool
+precondition_failed(const Result &res);
 
 } }
@@ -0,0 +1,163 @@
+#include "checksum_cache.h"
+#include "md5_base64_file.h"
+#include "util.h"
+#include "log.h"
+
+#include <set>
+
+#include <openssl/md5.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+
+std::set<int>
+local_fds(const std::vector<PartSource> &parts)
+{
+    std::set<int> fds;
+    for (const PartSource &ps : parts) {
+        if (ps.fd >= 0) fds.insert(ps.fd);
+    }
+    return fds;
+}
+
+}
+
+ChecksumCache::ChecksumCache(const std::string &dir)
+    : dir_(dir)
+{
+    if (mkdir(dir_.c_str(), 0700) < 0 && errno != EEXIST) {
+        log_warning("checksum cache: cannot create '%s': %s", dir_.c_str(), strerror(errno));
+    }
+}
+
+std::string
+ChecksumCache::identity(int fd, const std::vector<PartSource> &parts)
+{
+    struct stat stb;
+    if (fstat(fd, &stb) < 0) return std::string();
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%llu:%llu:%lld:%lld",
+             (unsigned long long) stb.st_dev, (unsigned long long) stb.st_ino,
+             (long long) stb.st_size,
+             (long long) stb.st_mtim.tv_sec * 1000000000LL + stb.st_mtim.tv_nsec);
+    std::string id(buf);
+    for (const PartSource &ps : parts) {
+        if (ps.fd != fd) continue;
+        snprintf(buf, sizeof(buf), ":%lld-%lld", (long long) ps.beg, (long long) ps.end);
+        id += buf;
+    }
+    return id;
+}
+
+// the identity is hashed for the file name and kept in the first line of the entry
+std::string
+ChecksumCache::entry_path(const std::string &id) const
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5((const unsigned char *) id.data(), id.size(), digest);
+    return dir_ + "/" + to_hex(std::string((const char *) digest, sizeof(digest)));
+}
+
+int
+ChecksumCache::load(std::vector<PartSource> &parts, Snapshot &snapshot) const
+{
+    int filled = 0;
+    snapshot.clear();
+    for (int fd : local_fds(parts)) {
+        std::string id = identity(fd, parts);
+        if (!id.length()) continue;
+        snapshot.emplace_back(fd, id);
+        std::string path = entry_path(id);
+        FILE *f = fopen(path.c_str(), "re");
+        if (!f) continue;
+
+        std::vector<std::string> md5s;
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t len = getline(&line, &size, f);
+        bool ok = len > 0 && line[len - 1] == '\n' && id == std::string(line, len - 1);
+        while (ok && (len = getline(&line, &size, f)) > 0) {
+            std::string md5;
+            line[len - 1] = 0;
+            if (len != MD5_DIGEST_SIZE * 2 + 1 || !from_hex(line, md5)) {
+                ok = false;
+                break;
+            }
+            md5s.push_back(md5);
+        }
+        free(line);
+        fclose(f);
+
+        size_t n = 0;
+        for (const PartSource &ps : parts) {
+            if (ps.fd == fd) ++n;
+        }
+        if (!ok || md5s.size() != n) {
+            log_warning("checksum cache: invalid entry %s", path.c_str());
+            continue;
+        }
+        n = 0;
+        for (PartSource &ps : parts) {
+            if (ps.fd != fd) continue;
+            if (ps.md5.size() != MD5_DIGEST_SIZE) {
+                ps.md5 = md5s[n];
+                ++filled;
+            }
+            ++n;
+        }
+    }
+    if (filled > 0) log_info("checksum cache: %d part checksums loaded", filled);
+    return filled;
+}
+
+void
+ChecksumCache::store(const std::vector<PartSource> &parts, const Snapshot &snapshot) const
+{
+    for (const auto &snap : snapshot) {
+        int fd = snap.first;
+        std::string body;
+        bool complete = true;
+        for (const PartSource &ps : parts) {
+            if (ps.fd != fd) continue;
+            if (ps.md5.size() != MD5_DIGEST_SIZE) {
+                complete = false;
+                break;
+            }
+            body += to_hex(ps.md5);
+            body += '\n';
+        }
+        if (!complete) continue;
+        const std::string &id = snap.second;
+        if (identity(fd, parts) != id) {
+            log_warning("checksum cache: file changed during the upload, not stored");
+            continue;
+        }
+
+        std::string path = entry_path(id);
+        std::string tmp_path = path + ".tmp";
+        FILE *f = fopen(tmp_path.c_str(), "we");
+        if (!f) {
+            log_warning("checksum cache: cannot open '%s': %s", tmp_path.c_str(), strerror(errno));
+            continue;
+        }
+        fprintf(f, "%s\n", id.c_str());
+        fwrite(body.data(), 1, body.size(), f);
+        if (fflush(f) || ferror(f)) {
+            log_warning("checksum cache: write error on '%s'", tmp_path.c_str());
+            fclose(f);
+            unlink(tmp_path.c_str());
+            continue;
+        }
+        fclose(f);
+        if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+            log_warning("checksum cache: rename to '%s' failed: %s", path.c_str(), strerror(errno));
+            unlink(tmp_path.c_str());
+        }
+    }
+}
@@ -0,0 +1,34 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "multipart.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+
+// part MD5s of local files kept in a directory, one entry per file identity
+// (device, inode, size, mtime in ns) and part layout; a modified file gets
+// a new identity, so stale entries are never used
+class ChecksumCache
+{
+    std::string dir_;
+
+    static std::string identity(int fd, const std::vector<PartSource> &parts);
+    std::string entry_path(const std::string &id) const;
+
+public:
+    explicit ChecksumCache(const std::string &dir);
+
+    ChecksumCache(const ChecksumCache &) = delete;
+    ChecksumCache &operator= (const ChecksumCache &) = delete;
+
+    // identities of the files of the parts, taken before the data is read
+    using Snapshot = std::vector<std::pair<int, std::string>>;
+
+    // fill in the unknown MD5s of the local parts, returns the number of parts filled
+    int load(std::vector<PartSource> &parts, Snapshot &snapshot) const;
+    // store the MD5s of the local parts unless the file changed since the snapshot,
+    // the parts of a file must all be known
+    void store(const std::vector<PartSource> &parts, const Snapshot &snapshot) const;
+};
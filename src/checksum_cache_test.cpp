@@ -0,0 +1,144 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "checksum_cache.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <openssl/md5.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::vector<PartSource>
+make_parts(int fd, off_t size, off_t part)
+{
+    std::vector<PartSource> parts;
+    for (off_t beg = 0; beg < size; beg += part) {
+        PartSource ps;
+        ps.fd = fd;
+        ps.beg = beg;
+        ps.end = std::min(size, beg + part);
+        parts.push_back(ps);
+    }
+    return parts;
+}
+
+static void
+fill_md5s(std::vector<PartSource> &parts)
+{
+    for (size_t i = 0; i < parts.size(); ++i) {
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        std::string data = "part " + std::to_string(i);
+        MD5((const unsigned char *) data.data(), data.size(), digest);
+        parts[i].md5.assign((const char *) digest, sizeof(digest));
+    }
+}
+
+// the entry files in the cache directory
+static std::vector<std::string>
+entries(const std::string &dir)
+{
+    std::vector<std::string> names;
+    DIR *d = opendir(dir.c_str());
+    assert(d);
+    while (struct dirent *e = readdir(d)) {
+        if (e->d_name[0] != '.') names.push_back(dir + "/" + e->d_name);
+    }
+    closedir(d);
+    return names;
+}
+
+static void
+remove_entries(const std::string &dir)
+{
+    for (const std::string &path : entries(dir)) unlink(path.c_str());
+}
+
+int main()
+{
+    char dir[] = "/tmp/checksum_cache_test.XXXXXX";
+    char *dir_ok = mkdtemp(dir);
+    assert(dir_ok);
+    std::string base = dir;
+    std::string cache_dir = base + "/cache";
+    std::string data_path = base + "/data";
+
+    int fd = open(data_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    assert(fd >= 0);
+    std::string data(3000, 'x');
+    int written = write_full(fd, data.data(), data.size());
+    assert(written == 0);
+
+    ChecksumCache cache(cache_dir);
+    ChecksumCache::Snapshot snapshot;
+
+    // nothing is known at first
+    std::vector<PartSource> parts = make_parts(fd, 3000, 1000);
+    int filled = cache.load(parts, snapshot);
+    assert(filled == 0);
+    assert(snapshot.size() == 1 && snapshot[0].first == fd);
+
+    // incomplete parts are not stored
+    fill_md5s(parts);
+    std::vector<PartSource> known = parts;
+    parts[2].md5.clear();
+    cache.store(parts, snapshot);
+    assert(entries(cache_dir).empty());
+
+    // store and reload
+    cache.store(known, snapshot);
+    assert(entries(cache_dir).size() == 1);
+    parts = make_parts(fd, 3000, 1000);
+    filled = cache.load(parts, snapshot);
+    assert(filled == 3);
+    for (size_t i = 0; i < parts.size(); ++i) assert(parts[i].md5 == known[i].md5);
+
+    // known MD5s are kept, another layout is another entry
+    parts = make_parts(fd, 3000, 1000);
+    parts[0].md5 = std::string(MD5_DIGEST_LENGTH, 'm');
+    filled = cache.load(parts, snapshot);
+    assert(filled == 2);
+    assert(parts[0].md5 == std::string(MD5_DIGEST_LENGTH, 'm') && parts[1].md5 == known[1].md5);
+    parts = make_parts(fd, 3000, 1500);
+    filled = cache.load(parts, snapshot);
+    assert(filled == 0);
+
+    // a torn last line invalidates the entry
+    std::string entry = entries(cache_dir)[0];
+    struct stat stb;
+    int stat_ok = stat(entry.c_str(), &stb);
+    assert(stat_ok == 0);
+    for (off_t cut : { 1, 5 }) {
+        int trunc_ok = truncate(entry.c_str(), stb.st_size - cut);
+        assert(trunc_ok == 0);
+        parts = make_parts(fd, 3000, 1000);
+        filled = cache.load(parts, snapshot);
+        assert(filled == 0);
+        for (const PartSource &ps : parts) assert(ps.md5.empty());
+    }
+    remove_entries(cache_dir);
+
+    // the file changes between hashing and store: nothing is stored
+    parts = make_parts(fd, 3000, 1000);
+    filled = cache.load(parts, snapshot);
+    assert(filled == 0);
+    fill_md5s(parts);
+    written = write_full(fd, "y", 1);
+    assert(written == 0);
+    cache.store(parts, snapshot);
+    assert(entries(cache_dir).empty());
+
+    close(fd);
+    unlink(data_path.c_str());
+    rmdir(cache_dir.c_str());
+    rmdir(dir);
+    printf("checksum_cache_test: ok\n");
+}
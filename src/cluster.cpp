@@ -0,0 +1,605 @@
+#include "cluster.h"
+#include "log.h"
+
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/crypto.h>
+
+// a worker opens a connection with "hello <token>\n", or "hello\n" without
+// a token, and the coordinator greets it with
+// "AWSUCOORD1 <file size> <part count>\nbucket <b>\nkey <k>\nupload <id>\n",
+// then the worker sends "next\n" and gets "part <number> <beg> <end>\n",
+// "done\n" or "abort\n", and reports a part with "etag <number> <etag>\n"
+// or "failed <number>\n"
+
+namespace {
+
+const char protocol_magic[] = "AWSUCOORD1";
+constexpr size_t max_line_size = 4096;
+
+// returns a listening or a connected socket
+int
+open_endpoint(const std::string &address, bool listening)
+{
+    const char *what = listening?"listen on":"connect to";
+    if (!address.compare(0, 5, "unix:")) {
+        std::string path = address.substr(5);
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        if (!path.length() || path.size() >= sizeof(sa.sun_path)) {
+            log_error("invalid socket path '%s'", path.c_str());
+            return -1;
+        }
+        sa.sun_family = AF_UNIX;
+        memcpy(sa.sun_path, path.c_str(), path.size() + 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            log_error("socket failed: %s", strerror(errno));
+            return -1;
+        }
+        int r;
+        if (listening) {
+            unlink(path.c_str());       // left by a previous coordinator
+            r = bind(fd, (struct sockaddr *) &sa, sizeof(sa));
+            if (r >= 0) r = listen(fd, 128);
+        } else {
+            r = connect(fd, (struct sockaddr *) &sa, sizeof(sa));
+        }
+        if (r < 0) {
+            log_error("%s '%s' failed: %s", what, address.c_str(), strerror(errno));
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon + 1 == address.size()) {
+        log_error("invalid address '%s'", address.c_str());
+        return -1;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    // without AI_PASSIVE an empty host is the loopback
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *ai = NULL;
+    int e = getaddrinfo(host.length()?host.c_str():NULL, port.c_str(), &hints, &ai);
+    if (e) {
+        log_error("cannot resolve '%s': %s", address.c_str(), gai_strerror(e));
+        return -1;
+    }
+    int fd = -1;
+    int err = 0;
+    for (struct addrinfo *p = ai; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        int one = 1;
+        int r;
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            r = bind(fd, p->ai_addr, p->ai_addrlen);
+            if (r >= 0) r = listen(fd, 128);
+        } else {
+            r = connect(fd, p->ai_addr, p->ai_addrlen);
+            if (r >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (r >= 0) break;
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    if (fd < 0) {
+        log_error("%s '%s' failed: %s", what, address.c_str(), strerror(err));
+    }
+    return fd;
+}
+
+bool
+send_line(int fd, const std::string &line)
+{
+    const char *buf = line.data();
+    size_t size = line.size();
+    while (size > 0) {
+        ssize_t w = send(fd, buf, size, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        buf += w;
+        size -= w;
+    }
+    return true;
+}
+
+// '\n'-terminated lines received from a socket
+class LineReader
+{
+    int fd_;
+    std::string buf_;
+
+public:
+    explicit LineReader(int fd) : fd_(fd) {}
+
+    // one recv, returns the number of bytes, 0 at the end of the stream, -1 on error
+    // or when a line longer than max_line_size is being received
+    ssize_t fill()
+    {
+        char tmp[4096];
+        ssize_t r;
+        while ((r = recv(fd_, tmp, sizeof(tmp), 0)) < 0 && errno == EINTR) {}
+        if (r > 0) {
+            size_t old = buf_.size();
+            buf_.append(tmp, r);
+            size_t nl = buf_.rfind('\n');
+            size_t partial = nl == std::string::npos?buf_.size():buf_.size() - nl - 1;
+            if (partial > max_line_size) {
+                log_error("too long line received");
+                buf_.resize(old);
+                return -1;
+            }
+        }
+        return r;
+    }
+    // the next complete line without the '\n'
+    bool next(std::string &line)
+    {
+        size_t nl = buf_.find('\n');
+        if (nl == std::string::npos) return false;
+        line.assign(buf_, 0, nl);
+        buf_.erase(0, nl + 1);
+        return true;
+    }
+    // blocks until a line is received, false at the end of the stream or on error
+    bool read(std::string &line)
+    {
+        while (!next(line)) {
+            if (fill() <= 0) return false;
+        }
+        return true;
+    }
+};
+
+struct Header
+{
+    long long size = 0;
+    size_t count = 0;
+    std::string bucket;
+    std::string key;
+    std::string upload_id;
+};
+
+bool
+read_value(LineReader &reader, const char *name, std::string &value)
+{
+    std::string line;
+    size_t len = strlen(name);
+    if (!reader.read(line) || line.compare(0, len, name) || line.size() <= len + 1 || line[len] != ' ') {
+        return false;
+    }
+    value = line.substr(len + 1);
+    return true;
+}
+
+// introduces the worker and reads the greeting of the coordinator
+bool
+read_header(int sock, LineReader &reader, const std::string &token, Header &header)
+{
+    std::string line;
+    char magic[16];
+    if (!send_line(sock, token.length()?"hello " + token + "\n":"hello\n")
+        || !reader.read(line)
+        || sscanf(line.c_str(), "%15s %lld %zu", magic, &header.size, &header.count) != 3
+        || strcmp(magic, protocol_magic)
+        || !read_value(reader, "bucket", header.bucket)
+        || !read_value(reader, "key", header.key)
+        || !read_value(reader, "upload", header.upload_id)) {
+        log_error("invalid greeting from the coordinator");
+        return false;
+    }
+    return true;
+}
+
+class Coordinator
+{
+    struct Connection
+    {
+        int fd;
+        LineReader reader;
+        int part = -1;              // the index of the part being uploaded
+        bool waiting = false;       // a part is requested
+        bool greeted = false;       // the token is checked
+
+        explicit Connection(int fd) : fd(fd), reader(fd) {}
+    };
+
+    const UploadOptions &options_;
+    const std::vector<PartSource> &parts_;
+    MultipartUpload &upload_;
+    std::string hello_;                     // the expected first line
+    std::string greeting_;
+    std::vector<std::unique_ptr<Connection>> conns_;
+    std::deque<int> queue_;                 // the parts to hand out
+    std::vector<int> handouts_;
+    size_t done_ = 0;
+    bool failed_ = false;
+
+    void requeue(int part);
+    bool handle(Connection &c, const std::string &line);
+    void drop(size_t i);
+    void dispatch();
+
+public:
+    Coordinator(
+            const UploadOptions &options,
+            const std::vector<PartSource> &parts,
+            MultipartUpload &upload,
+            const std::string &token,
+            const std::string &greeting)
+        : options_(options), parts_(parts), upload_(upload),
+          hello_(token.length()?"hello " + token:"hello"), greeting_(greeting)
+    {
+    }
+
+    bool run(int listen_fd);
+};
+
+void
+Coordinator::requeue(int part)
+{
+    if (handouts_[part] > options_.retries) {
+        log_error("part %d failed %d times, giving up", part + 1, handouts_[part]);
+        failed_ = true;
+        return;
+    }
+    queue_.push_front(part);
+}
+
+bool
+Coordinator::handle(Connection &c, const std::string &line)
+{
+    int number = 0;
+    char etag[256];
+    if (!c.greeted) {
+        if (line.size() != hello_.size() || CRYPTO_memcmp(line.data(), hello_.data(), line.size())) {
+            log_warning("a client is rejected: invalid token");
+            return false;
+        }
+        c.greeted = true;
+        // a failed send shows up as a hangup
+        send_line(c.fd, greeting_);
+        return true;
+    }
+    if (line == "next") {
+        if (c.part >= 0 || c.waiting) return false;
+        c.waiting = true;
+        return true;
+    }
+    if (sscanf(line.c_str(), "etag %d %255s", &number, etag) == 2) {
+        if (number != c.part + 1 || c.part < 0) return false;
+        const PartSource &ps = parts_[c.part];
+        upload_.set_part_etag(number, etag, ps.end - ps.beg);
+        c.part = -1;
+        ++done_;
+        log_info("part %d uploaded, %zu of %zu", number, done_, parts_.size());
+        return true;
+    }
+    if (sscanf(line.c_str(), "failed %d", &number) == 1) {
+        if (number != c.part + 1 || c.part < 0) return false;
+        log_warning("part %d failed on a worker", number);
+        int part = c.part;
+        c.part = -1;
+        requeue(part);
+        return true;
+    }
+    return false;
+}
+
+void
+Coordinator::drop(size_t i)
+{
+    Connection &c = *conns_[i];
+    if (c.part >= 0) {
+        log_warning("a worker is lost with part %d", c.part + 1);
+        requeue(c.part);
+    }
+    close(c.fd);
+    conns_.erase(conns_.begin() + i);
+}
+
+void
+Coordinator::dispatch()
+{
+    for (auto &c : conns_) {
+        if (queue_.empty()) break;
+        if (!c->waiting) continue;
+        int part = queue_.front();
+        queue_.pop_front();
+        ++handouts_[part];
+        c->part = part;
+        c->waiting = false;
+        char buf[128];
+        snprintf(buf, sizeof(buf), "part %d %lld %lld\n",
+                 part + 1, (long long) parts_[part].beg, (long long) parts_[part].end);
+        // a failed send shows up as a hangup
+        send_line(c->fd, buf);
+    }
+}
+
+bool
+Coordinator::run(int listen_fd)
+{
+    handouts_.assign(parts_.size(), 0);
+    for (size_t i = 0; i < parts_.size(); ++i) {
+        queue_.push_back(i);
+    }
+
+    std::vector<struct pollfd> pfds;
+    while (done_ < parts_.size() && !failed_) {
+        pfds.clear();
+        pfds.push_back({ listen_fd, POLLIN, 0 });
+        for (auto &c : conns_) {
+            pfds.push_back({ c->fd, POLLIN, 0 });
+        }
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            log_error("poll failed: %s", strerror(errno));
+            failed_ = true;
+            break;
+        }
+        // backwards, so dropping a connection keeps the indices of the rest
+        for (size_t i = conns_.size(); i-- > 0; ) {
+            if (!pfds[i + 1].revents) continue;
+            Connection &c = *conns_[i];
+            bool ok = c.reader.fill() > 0;
+            std::string line;
+            while (ok && c.reader.next(line)) {
+                ok = handle(c, line);
+                if (!ok && c.greeted) log_warning("unexpected message from a worker: '%s'", line.c_str());
+            }
+            if (!ok) drop(i);
+        }
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                int one = 1;
+                setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+                conns_.emplace_back(new Connection(fd));
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                log_warning("accept failed: %s", strerror(errno));
+            }
+        }
+        dispatch();
+    }
+
+    bool success = !failed_ && upload_.complete();
+    if (!success) upload_.abort();
+    for (auto &c : conns_) {
+        if (c->greeted) send_line(c->fd, success?"done\n":"abort\n");
+        shutdown(c->fd, SHUT_WR);
+    }
+    // closing with an unread request would reset the connection before
+    // the worker reads the answer, so the requests are read until it hangs up
+    for (auto &c : conns_) {
+        struct pollfd pfd = { c->fd, POLLIN, 0 };
+        while (poll(&pfd, 1, 1000) > 0 && c->reader.fill() > 0) {}
+        close(c->fd);
+    }
+    conns_.clear();
+    return success;
+}
+
+// one connection to the coordinator, returns true when the coordinator is done;
+// a failed part is reported, the coordinator decides whether to retry it
+bool
+serve_connection(
+        MultipartUpload &upload,
+        int sock,
+        LineReader &reader,
+        int fd,
+        const Header &header,
+        std::atomic<int> &uploaded)
+{
+    std::string line;
+    while (1) {
+        if (!send_line(sock, "next\n") || !reader.read(line)) {
+            log_error("connection to the coordinator is lost");
+            return false;
+        }
+        if (line == "done") return true;
+        if (line == "abort") {
+            log_error("the coordinator aborted the upload");
+            return false;
+        }
+        int number = 0;
+        long long beg = 0, end = 0;
+        if (sscanf(line.c_str(), "part %d %lld %lld", &number, &beg, &end) != 3
+            || number < 1 || (size_t) number > header.count || beg < 0 || beg >= end || end > header.size) {
+            log_error("unexpected message from the coordinator: '%s'", line.c_str());
+            return false;
+        }
+        PartSource ps;
+        ps.fd = fd;
+        ps.beg = beg;
+        ps.end = end;
+        std::string etag = upload.upload_part(number, ps);
+        std::string report = etag.length()?"etag " + std::to_string(number) + " " + etag + "\n"
+            :"failed " + std::to_string(number) + "\n";
+        if (!send_line(sock, report)) {
+            log_error("connection to the coordinator is lost");
+            return false;
+        }
+        if (etag.length()) ++uploaded;
+    }
+}
+
+}
+
+bool
+load_token(const std::string &path, std::string &token)
+{
+    FILE *f = fopen(path.c_str(), "re");
+    if (!f) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    char buf[256];
+    size_t size = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    while (size > 0 && isspace((unsigned char) buf[size - 1])) --size;
+    bool ok = size > 0 && size < sizeof(buf);
+    for (size_t i = 0; ok && i < size; ++i) {
+        ok = isgraph((unsigned char) buf[i]);
+    }
+    if (ok) token.assign(buf, size);
+    OPENSSL_cleanse(buf, sizeof(buf));
+    if (!ok) {
+        log_error("'%s' must hold one word of at most %zu characters", path.c_str(), sizeof(buf) - 1);
+        return false;
+    }
+    return true;
+}
+
+bool
+run_coordinator(
+        const UploadOptions &options,
+        const std::string &address,
+        const std::string &token,
+        const std::string &bucket,
+        const std::string &key,
+        const std::vector<PartSource> &parts)
+{
+    if (key.find('\n') != std::string::npos) {
+        log_error("keys with newlines are not supported in coordinate mode");
+        return false;
+    }
+    for (const PartSource &ps : parts) {
+        if (ps.fd < 0) {
+            log_error("coordinate mode supports local parts only");
+            return false;
+        }
+    }
+    int listen_fd = open_endpoint(address, true);
+    if (listen_fd < 0) return false;
+
+    MultipartUpload upload(options, bucket, key);
+    if (!upload.create()) {
+        close(listen_fd);
+        return false;
+    }
+    upload.start_parts(parts.size());
+    std::string greeting = std::string(protocol_magic) + " " + std::to_string((long long) parts.back().end)
+        + " " + std::to_string(parts.size()) + "\n"
+        + "bucket " + bucket + "\n"
+        + "key " + key + "\n"
+        + "upload " + upload.upload_id() + "\n";
+    log_info("coordinating %zu parts of s3://%s/%s on %s", parts.size(), bucket.c_str(), key.c_str(), address.c_str());
+
+    Coordinator coordinator(options, parts, upload, token, greeting);
+    bool success = coordinator.run(listen_fd);
+    close(listen_fd);
+    if (!address.compare(0, 5, "unix:")) unlink(address.c_str() + 5);
+    return success;
+}
+
+bool
+run_worker(
+        const UploadOptions &options,
+        const std::string &address,
+        const std::string &token,
+        const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat stb;
+    if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode)) {
+        log_error("'%s' is not a regular file", path.c_str());
+        close(fd);
+        return false;
+    }
+
+    int sock = open_endpoint(address, false);
+    if (sock < 0) {
+        close(fd);
+        return false;
+    }
+    LineReader reader(sock);
+    Header header;
+    bool valid = read_header(sock, reader, token, header);
+    if (valid && header.size != stb.st_size) {
+        log_error("'%s' has %lld bytes, the file of the coordinator has %lld",
+                  path.c_str(), (long long) stb.st_size, header.size);
+        valid = false;
+    }
+    if (valid && (header.count < 1 || header.count > 10000)) {
+        log_error("invalid number of parts: %zu", header.count);
+        valid = false;
+    }
+    if (!valid) {
+        close(sock);
+        close(fd);
+        return false;
+    }
+    log_info("working on s3://%s/%s, upload %s", header.bucket.c_str(), header.key.c_str(), header.upload_id.c_str());
+
+    MultipartUpload upload(options, header.bucket, header.key);
+    upload.attach(header.upload_id, header.count);
+    std::atomic<int> uploaded{0};
+    std::vector<char> results(options.jobs, 0);
+    std::vector<std::thread> threads;
+    for (int j = 0; j < options.jobs; ++j) {
+        threads.emplace_back([&, j] {
+            if (!j) {
+                results[j] = serve_connection(upload, sock, reader, fd, header, uploaded);
+                return;
+            }
+            // every connection is greeted, it must be the same upload
+            int s = open_endpoint(address, false);
+            if (s < 0) return;
+            LineReader r(s);
+            Header h;
+            if (read_header(s, r, token, h) && h.upload_id == header.upload_id) {
+                results[j] = serve_connection(upload, s, r, fd, header, uploaded);
+            } else {
+                log_error("the coordinator has changed the upload");
+            }
+            close(s);
+        });
+    }
+    for (auto &t : threads) t.join();
+    close(sock);
+    close(fd);
+
+    log_info("%d parts uploaded", (int) uploaded);
+    for (char r : results) {
+        if (!r) return false;
+    }
+    return true;
+}
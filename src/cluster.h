@@ -0,0 +1,40 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "multipart.h"
+
+#include <string>
+#include <vector>
+
+// one object uploaded by several hosts reading the same file on shared storage:
+// the coordinator creates the multipart upload and hands the parts out to the
+// workers one at a time, the workers upload them and report the ETags back,
+// and the coordinator completes the upload;
+// an address is either "unix:PATH" or "HOST:PORT", an empty host is the
+// loopback, so listening on all interfaces takes an explicit "0.0.0.0:PORT";
+// a worker must present the token of the coordinator, if it has one
+
+// the file holds the token, a single word
+bool
+load_token(const std::string &path, std::string &token);
+
+// every connection holds at most one part, a part of a lost connection or a
+// failed part is handed out again, at most options.retries times; the workers
+// do not retry parts themselves
+bool
+run_coordinator(
+        const UploadOptions &options,
+        const std::string &address,
+        const std::string &token,
+        const std::string &bucket,
+        const std::string &key,
+        const std::vector<PartSource> &parts);
+
+// options.jobs connections upload parts concurrently; 'path' is the local
+// name of the coordinator's file, which must have the same size
+bool
+run_worker(
+        const UploadOptions &options,
+        const std::string &address,
+        const std::string &token,
+        const std::string &path);
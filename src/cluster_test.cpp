@@ -0,0 +1,366 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "cluster.h"
+#include "staging.h"
+#include "util.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <openssl/md5.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// stands in for the aws CLI: logs "<operation> <part> <worker>" calls,
+// a part fails when listed in $FAKE_AWS_FAIL or once when a fail-once.<part>
+// file exists, with $FAKE_AWS_KILL the calling worker is killed instead;
+// the ETag of a part is the MD5 of the body
+static const char fake_aws[] = R"sh(#!/bin/sh
+op=$2
+shift 2
+part=- body= length=
+while [ $# -gt 1 ]; do
+    case $1 in
+    --part-number) part=$2;;
+    --body) body=$2;;
+    --content-length) length=$2;;
+    esac
+    shift 2
+done
+echo "$op $part ${FAKE_AWS_WORKER:-coordinator}" >> "$FAKE_AWS_DIR/log"
+case $op in
+create-multipart-upload)
+    echo '{"Bucket": "bucket", "Key": "key", "UploadId": "upload-1"}';;
+upload-part)
+    if [ -n "$FAKE_AWS_KILL" ]; then kill -KILL $PPID; exit 1; fi
+    sleep 0.1
+    case " $FAKE_AWS_FAIL " in *" $part "*) echo "An error occurred (InternalError)" >&2; exit 255;; esac
+    if [ -e "$FAKE_AWS_DIR/fail-once.$part" ]; then
+        rm "$FAKE_AWS_DIR/fail-once.$part"
+        echo "An error occurred (InternalError)" >&2
+        exit 255
+    fi
+    [ "$(wc -c < "$body")" -eq "$length" ] || exit 1
+    echo "{\"ETag\": \"\\\"$(md5sum < "$body" | cut -c1-32)\\\"\"}";;
+complete-multipart-upload)
+    cat > "$FAKE_AWS_DIR/complete"
+    echo '{"Bucket": "bucket", "Key": "key", "Location": "here", "ETag": "\"e-6\""}';;
+esac
+)sh";
+
+static const int part_count = 6;
+static const off_t part_bytes = 1000;
+
+static std::string base;
+static std::string address;
+static std::string data_path;
+static std::string data;
+
+static std::string
+read_file(const std::string &path)
+{
+    std::ifstream in(path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static void
+write_file(const std::string &path, const std::string &text, mode_t mode)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    assert(fd >= 0);
+    int written = write_full(fd, text.data(), text.size());
+    assert(written == 0);
+    close(fd);
+}
+
+// the number of aws calls logged as "<op> <part> <worker>"
+static int
+calls(const std::string &op, const std::string &part, const std::string &worker = std::string())
+{
+    std::istringstream log(read_file(base + "/log"));
+    std::string line;
+    std::string prefix = op + " " + part + " ";
+    int n = 0;
+    while (std::getline(log, line)) {
+        if (!line.compare(0, prefix.size(), prefix) && (worker.empty() || line.substr(prefix.size()) == worker)) ++n;
+    }
+    return n;
+}
+
+static void
+reset_log()
+{
+    write_file(base + "/log", "", 0600);
+    unlink((base + "/complete").c_str());
+}
+
+// run f in a child process, the exit status is 0 if it returns true
+static pid_t
+spawn(const std::function<bool()> &f)
+{
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (!pid) {
+        alarm(60);
+        _exit(f()?0:1);
+    }
+    return pid;
+}
+
+static int
+wait_status(pid_t pid)
+{
+    int status = 0;
+    pid_t r = waitpid(pid, &status, 0);
+    assert(r == pid);
+    return status;
+}
+
+static bool
+exited_ok(pid_t pid)
+{
+    int status = wait_status(pid);
+    return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static pid_t
+start_coordinator(const std::string &token, int retries)
+{
+    std::string sock_path = address.substr(5);
+    unlink(sock_path.c_str());
+    pid_t pid = spawn([&] {
+        int fd = open(data_path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        std::vector<PartSource> parts(part_count);
+        for (int i = 0; i < part_count; ++i) {
+            parts[i].fd = fd;
+            parts[i].beg = i * part_bytes;
+            parts[i].end = (i + 1) * part_bytes;
+        }
+        UploadOptions options;
+        options.retries = retries;
+        return run_coordinator(options, address, token, "bucket", "key", parts);
+    });
+    // the socket is bound before the upload is created
+    struct stat stb;
+    for (int i = 0; i < 500 && stat(sock_path.c_str(), &stb) < 0; ++i) usleep(10000);
+    int r = stat(sock_path.c_str(), &stb);
+    assert(r == 0);
+    return pid;
+}
+
+static pid_t
+start_worker(const std::string &name, const std::string &token, int jobs, const char *fail = "", bool kill = false)
+{
+    return spawn([&] {
+        setenv("FAKE_AWS_WORKER", name.c_str(), 1);
+        setenv("FAKE_AWS_FAIL", fail, 1);
+        if (kill) setenv("FAKE_AWS_KILL", "1", 1);
+        StagingArea staging(base, 0);
+        UploadOptions options;
+        options.jobs = jobs;
+        options.staging = &staging;
+        return run_worker(options, address, token, data_path);
+    });
+}
+
+// the completed upload lists the MD5s of the parts in order
+static bool
+completed()
+{
+    std::string doc = read_file(base + "/complete");
+    size_t pos = 0;
+    for (int i = 0; i < part_count; ++i) {
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        MD5((const unsigned char *) data.data() + i * part_bytes, part_bytes, digest);
+        char hex[MD5_DIGEST_LENGTH * 2 + 1];
+        hex_encode(hex, digest, sizeof(digest));
+        pos = doc.find(hex, pos);
+        if (pos == std::string::npos) return false;
+    }
+    return true;
+}
+
+static int
+raw_connect()
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, address.c_str() + 5);
+    int r = connect(fd, (struct sockaddr *) &sa, sizeof(sa));
+    assert(r == 0);
+    return fd;
+}
+
+// everything received until the coordinator closes the connection,
+// false if it is not closed within 5 seconds
+static bool
+read_until_closed(int fd, std::string &received)
+{
+    received.clear();
+    while (1) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 5000) <= 0) return false;
+        char buf[4096];
+        ssize_t r = recv(fd, buf, sizeof(buf), 0);
+        if (r <= 0) return true;
+        received.append(buf, r);
+    }
+}
+
+int main()
+{
+    char dir[] = "/tmp/cluster_test.XXXXXX";
+    char *dir_ok = mkdtemp(dir);
+    assert(dir_ok);
+    base = dir;
+    address = "unix:" + base + "/sock";
+    data_path = base + "/data";
+    alarm(300);
+    bool ok;
+
+    // the workers run the stub found first in PATH
+    std::string bin = base + "/bin";
+    int r = mkdir(bin.c_str(), 0700);
+    assert(r == 0);
+    write_file(bin + "/aws", fake_aws, 0700);
+    setenv("PATH", (bin + ":" + getenv("PATH")).c_str(), 1);
+    setenv("FAKE_AWS_DIR", base.c_str(), 1);
+
+    for (int i = 0; i < part_count * part_bytes; ++i) data.push_back('a' + i % 23 + i / 1000);
+    write_file(data_path, data, 0600);
+
+    // two workers upload every part exactly once
+    {
+        reset_log();
+        pid_t coordinator = start_coordinator("", 0);
+        pid_t w1 = start_worker("w1", "", 2);
+        pid_t w2 = start_worker("w2", "", 2);
+        ok = exited_ok(w1);
+        assert(ok);
+        ok = exited_ok(w2);
+        assert(ok);
+        ok = exited_ok(coordinator);
+        assert(ok);
+        assert(calls("create-multipart-upload", "-") == 1);
+        for (int i = 1; i <= part_count; ++i) assert(calls("upload-part", std::to_string(i)) == 1);
+        assert(calls("complete-multipart-upload", "-") == 1 && completed());
+        assert(calls("abort-multipart-upload", "-") == 0);
+    }
+
+    // a failed part is handed out again
+    {
+        reset_log();
+        write_file(base + "/fail-once.3", "", 0600);
+        pid_t coordinator = start_coordinator("", 1);
+        pid_t w1 = start_worker("w1", "", 2);
+        pid_t w2 = start_worker("w2", "", 2);
+        ok = exited_ok(w1);
+        assert(ok);
+        ok = exited_ok(w2);
+        assert(ok);
+        ok = exited_ok(coordinator);
+        assert(ok);
+        assert(calls("upload-part", "3") == 2);
+        assert(calls("upload-part", "4") == 1);
+        assert(calls("complete-multipart-upload", "-") == 1 && completed());
+    }
+
+    // but at most 'retries' times, then the upload is aborted
+    {
+        reset_log();
+        pid_t coordinator = start_coordinator("", 2);
+        pid_t w1 = start_worker("w1", "", 1, "4");
+        pid_t w2 = start_worker("w2", "", 1, "4");
+        ok = exited_ok(w1);
+        assert(!ok);
+        ok = exited_ok(w2);
+        assert(!ok);
+        ok = exited_ok(coordinator);
+        assert(!ok);
+        assert(calls("upload-part", "4") == 3);
+        assert(calls("complete-multipart-upload", "-") == 0);
+        assert(calls("abort-multipart-upload", "-") == 1);
+    }
+
+    // the part of a lost worker is taken over by another one
+    {
+        reset_log();
+        pid_t coordinator = start_coordinator("", 1);
+        pid_t w1 = start_worker("w1", "", 1, "", true);
+        int status = wait_status(w1);
+        assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+        assert(calls("upload-part", "1", "w1") == 1);
+        pid_t w2 = start_worker("w2", "", 2);
+        ok = exited_ok(w2);
+        assert(ok);
+        ok = exited_ok(coordinator);
+        assert(ok);
+        for (int i = 1; i <= part_count; ++i) assert(calls("upload-part", std::to_string(i), "w2") == 1);
+        assert(calls("complete-multipart-upload", "-") == 1 && completed());
+    }
+
+    // clients with a wrong token and lines over the bound are refused
+    {
+        reset_log();
+        pid_t coordinator = start_coordinator("secret", 0);
+        std::string received;
+
+        int fd = raw_connect();
+        send(fd, "hello\n", 6, MSG_NOSIGNAL);
+        bool closed = read_until_closed(fd, received);
+        assert(closed && received.empty());
+        close(fd);
+
+        fd = raw_connect();
+        std::string line = "hello secret\n" + std::string(5000, 'x');
+        ssize_t n = send(fd, line.data(), line.size(), MSG_NOSIGNAL);
+        assert(n == (ssize_t) line.size());
+        // no newline follows, the connection is closed because of the size
+        closed = read_until_closed(fd, received);
+        assert(closed && !received.compare(0, 18, "AWSUCOORD1 6000 6\n"));
+        close(fd);
+
+        pid_t bad = start_worker("bad", "wrong", 1);
+        ok = exited_ok(bad);
+        assert(!ok);
+        pid_t good = start_worker("good", "secret", 2);
+        ok = exited_ok(good);
+        assert(ok);
+        ok = exited_ok(coordinator);
+        assert(ok);
+        assert(calls("upload-part", "1", "bad") == 0);
+        for (int i = 1; i <= part_count; ++i) assert(calls("upload-part", std::to_string(i), "good") == 1);
+        assert(calls("complete-multipart-upload", "-") == 1 && completed());
+    }
+
+    unlink((bin + "/aws").c_str());
+    rmdir(bin.c_str());
+    unlink(data_path.c_str());
+    unlink((base + "/log").c_str());
+    unlink((base + "/complete").c_str());
+    rmdir(dir);
+    printf("cluster_test: ok\n");
+}
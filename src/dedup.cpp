@@ -0,0 +1,175 @@
+#include "dedup.h"
+#include "checksum_cache.h"
+#include "staging.h"
+#include "log.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+KnownSet::~KnownSet()
+{
+    if (file_) fclose(file_);
+}
+
+bool
+KnownSet::open(const std::string &path)
+{
+    path_ = path;
+    FILE *f = fopen(path.c_str(), "re");
+    if (f) {
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t len;
+        off_t good = 0;
+        bool torn = false;
+        while ((len = getline(&line, &size, f)) > 0) {
+            if (line[len - 1] != '\n') {
+                torn = true;
+                break;
+            }
+            keys_.insert(std::string(line, len - 1));
+            good += len;
+        }
+        free(line);
+        fclose(f);
+        // the next key must not be appended to the torn line
+        if (torn && truncate(path.c_str(), good) < 0) {
+            log_error("cannot truncate '%s': %s", path.c_str(), strerror(errno));
+            return false;
+        }
+    } else if (errno != ENOENT) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    file_ = fopen(path.c_str(), "ae");
+    if (!file_) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool
+KnownSet::contains(const std::string &key) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return keys_.count(key) > 0;
+}
+
+// a lost line only costs a probe or a repeated upload
+void
+KnownSet::add(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!keys_.insert(key).second) return;
+    fprintf(file_, "%s\n", key.c_str());
+    if (fflush(file_)) {
+        log_warning("cannot write '%s': %s", path_.c_str(), strerror(errno));
+    }
+}
+
+std::string
+content_key(const DedupOptions &dedup, const std::vector<PartSource> &parts)
+{
+    std::string etag = composite_etag(parts);
+    if (etag.size() < 2) return std::string();
+    return dedup.prefix + etag.substr(1, etag.size() - 2);
+}
+
+namespace {
+
+bool
+record_name(
+        const UploadOptions &options,
+        const DedupOptions &dedup,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &ckey,
+        off_t size)
+{
+    if (dedup.manifest_file.length()) {
+        FILE *f = fopen(dedup.manifest_file.c_str(), "ae");
+        if (!f) {
+            log_error("cannot open '%s': %s", dedup.manifest_file.c_str(), strerror(errno));
+            return false;
+        }
+        fprintf(f, "%s %lld %s\n", ckey.c_str(), (long long) size, key.c_str());
+        if (fflush(f) || fdatasync(fileno(f)) < 0 || ferror(f)) {
+            log_error("write error on '%s'", dedup.manifest_file.c_str());
+            fclose(f);
+            return false;
+        }
+        fclose(f);
+        return true;
+    }
+
+    std::string text = "AWSUREF1 " + ckey + " " + std::to_string((long long) size) + "\n";
+    StagedFile file;
+    if (!options.staging->create(file, text.size()) || write_full(file.fd(), text.data(), text.size()) < 0) {
+        return false;
+    }
+    std::vector<PartSource> parts;
+    plan_parts(parts, file.fd(), std::string(), 0, text.size());
+    UploadOptions ref_options = options;
+    ref_options.skip_identical = false;
+    ref_options.checksum_cache = nullptr;
+    return upload_object(ref_options, bucket, key, parts);
+}
+
+}
+
+bool
+upload_dedup(
+        const UploadOptions &options,
+        const DedupOptions &dedup,
+        const std::string &bucket,
+        const std::string &key,
+        std::vector<PartSource> &parts)
+{
+    for (const PartSource &ps : parts) {
+        if (ps.fd < 0) {
+            log_error("deduplication supports local parts only");
+            return false;
+        }
+    }
+
+    // the content is hashed first, the MD5s are reused by the upload
+    ChecksumCache::Snapshot snapshot;
+    if (options.checksum_cache) {
+        options.checksum_cache->load(parts, snapshot);
+    }
+    if (!compute_part_md5s(parts, options.jobs, options.cache_mode)) {
+        return false;
+    }
+    if (options.checksum_cache) {
+        options.checksum_cache->store(parts, snapshot);
+    }
+    std::string ckey = content_key(dedup, parts);
+    if (!ckey.length()) return false;
+    off_t size = parts.back().end - parts.front().beg;
+
+    bool stored = dedup.known && dedup.known->contains(ckey);
+    if (!stored && dedup.probe && remote_object_matches(bucket, ckey, parts, options.metrics)) {
+        stored = true;
+    }
+    if (stored) {
+        log_info("content %s is already stored", ckey.c_str());
+        printf("skipped: 1\n");
+    } else {
+        UploadOptions content_options = options;
+        content_options.skip_identical = false;
+        content_options.checksum_cache = nullptr;
+        if (!upload_object(content_options, bucket, ckey, parts)) {
+            return false;
+        }
+        log_info("content %s uploaded", ckey.c_str());
+    }
+    if (dedup.known) dedup.known->add(ckey);
+    printf("content_key: %s\n", ckey.c_str());
+
+    return record_name(options, dedup, bucket, key, ckey, size);
+}
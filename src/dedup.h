@@ -0,0 +1,54 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "multipart.h"
+
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <cstdio>
+
+// keys of content objects known to be stored, one per line in an append-only file
+class KnownSet
+{
+    std::string path_;
+    FILE *file_ = nullptr;
+    std::set<std::string> keys_;
+    mutable std::mutex mutex_;
+
+public:
+    KnownSet() = default;
+    ~KnownSet();
+
+    KnownSet(const KnownSet &) = delete;
+    KnownSet &operator= (const KnownSet &) = delete;
+
+    bool open(const std::string &path);
+    bool contains(const std::string &key) const;
+    void add(const std::string &key);
+};
+
+struct DedupOptions
+{
+    std::string prefix;             // content objects are stored as prefix + hash
+    KnownSet *known = nullptr;
+    bool probe = false;             // head-object before uploading unknown content
+    std::string manifest_file;      // "<content key> <size> <name>" lines; empty: reference objects
+};
+
+// the content key of the parts: the prefix followed by the multipart ETag
+// ("hex-N") the object gets, so a stored object can be checked by its ETag
+std::string
+content_key(const DedupOptions &dedup, const std::vector<PartSource> &parts);
+
+// upload the parts as a content object unless the content is already stored,
+// then record 'key' as a name of it: a line of the manifest, or a small
+// reference object "AWSUREF1 <content key> <size>" under 'key'
+bool
+upload_dedup(
+        const UploadOptions &options,
+        const DedupOptions &dedup,
+        const std::string &bucket,
+        const std::string &key,
+        std::vector<PartSource> &parts);
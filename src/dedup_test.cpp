@@ -0,0 +1,96 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "dedup.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <openssl/md5.h>
+
+#include <unistd.h>
+
+static std::string
+read_file(const std::string &path)
+{
+    std::ifstream in(path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static std::string
+md5_of(const std::string &data)
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5((const unsigned char *) data.data(), data.size(), digest);
+    return std::string((const char *) digest, sizeof(digest));
+}
+
+int main()
+{
+    char dir[] = "/tmp/dedup_test.XXXXXX";
+    char *dir_ok = mkdtemp(dir);
+    assert(dir_ok);
+    std::string path = std::string(dir) + "/known";
+    bool ok;
+
+    // the content key is the prefix followed by the multipart ETag
+    DedupOptions dedup;
+    dedup.prefix = "cas/";
+    std::vector<PartSource> parts(2);
+    parts[0].md5 = md5_of("a");
+    parts[1].md5 = md5_of("b");
+    assert(content_key(dedup, parts) == "cas/96e024ba2074fe77e8e965ba43a704be-2");
+    parts[1].md5.clear();
+    assert(content_key(dedup, parts).empty());
+
+    {
+        KnownSet known;
+        ok = known.open(path);
+        assert(ok);
+        assert(!known.contains("k1"));
+        known.add("k1");
+        known.add("k2");
+        known.add("k1");
+        assert(known.contains("k1") && known.contains("k2"));
+    }
+    assert(read_file(path) == "k1\nk2\n");
+
+    {
+        KnownSet known;
+        ok = known.open(path);
+        assert(ok);
+        assert(known.contains("k1") && known.contains("k2") && !known.contains("k3"));
+    }
+
+    // a torn last line is dropped and does not merge with the next key
+    {
+        std::ofstream out(path, std::ios::app);
+        out << "k3-tor";
+    }
+    {
+        KnownSet known;
+        ok = known.open(path);
+        assert(ok);
+        assert(known.contains("k1") && known.contains("k2"));
+        assert(!known.contains("k3-tor"));
+        known.add("k4");
+    }
+    assert(read_file(path) == "k1\nk2\nk4\n");
+    {
+        KnownSet known;
+        ok = known.open(path);
+        assert(ok);
+        assert(known.contains("k1") && known.contains("k2") && known.contains("k4"));
+        assert(!known.contains("k3-tork4"));
+    }
+
+    unlink(path.c_str());
+    rmdir(dir);
+    printf("dedup_test: ok\n");
+}
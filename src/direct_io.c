@@ -0,0 +1,85 @@
+#include "direct_io.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+/* sufficient for the logical block size of all common devices */
+enum { DIRECT_ALIGN = 4096 };
+enum { DIRECT_BUF_SIZE = 8 * 1024 * 1024 };
+
+int
+direct_read_range(
+        int fd,
+        off_t beg,
+        off_t end,
+        direct_read_callback_t callback,
+        void *arg)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int dfd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC, 0);
+    if (dfd < 0) {
+        log_error("direct_read_range: open: %s", strerror(errno));
+        return -1;
+    }
+    void *buf = NULL;
+    if (posix_memalign(&buf, DIRECT_ALIGN, DIRECT_BUF_SIZE)) {
+        log_error("direct_read_range: out of memory");
+        close(dfd);
+        return -1;
+    }
+
+    int retval = 0;
+    off_t pos = beg - beg % DIRECT_ALIGN;
+    while (pos < end) {
+        ssize_t r = pread(dfd, buf, DIRECT_BUF_SIZE, pos);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) {
+            log_error("direct_read_range: pread: %s", strerror(errno));
+            retval = -1;
+            break;
+        }
+        /* the file may end before beg, then there is nothing to pass on */
+        if (!r || pos + r <= beg) {
+            log_error("direct_read_range: unexpected end of file");
+            retval = -1;
+            break;
+        }
+        /* the first read starts before beg, the last may end after end */
+        off_t from = pos < beg?beg - pos:0;
+        off_t to = pos + r > end?end - pos:r;
+        if (callback((const char *) buf + from, to - from, arg) < 0) {
+            retval = -1;
+            break;
+        }
+        pos += r;
+        /* a short read is only possible at the end of the file */
+        if (r % DIRECT_ALIGN && pos < end) {
+            log_error("direct_read_range: short read");
+            retval = -1;
+            break;
+        }
+    }
+
+    free(buf);
+    close(dfd);
+    return retval;
+}
+
+void
+cache_will_need(int fd, off_t beg, off_t end)
+{
+    if (end > beg) posix_fadvise(fd, beg, end - beg, POSIX_FADV_WILLNEED);
+}
+
+void
+cache_dont_need(int fd, off_t beg, off_t end)
+{
+    if (end > beg) posix_fadvise(fd, beg, end - beg, POSIX_FADV_DONTNEED);
+}
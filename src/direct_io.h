@@ -0,0 +1,34 @@
+#ifndef __DIRECT_IO_H__
+#define __DIRECT_IO_H__
+
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* called for consecutive pieces of the range, returns < 0 to stop */
+typedef int (*direct_read_callback_t)(const char *data, size_t size, void *arg);
+
+/* read [beg, end) of fd bypassing the page cache, the file is reopened
+   with O_DIRECT and read with aligned buffers and offsets */
+int
+direct_read_range(
+        int fd,
+        off_t beg,
+        off_t end,
+        direct_read_callback_t callback,
+        void *arg);
+
+/* advise the kernel about a range of a file, errors are ignored */
+void
+cache_will_need(int fd, off_t beg, off_t end);
+
+void
+cache_dont_need(int fd, off_t beg, off_t end);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,253 @@
+#include "download.h"
+#include "awss3api.h"
+#include "metrics.h"
+#include "multipart.h"
+#include "thread_pool.h"
+#include "timeutil.h"
+#include "trace.h"
+#include "log.h"
+#include "md5_base64_file.h"
+#include "util.h"
+
+#include <vector>
+#include <atomic>
+
+#include <openssl/md5.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace {
+
+struct Range
+{
+    off_t beg;
+    off_t end;
+    unsigned char md5[MD5_DIGEST_SIZE];
+};
+
+// number of parts of a multipart ETag ("hex-N"), 0 for a plain MD5 ETag, -1 otherwise
+int
+etag_part_count(const std::string &etag)
+{
+    size_t len = etag.size();
+    if (len < 34 || etag[0] != '"' || etag[len - 1] != '"') return -1;
+    for (int i = 1; i <= 32; ++i) {
+        if (!isxdigit((unsigned char) etag[i])) return -1;
+    }
+    if (len == 34) return 0;
+    if (etag[33] != '-') return -1;
+    char *eptr = NULL;
+    long n = strtol(etag.c_str() + 34, &eptr, 10);
+    if (*eptr != '"' || n <= 0 || n > 10000) return -1;
+    return n;
+}
+
+bool
+preallocate(int fd, off_t size)
+{
+    if (!fallocate(fd, 0, 0, size)) return true;
+    if (errno != EOPNOTSUPP) {
+        log_error("fallocate failed: %s", strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, size) < 0) {
+        log_error("ftruncate failed: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// the parts of an object may differ in size (objects assembled by copy mode
+// or extended by append mode), so the size of every part is asked for;
+// returns 1 with the ranges, 0 if the sizes do not add up to the object size,
+// -1 if a request fails
+int
+plan_part_ranges(
+        const DownloadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        int part_count,
+        off_t size,
+        std::vector<Range> &ranges)
+{
+    std::vector<off_t> sizes(part_count, -1);
+    std::atomic<bool> failed{false};
+    {
+        ThreadPool pool(options.jobs);
+        for (int i = 0; i < part_count; ++i) {
+            pool.submit([&, i] {
+                if (failed) return;
+                aws::s3::Result res;
+                for (int attempt = 0; attempt <= options.retries; ++attempt) {
+                    res = aws::s3::head_object(bucket, key, i + 1);
+                    if (options.metrics) options.metrics->record_call(res);
+                    if (res.success) break;
+                }
+                if (!res.success) {
+                    failed = true;
+                    return;
+                }
+                sizes[i] = res.content_length;
+            });
+        }
+        pool.wait();
+    }
+    if (failed) return -1;
+
+    off_t beg = 0;
+    for (int i = 0; i < part_count; ++i) {
+        if (sizes[i] <= 0 || sizes[i] > size - beg) return 0;
+        ranges.push_back(Range{ beg, beg + sizes[i], {} });
+        beg += sizes[i];
+    }
+    if (beg != size) {
+        ranges.clear();
+        return 0;
+    }
+    return 1;
+}
+
+}
+
+bool
+download_object(
+        const DownloadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &path)
+{
+    aws::s3::Result head = aws::s3::head_object(bucket, key);
+    if (options.metrics) options.metrics->record_call(head);
+    if (!head.success) return false;
+    off_t size = head.content_length;
+    const std::string &etag = head.etag;
+
+    // ranges follow the parts, so every range can be checked against its MD5
+    std::vector<Range> ranges;
+    int part_count = etag_part_count(etag);
+    if (part_count < 0) {
+        log_warning("ETag %s is not an MD5, the data is not verified", etag.c_str());
+    } else if (part_count > 0) {
+        int r = plan_part_ranges(options, bucket, key, part_count, size, ranges);
+        if (r < 0) return false;
+        if (!r) {
+            log_warning("the parts of %s do not add up to %lld bytes, the data is not verified",
+                        etag.c_str(), (long long) size);
+            part_count = -1;
+            ranges.clear();
+        }
+    }
+    if (part_count <= 0) {
+        for (off_t beg = 0; beg < size; beg += part_size) {
+            ranges.push_back(Range{ beg, std::min(beg + part_size, size), {} });
+        }
+    }
+
+    std::string tmp_path = path + ".part";
+    int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("cannot open '%s': %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    auto fail = [&]() -> bool {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    };
+    if (size > 0 && !preallocate(fd, size)) {
+        return fail();
+    }
+
+    std::atomic<bool> failed{false};
+    {
+        ThreadPool pool(options.jobs);
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            pool.submit([&, i] {
+                if (failed) return;
+                Range &r = ranges[i];
+                int part_number = i + 1;
+                uint64_t part_start_us = monotonic_us();
+                int attempts = 0;
+                aws::s3::Result res;
+                while (1) {
+                    ++attempts;
+                    trace::Scope ts("part", part_number);
+                    MD5_CTX ctx;
+                    MD5_Init(&ctx);
+                    off_t offset = r.beg;
+                    res = aws::s3::get_object_range(bucket, key, etag, r.beg, r.end,
+                        [&](const char *data, size_t len) -> bool {
+                            if (pwrite_full(fd, data, len, offset) < 0) return false;
+                            MD5_Update(&ctx, data, len);
+                            offset += len;
+                            return true;
+                        });
+                    MD5_Final(r.md5, &ctx);
+                    if (res.success || attempts > options.retries || failed) break;
+                    log_warning("part %d failed, retrying", part_number);
+                    if (options.metrics) {
+                        options.metrics->add_retry();
+                        options.metrics->record_call(res);
+                    }
+                }
+                if (options.metrics) {
+                    options.metrics->record_part(part_number, r.end - r.beg, attempts,
+                                                 monotonic_us() - part_start_us, res);
+                }
+                if (!res.success) failed = true;
+            });
+        }
+        pool.wait();
+    }
+    if (failed) {
+        return fail();
+    }
+
+    if (part_count > 0) {
+        std::string digests;
+        for (const Range &r : ranges) {
+            digests.append((const char *) r.md5, sizeof(r.md5));
+        }
+        char buf[64];
+        if (md5_composite_etag((const unsigned char *) digests.data(), ranges.size(), buf, sizeof(buf)) < 0
+            || etag != buf) {
+            log_error("ETag mismatch: %s, downloaded data gives %s", etag.c_str(), buf);
+            return fail();
+        }
+    } else if (!part_count) {
+        // a plain ETag is the MD5 of the whole object, the file is read again
+        unsigned char digest[MD5_DIGEST_SIZE];
+        char hex[MD5_DIGEST_SIZE * 2 + 3];
+        trace::Scope ts("md5_fd_offsets");
+        if (md5_fd_offsets(fd, 0, size, digest) < 0) {
+            return fail();
+        }
+        hex[0] = '"';
+        hex_encode(hex + 1, digest, MD5_DIGEST_SIZE);
+        strcpy(hex + 1 + MD5_DIGEST_SIZE * 2, "\"");
+        if (etag != hex) {
+            log_error("ETag mismatch: %s, downloaded data gives %s", etag.c_str(), hex);
+            return fail();
+        }
+    }
+
+    if (fsync(fd) < 0) {
+        log_error("fsync failed: %s", strerror(errno));
+        return fail();
+    }
+    close(fd);
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        log_error("cannot rename '%s': %s", tmp_path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    log_info("downloaded s3://%s/%s to %s: %lld bytes in %zu ranges",
+             bucket.c_str(), key.c_str(), path.c_str(), (long long) size, ranges.size());
+    return true;
+}
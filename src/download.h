@@ -0,0 +1,23 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <string>
+
+class Metrics;
+
+struct DownloadOptions
+{
+    int jobs = 1;
+    int retries = 0;
+    Metrics *metrics = nullptr;
+};
+
+// download an object into 'path' with concurrent ranged GETs following the
+// part layout of the object, the data is verified against the ETag;
+// the file is written under a temporary name and renamed on success
+bool
+download_object(
+        const DownloadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &path);
@@ -0,0 +1,28 @@
+#include "extent.h"
+
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+int
+file_physical_offset(int fd, uint64_t *poffset)
+{
+    /* the first extent only, reading goes on sequentially from it */
+    union
+    {
+        struct fiemap fm;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } u;
+    memset(&u, 0, sizeof(u));
+    u.fm.fm_start = 0;
+    u.fm.fm_length = FIEMAP_MAX_OFFSET;
+    u.fm.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &u.fm) < 0) return -1;
+    if (u.fm.fm_mapped_extents < 1) return -1;
+    const struct fiemap_extent *fe = &u.fm.fm_extents[0];
+    /* delayed allocation or data inline in the inode */
+    if (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE)) return -1;
+    *poffset = fe->fe_physical;
+    return 0;
+}
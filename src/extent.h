@@ -0,0 +1,20 @@
+#ifndef __EXTENT_H__
+#define __EXTENT_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the physical location of the start of the file data on its device,
+   as reported by FIEMAP; returns < 0 if the file system does not
+   support FIEMAP or the first extent is not mapped yet */
+int
+file_physical_offset(int fd, uint64_t *poffset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
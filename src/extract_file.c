@@ -1,8 +1,14 @@
 #include "extract_file.h"
 #include "random.h"
 #include "base32.h"
+#include "direct_io.h"
+#include "log.h"
+#include "util.h"
 
 #include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdio.h>
@@ -36,15 +42,15 @@ extract_file_fd(
         while (rem_size > 0) {
             ssize_t r = sendfile(dstfd, srcfd, &off_in, rem_size);
             if (r < 0) {
-                fprintf(stderr, "extract_file_fd: sendfile: %s\n",
-                        strerror(errno));
-                exit(1);
+                log_error("extract_file_fd: sendfile: %s",
+                          strerror(errno));
+                return -1;
             }
             if (!r) {
-                fprintf(stderr, "sendfile returned 0!\n");
-                exit(1);
+                log_error("extract_file_fd: sendfile returned 0!");
+                return -1;
             }
-            fprintf(stderr, "sendfile success: %lld\n", (long long) r);
+            log_debug("extract_file_fd: sendfile: %lld", (long long) r);
             rem_size -= r;
         }
 
@@ -54,6 +60,83 @@ extract_file_fd(
     return retval;
 }
 
+/*
+ * copies [beg, end) of srcfd to the beginning of dstfd, on copy-on-write
+ * file systems the extents are shared (FICLONERANGE), otherwise the
+ * kernel copies the data (copy_file_range), sendfile is the last resort
+ */
+int
+reflink_file_fd(
+        int dstfd,
+        int srcfd,
+        off_t beg,
+        off_t end)
+{
+#ifdef FICLONERANGE
+    struct file_clone_range fcr =
+    {
+        .src_fd = srcfd,
+        .src_offset = beg,
+        .src_length = end - beg,
+        .dest_offset = 0,
+    };
+    if (ioctl(dstfd, FICLONERANGE, &fcr) >= 0) {
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+static int
+write_callback(const char *data, size_t size, void *arg)
+{
+    return write_full(*(int *) arg, data, size);
+}
+
+int
+copy_file_fd_direct(
+        int dstfd,
+        int srcfd,
+        off_t beg,
+        off_t end)
+{
+    if (end <= beg) return 0;
+    if (reflink_file_fd(dstfd, srcfd, beg, end) >= 0) return 0;
+    return direct_read_range(srcfd, beg, end, write_callback, &dstfd);
+}
+
+int
+clone_file_fd(
+        int dstfd,
+        int srcfd,
+        off_t beg,
+        off_t end)
+{
+    if (end <= beg) return 0;
+    if (reflink_file_fd(dstfd, srcfd, beg, end) >= 0) return 0;
+
+    off_t off_in = beg;
+    off_t off_out = 0;
+    while (off_in < end) {
+        ssize_t r = copy_file_range(srcfd, &off_in, dstfd, &off_out, end - off_in, 0);
+        if (r < 0) {
+            if (!off_out && (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                             || errno == EOPNOTSUPP)) {
+                return extract_file_fd(dstfd, srcfd, beg, end);
+            }
+            log_error("clone_file_fd: copy_file_range: %s",
+                      strerror(errno));
+            return -1;
+        }
+        if (!r) {
+            log_error("clone_file_fd: copy_file_range returned 0!");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 int
 extract_file(
         const char *name,
@@ -68,15 +151,15 @@ extract_file(
 
     int dstfd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, 0600);
     if (dstfd < 0) {
-        fprintf(stderr, "extract_file: open '%s': %s\n",
-                name, strerror(errno));
+        log_error("extract_file: open '%s': %s",
+                  name, strerror(errno));
         retval = -1;
         goto cleanup;
     }
     file_created = 1;
     if (ftruncate(dstfd, copy_size) < 0) {
-        fprintf(stderr, "extract_file: ftruncate: %s\n",
-                strerror(errno));
+        log_error("extract_file: ftruncate: %s",
+                  strerror(errno));
         retval = -1;
         goto cleanup;
     }
@@ -85,8 +168,8 @@ extract_file(
         goto cleanup;
     }
     if (fsync(dstfd) < 0) {
-        fprintf(stderr, "extract_file: fsync: %s\n",
-                strerror(errno));
+        log_error("extract_file: fsync: %s",
+                  strerror(errno));
         retval = -1;
         goto cleanup;
     }
@@ -109,6 +192,22 @@ extract_dirname(char *buf, size_t size, const char *path)
     return buf;
 }
 
+/*
+ * temporary names are derived from a per-process random key and
+ * a counter, so /dev/urandom is read only once
+ */
+static unsigned char name_key[16];
+static pthread_once_t name_key_once = PTHREAD_ONCE_INIT;
+static unsigned long long name_counter;
+
+static int name_key_status;
+
+static void
+init_name_key(void)
+{
+    name_key_status = random_bytes(name_key, sizeof(name_key));
+}
+
 int
 create_temporary_fd(
         char *buf,
@@ -134,23 +233,32 @@ create_temporary_fd(
         separator = "";
     }
 
+    pthread_once(&name_key_once, init_name_key);
+    if (name_key_status < 0) {
+        return -1;
+    }
+
     while (1) {
         unsigned char rand_key[16];
-        random_bytes(rand_key, sizeof(rand_key));
+        unsigned long long counter = __atomic_add_fetch(&name_counter, 1, __ATOMIC_RELAXED);
+        memcpy(rand_key, name_key, sizeof(rand_key));
+        for (int i = 0; i < (int) sizeof(counter); ++i) {
+            rand_key[i] ^= (unsigned char) (counter >> (i * 8));
+        }
         unsigned char rand_name[32];
         base32_buf((unsigned char *) rand_name, rand_key, sizeof(rand_key), 0);
         snprintf(out_path, sizeof(out_path), "%s%s%s", path, separator, rand_name);
-        int tfd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_EXCL, 0600);
+        int tfd = open(out_path, O_RDWR | O_CREAT | O_TRUNC | O_EXCL | O_CLOEXEC, 0600);
         if (tfd >= 0) {
             snprintf(buf, size, "%s", out_path);
             return tfd;
         }
         if (errno != EEXIST) {
-            fprintf(stderr, "create_temporary_fd: open(%s) failed: %s\n", out_path, strerror(errno));
+            log_error("create_temporary_fd: open(%s) failed: %s", out_path, strerror(errno));
             return -1;
         }
         if (attempts == 5) {
-            fprintf(stderr, "create_temporary_fd: too many attempts at opening temporary file\n");
+            log_error("create_temporary_fd: too many attempts at opening temporary file");
             return -1;
         }
         ++attempts;
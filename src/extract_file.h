@@ -14,6 +14,29 @@ extract_file_fd(
         off_t beg,
         off_t end);
 
+/* share the extents of the range, fails unless supported by the file system */
+int
+reflink_file_fd(
+        int dstfd,
+        int srcfd,
+        off_t beg,
+        off_t end);
+
+/* reflink, or copy reading the source with O_DIRECT */
+int
+copy_file_fd_direct(
+        int dstfd,
+        int srcfd,
+        off_t beg,
+        off_t end);
+
+int
+clone_file_fd(
+        int dstfd,
+        int srcfd,
+        off_t beg,
+        off_t end);
+
 int
 extract_file(
         const char *name,
@@ -0,0 +1,286 @@
+#include "log.h"
+#include "timeutil.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+int log_current_level = LOG_LEVEL_INFO;
+
+namespace {
+
+constexpr size_t FLUSH_THRESHOLD = 64 * 1024;
+constexpr int RATE_SLOTS = 256;
+
+// messages of one thread, swapped out by the writer
+struct LogBuffer
+{
+    std::mutex mutex;
+    std::string data;
+};
+
+// token bucket for a message format
+struct RateSlot
+{
+    const char *format = nullptr;
+    double tokens = 0;
+    uint64_t last_us = 0;
+    unsigned suppressed = 0;
+};
+
+std::mutex registry_mutex;
+std::vector<std::shared_ptr<LogBuffer>> registry;
+
+std::mutex writer_mutex;
+std::condition_variable writer_cond;
+std::thread writer_thread;
+std::atomic<bool> writer_running{false};
+bool writer_stopping = false;
+bool writer_kicked = false;
+
+std::mutex rate_mutex;
+RateSlot rate_slots[RATE_SLOTS];
+int rate_limit = 0;
+
+thread_local std::shared_ptr<LogBuffer> local_buffer;
+
+const char level_letters[] = "EWID";
+
+void
+write_all(const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t w = write(2, data, size);
+        if (w <= 0) return;
+        data += w;
+        size -= w;
+    }
+}
+
+// returns false if the message must be dropped, *psuppressed is
+// the number of messages dropped since the last one passed
+bool
+rate_check(const char *format, unsigned *psuppressed)
+{
+    *psuppressed = 0;
+    if (rate_limit <= 0) return true;
+
+    uint64_t now = monotonic_us();
+    size_t slot = ((uintptr_t) format >> 3) % RATE_SLOTS;
+    std::lock_guard<std::mutex> lock(rate_mutex);
+    RateSlot &rs = rate_slots[slot];
+    if (rs.format != format) {
+        rs.format = format;
+        rs.tokens = rate_limit;
+        rs.last_us = now;
+        rs.suppressed = 0;
+    } else {
+        rs.tokens += (now - rs.last_us) * rate_limit / 1e6;
+        if (rs.tokens > rate_limit) rs.tokens = rate_limit;
+        rs.last_us = now;
+    }
+    if (rs.tokens < 1) {
+        ++rs.suppressed;
+        return false;
+    }
+    rs.tokens -= 1;
+    *psuppressed = rs.suppressed;
+    rs.suppressed = 0;
+    return true;
+}
+
+void
+format_message(std::string &out, int level, unsigned suppressed, const char *format, va_list args)
+{
+    struct timeval tv;
+    struct tm tt;
+    gettimeofday(&tv, NULL);
+    localtime_r(&tv.tv_sec, &tt);
+
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%03d %c: ",
+             tt.tm_hour, tt.tm_min, tt.tm_sec, (int) (tv.tv_usec / 1000),
+             level_letters[level]);
+    if (suppressed > 0) {
+        out.append(prefix);
+        out.append(std::to_string(suppressed));
+        out.append(" similar messages suppressed\n");
+    }
+    out.append(prefix);
+
+    char buf[1024];
+    va_list args2;
+    va_copy(args2, args);
+    int len = vsnprintf(buf, sizeof(buf), format, args2);
+    va_end(args2);
+    if (len < 0) return;
+    if ((size_t) len < sizeof(buf)) {
+        out.append(buf, len);
+    } else {
+        size_t pos = out.size();
+        out.resize(pos + len + 1);
+        vsnprintf(&out[pos], len + 1, format, args);
+        out.resize(pos + len);
+    }
+    if (out.empty() || out.back() != '\n') out.push_back('\n');
+}
+
+LogBuffer *
+get_buffer()
+{
+    if (!local_buffer) {
+        local_buffer = std::make_shared<LogBuffer>();
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(local_buffer);
+    }
+    return local_buffer.get();
+}
+
+void
+drain()
+{
+    std::vector<std::shared_ptr<LogBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        buffers = registry;
+    }
+    std::string data;
+    for (auto &b : buffers) {
+        {
+            std::lock_guard<std::mutex> lock(b->mutex);
+            data.swap(b->data);
+        }
+        write_all(data.data(), data.size());
+        data.clear();
+    }
+    buffers.clear();
+
+    // forget the buffers of finished threads, nobody else can reference them
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (size_t i = 0; i < registry.size(); ) {
+        if (registry[i].use_count() == 1 && registry[i]->data.empty()) {
+            registry.erase(registry.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+void
+writer_loop()
+{
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    while (1) {
+        writer_cond.wait_for(lock, std::chrono::milliseconds(100),
+                             [] { return writer_stopping || writer_kicked; });
+        writer_kicked = false;
+        bool stopping = writer_stopping;
+        lock.unlock();
+        drain();
+        lock.lock();
+        if (stopping) break;
+    }
+}
+
+}
+
+void
+log_set_level(int level)
+{
+    if (level < LOG_LEVEL_ERROR) level = LOG_LEVEL_ERROR;
+    if (level > LOG_LEVEL_DEBUG) level = LOG_LEVEL_DEBUG;
+    log_current_level = level;
+}
+
+int
+log_parse_level(const char *str)
+{
+    if (!strcmp(str, "error")) return LOG_LEVEL_ERROR;
+    if (!strcmp(str, "warning")) return LOG_LEVEL_WARNING;
+    if (!strcmp(str, "info")) return LOG_LEVEL_INFO;
+    if (!strcmp(str, "debug")) return LOG_LEVEL_DEBUG;
+    return -1;
+}
+
+void
+log_set_rate_limit(int rate)
+{
+    rate_limit = rate;
+}
+
+int
+log_start(void)
+{
+    if (writer_running) return 0;
+    writer_stopping = false;
+    writer_thread = std::thread(writer_loop);
+    writer_running = true;
+    atexit(log_stop);
+    return 0;
+}
+
+void
+log_stop(void)
+{
+    if (!writer_running) return;
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        writer_stopping = true;
+    }
+    writer_cond.notify_one();
+    writer_thread.join();
+    writer_running = false;
+}
+
+void
+log_vprintf(int level, const char *format, va_list args)
+{
+    if (level < LOG_LEVEL_ERROR) level = LOG_LEVEL_ERROR;
+    if (level > LOG_LEVEL_DEBUG) level = LOG_LEVEL_DEBUG;
+
+    unsigned suppressed = 0;
+    if (level != LOG_LEVEL_ERROR && !rate_check(format, &suppressed)) return;
+
+    if (!writer_running) {
+        std::string msg;
+        format_message(msg, level, suppressed, format, args);
+        write_all(msg.data(), msg.size());
+        return;
+    }
+
+    LogBuffer *b = get_buffer();
+    bool kick;
+    {
+        std::lock_guard<std::mutex> lock(b->mutex);
+        format_message(b->data, level, suppressed, format, args);
+        kick = b->data.size() >= FLUSH_THRESHOLD;
+    }
+    if (kick) {
+        {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            writer_kicked = true;
+        }
+        writer_cond.notify_one();
+    }
+}
+
+void
+log_printf(int level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_vprintf(level, format, args);
+    va_end(args);
+}
@@ -0,0 +1,68 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdarg.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+    LOG_LEVEL_ERROR = 0,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+
+/*
+ * messages above LOG_COMPILE_LEVEL are removed at compile time,
+ * build with -DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO to drop the debug output
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern int log_current_level;
+
+void
+log_set_level(int level);
+
+int
+log_parse_level(const char *str);
+
+/* at most 'rate' messages per second (burst of the same size) with the same format, 0 disables */
+void
+log_set_rate_limit(int rate);
+
+/* start the background writer, until then messages are written synchronously */
+int
+log_start(void);
+
+/* flush pending messages and stop the background writer */
+void
+log_stop(void);
+
+void
+log_printf(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void
+log_vprintf(int level, const char *format, va_list args);
+
+#define LOG_AT_LEVEL(level, ...) \
+    do { \
+        if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_current_level) \
+            log_printf((level), __VA_ARGS__); \
+    } while (0)
+
+#define log_error(...) LOG_AT_LEVEL(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) LOG_AT_LEVEL(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) LOG_AT_LEVEL(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT_LEVEL(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,65 +10,138 @@
 #include <sys/mman.h>
 
 #include "base64.h"
+#include "direct_io.h"
+#include "log.h"
+#include "util.h"
 
 enum { MMAP_WINDOW_SIZE = 64 * 1024 * 1024 };
 
 int
-md5_base64_fd_offsets(
+md5_fd_offsets(
         int fd,
         off_t beg,
         off_t end,
-        char *b64_buf,
-        size_t b64_size)
+        unsigned char *digest)
 {
     int retval = 0;
-    unsigned char digest[MD5_DIGEST_LENGTH];
     MD5_CTX ctx;
     MD5_Init(&ctx);
 
+    // mmap offsets must be page aligned
+    off_t page_size = sysconf(_SC_PAGESIZE);
     while (beg < end) {
+        off_t skip = beg % page_size;
         off_t rem_size = end - beg;
         size_t mmap_size = MMAP_WINDOW_SIZE;
-        if (rem_size < mmap_size) {
-            mmap_size = rem_size;
+        if (rem_size + skip < mmap_size) {
+            mmap_size = rem_size + skip;
         }
-        const char *ptr = mmap(NULL, mmap_size, PROT_READ, MAP_PRIVATE, fd, beg);
+        const char *ptr = mmap(NULL, mmap_size, PROT_READ, MAP_PRIVATE, fd, beg - skip);
         if (ptr == MAP_FAILED) {
-            fprintf(stderr, "md5_base64_fd_offsets: mmap: %s\n",
-                    strerror(errno));
+            log_error("md5_fd_offsets: mmap: %s",
+                      strerror(errno));
             retval = -1;
             break;
         }
-        MD5_Update(&ctx, ptr, mmap_size);
+        MD5_Update(&ctx, ptr + skip, mmap_size - skip);
         munmap((void*) ptr, mmap_size);
-        beg += mmap_size;
+        beg += mmap_size - skip;
     }
 
     MD5_Final(digest, &ctx);
 
-    if (b64_size >= ((MD5_DIGEST_LENGTH + 2) / 3 * 4 + 1)) {
-        base64_encode((char*) digest, sizeof(digest), b64_buf);
-    } else {
-        char tmpbuf[(MD5_DIGEST_LENGTH + 2) / 3 * 4 + 1];
-        base64_encode((char*) digest, sizeof(digest), tmpbuf);
-        if (snprintf(b64_buf, b64_size, "%s", tmpbuf) >= b64_size) {
-	    abort();
-	}
-    }
+    return retval;
+}
 
+static int
+md5_update_callback(const char *data, size_t size, void *arg)
+{
+    MD5_Update((MD5_CTX *) arg, data, size);
+    return 0;
+}
+
+int
+md5_fd_offsets_direct(
+        int fd,
+        off_t beg,
+        off_t end,
+        unsigned char *digest)
+{
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    int retval = 0;
+    if (beg < end) {
+        retval = direct_read_range(fd, beg, end, md5_update_callback, &ctx);
+    }
+    MD5_Final(digest, &ctx);
     return retval;
 }
 
+int
+md5_digest_base64(
+        const unsigned char *digest,
+        char *b64_buf,
+        size_t b64_size)
+{
+    char tmpbuf[(MD5_DIGEST_LENGTH + 2) / 3 * 4 + 1];
+    ssize_t len = base64_encode((const char*) digest, MD5_DIGEST_LENGTH, tmpbuf);
+    tmpbuf[len] = 0;
+    if (snprintf(b64_buf, b64_size, "%s", tmpbuf) >= b64_size) {
+        log_error("md5_digest_base64: output buffer is too small");
+        return -1;
+    }
+    return 0;
+}
+
+int
+md5_base64_fd_offsets(
+        int fd,
+        off_t beg,
+        off_t end,
+        char *b64_buf,
+        size_t b64_size)
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+
+    if (md5_fd_offsets(fd, beg, end, digest) < 0) {
+        return -1;
+    }
+    return md5_digest_base64(digest, b64_buf, b64_size);
+}
+
+/*
+ * S3 ETag of a multipart object: MD5 of the concatenated part MD5s,
+ * followed by the number of parts, in quotes as returned by the API
+ */
+int
+md5_composite_etag(
+        const unsigned char *digests,
+        size_t count,
+        char *buf,
+        size_t size)
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char hex[MD5_DIGEST_LENGTH * 2 + 1];
+
+    MD5(digests, count * MD5_DIGEST_LENGTH, digest);
+    hex_encode(hex, digest, MD5_DIGEST_LENGTH);
+    if (snprintf(buf, size, "\"%s-%zu\"", hex, count) >= size) {
+        log_error("md5_composite_etag: output buffer is too small");
+        return -1;
+    }
+    return 0;
+}
+
 int md5_base64_fd(int fd, char *b64_buf, size_t b64_size)
 {
     struct stat stb;
     if (fstat(fd, &stb) < 0) {
-        fprintf(stderr, "md5_base64_fd: fstat: %s\n",
-                strerror(errno));
+        log_error("md5_base64_fd: fstat: %s",
+                  strerror(errno));
         return -1;
     }
     if (!S_ISREG(stb.st_mode)) {
-        fprintf(stderr, "md5_base64_fd: not a regular file\n");
+        log_error("md5_base64_fd: not a regular file");
         return -1;
     }
 
@@ -79,8 +152,8 @@ int md5_base64_file(const char *path, char *b64_buf, size_t b64_size)
 {
     int fd = open(path, O_RDONLY, 0);
     if (fd < 0) {
-        fprintf(stderr, "md5_base64_file: open '%s': %s\n",
-                path, strerror(errno));
+        log_error("md5_base64_file: open '%s': %s",
+                  path, strerror(errno));
         return -1;
     }
     int res = md5_base64_fd(fd, b64_buf, b64_size);
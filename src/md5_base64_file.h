@@ -5,6 +5,36 @@
 extern "C" {
 #endif
 
+enum { MD5_DIGEST_SIZE = 16 };
+
+int
+md5_fd_offsets(
+        int fd,
+        off_t beg,
+        off_t end,
+        unsigned char *digest);
+
+/* the same, reading the data with O_DIRECT */
+int
+md5_fd_offsets_direct(
+        int fd,
+        off_t beg,
+        off_t end,
+        unsigned char *digest);
+
+int
+md5_digest_base64(
+        const unsigned char *digest,
+        char *b64_buf,
+        size_t b64_size);
+
+int
+md5_composite_etag(
+        const unsigned char *digests,
+        size_t count,
+        char *buf,
+        size_t size);
+
 int
 md5_base64_fd_offsets(
         int fd,
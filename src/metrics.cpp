@@ -0,0 +1,295 @@
+#include "metrics.h"
+#include "timeutil.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+Histogram::Histogram(double first_bound, double factor, int bucket_count)
+    : counts_(bucket_count + 1)
+{
+    double bound = first_bound;
+    for (int i = 0; i < bucket_count; ++i) {
+        bounds_.push_back(bound);
+        bound *= factor;
+    }
+}
+
+void
+Histogram::observe(double value)
+{
+    size_t i = 0;
+    while (i < bounds_.size() && value > bounds_[i]) ++i;
+    ++counts_[i];
+    ++count_;
+    sum_ += value;
+}
+
+void
+Histogram::write_json(FILE *f) const
+{
+    fprintf(f, "{ \"count\": %llu, \"sum\": %.6f, \"buckets\": [",
+            (unsigned long long) count_, sum_);
+    for (size_t i = 0; i < counts_.size(); ++i) {
+        if (i > 0) fprintf(f, ", ");
+        if (i < bounds_.size()) {
+            fprintf(f, "[%g, %llu]", bounds_[i], (unsigned long long) counts_[i]);
+        } else {
+            fprintf(f, "[\"+Inf\", %llu]", (unsigned long long) counts_[i]);
+        }
+    }
+    fprintf(f, "] }");
+}
+
+void
+Histogram::write_prometheus(FILE *f, const char *name, const char *labels) const
+{
+    const char *sep = (labels && *labels)?",":"";
+    if (!labels) labels = "";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < bounds_.size(); ++i) {
+        cumulative += counts_[i];
+        fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, bounds_[i],
+                (unsigned long long) cumulative);
+    }
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long) count_);
+    if (*labels) {
+        fprintf(f, "%s_sum{%s} %.6f\n", name, labels, sum_);
+        fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long) count_);
+    } else {
+        fprintf(f, "%s_sum %.6f\n", name, sum_);
+        fprintf(f, "%s_count %llu\n", name, (unsigned long long) count_);
+    }
+}
+
+Metrics::Metrics()
+    : hash_seconds_(0.001, 2, 20),
+      stage_seconds_(0.001, 2, 20),
+      spawn_seconds_(0.0001, 2, 16),
+      transfer_seconds_(0.01, 2, 18),
+      part_seconds_(0.01, 2, 18),
+      part_bytes_(1024 * 1024, 2, 14),
+      part_mbps_(1, 2, 14)
+{
+}
+
+void
+Metrics::start()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    start_us_ = monotonic_us();
+}
+
+void
+Metrics::finish(bool success)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    finish_us_ = monotonic_us();
+    success_ = success;
+}
+
+static void
+add_children(aws::s3::CallStats &dst, const aws::s3::CallStats &src)
+{
+    dst.utime_ms += src.utime_ms;
+    dst.stime_ms += src.stime_ms;
+    if (src.maxrss_kb > dst.maxrss_kb) dst.maxrss_kb = src.maxrss_kb;
+    dst.nvcsw += src.nvcsw;
+    dst.nivcsw += src.nivcsw;
+    dst.children += src.children;
+}
+
+void
+Metrics::record_part(int part_number, off_t bytes, int attempts, uint64_t total_us, const aws::s3::Result &res)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    PartMetrics pm;
+    pm.part_number = part_number;
+    pm.bytes = bytes;
+    pm.attempts = attempts;
+    pm.success = res.success;
+    pm.total_us = total_us;
+    pm.stats = res.stats;
+    part_list_.push_back(pm);
+
+    add_children(children_, res.stats);
+    ++parts_;
+    if (!res.success) {
+        ++parts_failed_;
+        return;
+    }
+    bytes_ += bytes;
+
+    hash_seconds_.observe(res.stats.hash_us / 1e6);
+    stage_seconds_.observe(res.stats.stage_us / 1e6);
+    spawn_seconds_.observe(res.stats.spawn_us / 1e6);
+    transfer_seconds_.observe(res.stats.transfer_us / 1e6);
+    part_seconds_.observe(total_us / 1e6);
+    part_bytes_.observe(bytes);
+    if (res.stats.transfer_us > 0) {
+        part_mbps_.observe(bytes / (1024.0 * 1024.0) / (res.stats.transfer_us / 1e6));
+    }
+}
+
+void
+Metrics::record_call(const aws::s3::Result &res)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    add_children(children_, res.stats);
+}
+
+void
+Metrics::add_retry()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++retries_;
+}
+
+double
+Metrics::elapsed_seconds() const
+{
+    uint64_t end = finish_us_;
+    if (!end) end = monotonic_us();
+    if (!start_us_) return 0;
+    return (end - start_us_) / 1e6;
+}
+
+double
+Metrics::throughput_mbps() const
+{
+    double elapsed = elapsed_seconds();
+    if (elapsed <= 0) return 0;
+    return bytes_ / (1024.0 * 1024.0) / elapsed;
+}
+
+// metrics files are replaced atomically, so that collectors never see partial data
+static FILE *
+open_temporary(const std::string &path, std::string &tmp_path)
+{
+    tmp_path = path + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "w");
+    if (!f) {
+        log_error("metrics: cannot open '%s': %s", tmp_path.c_str(), strerror(errno));
+    }
+    return f;
+}
+
+static bool
+commit_temporary(FILE *f, const std::string &tmp_path, const std::string &path)
+{
+    fflush(f);
+    if (ferror(f)) {
+        log_error("metrics: write error on '%s'", tmp_path.c_str());
+        fclose(f);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    fclose(f);
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        log_error("metrics: rename to '%s' failed: %s", path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool
+Metrics::write_json(const std::string &path) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string tmp_path;
+    FILE *f = open_temporary(path, tmp_path);
+    if (!f) return false;
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"success\": %s,\n", success_?"true":"false");
+    fprintf(f, "  \"elapsed_seconds\": %.6f,\n", elapsed_seconds());
+    fprintf(f, "  \"bytes\": %llu,\n", (unsigned long long) bytes_);
+    fprintf(f, "  \"throughput_mbps\": %.3f,\n", throughput_mbps());
+    fprintf(f, "  \"parts\": %llu,\n", (unsigned long long) parts_);
+    fprintf(f, "  \"parts_failed\": %llu,\n", (unsigned long long) parts_failed_);
+    fprintf(f, "  \"retries\": %llu,\n", (unsigned long long) retries_);
+    fprintf(f, "  \"children\": { \"count\": %d, \"utime_ms\": %llu, \"stime_ms\": %llu, \"maxrss_kb\": %llu, \"nvcsw\": %llu, \"nivcsw\": %llu },\n",
+            children_.children,
+            (unsigned long long) children_.utime_ms, (unsigned long long) children_.stime_ms,
+            (unsigned long long) children_.maxrss_kb,
+            (unsigned long long) children_.nvcsw, (unsigned long long) children_.nivcsw);
+    fprintf(f, "  \"histograms\": {\n");
+    fprintf(f, "    \"hash_seconds\": "); hash_seconds_.write_json(f); fprintf(f, ",\n");
+    fprintf(f, "    \"stage_seconds\": "); stage_seconds_.write_json(f); fprintf(f, ",\n");
+    fprintf(f, "    \"spawn_seconds\": "); spawn_seconds_.write_json(f); fprintf(f, ",\n");
+    fprintf(f, "    \"transfer_seconds\": "); transfer_seconds_.write_json(f); fprintf(f, ",\n");
+    fprintf(f, "    \"part_seconds\": "); part_seconds_.write_json(f); fprintf(f, ",\n");
+    fprintf(f, "    \"part_bytes\": "); part_bytes_.write_json(f); fprintf(f, ",\n");
+    fprintf(f, "    \"part_throughput_mbps\": "); part_mbps_.write_json(f); fprintf(f, "\n");
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"part_list\": [");
+    for (size_t i = 0; i < part_list_.size(); ++i) {
+        const PartMetrics &pm = part_list_[i];
+        fprintf(f, "%s\n    { \"part_number\": %d, \"bytes\": %lld, \"attempts\": %d, \"success\": %s, \"total_us\": %llu, \"hash_us\": %llu, \"stage_us\": %llu, \"spawn_us\": %llu, \"transfer_us\": %llu, \"utime_ms\": %llu, \"stime_ms\": %llu, \"maxrss_kb\": %llu }",
+                i?",":"", pm.part_number, (long long) pm.bytes, pm.attempts, pm.success?"true":"false",
+                (unsigned long long) pm.total_us,
+                (unsigned long long) pm.stats.hash_us, (unsigned long long) pm.stats.stage_us,
+                (unsigned long long) pm.stats.spawn_us, (unsigned long long) pm.stats.transfer_us,
+                (unsigned long long) pm.stats.utime_ms, (unsigned long long) pm.stats.stime_ms,
+                (unsigned long long) pm.stats.maxrss_kb);
+    }
+    fprintf(f, "\n  ]\n}\n");
+
+    return commit_temporary(f, tmp_path, path);
+}
+
+bool
+Metrics::write_prometheus(const std::string &path) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string tmp_path;
+    FILE *f = open_temporary(path, tmp_path);
+    if (!f) return false;
+
+    fprintf(f, "# TYPE aws_uploader_success gauge\n");
+    fprintf(f, "aws_uploader_success %d\n", success_);
+    fprintf(f, "# TYPE aws_uploader_duration_seconds gauge\n");
+    fprintf(f, "aws_uploader_duration_seconds %.6f\n", elapsed_seconds());
+    fprintf(f, "# TYPE aws_uploader_throughput_mbps gauge\n");
+    fprintf(f, "aws_uploader_throughput_mbps %.3f\n", throughput_mbps());
+    fprintf(f, "# TYPE aws_uploader_bytes_total counter\n");
+    fprintf(f, "aws_uploader_bytes_total %llu\n", (unsigned long long) bytes_);
+    fprintf(f, "# TYPE aws_uploader_parts_total counter\n");
+    fprintf(f, "aws_uploader_parts_total %llu\n", (unsigned long long) parts_);
+    fprintf(f, "# TYPE aws_uploader_parts_failed_total counter\n");
+    fprintf(f, "aws_uploader_parts_failed_total %llu\n", (unsigned long long) parts_failed_);
+    fprintf(f, "# TYPE aws_uploader_retries_total counter\n");
+    fprintf(f, "aws_uploader_retries_total %llu\n", (unsigned long long) retries_);
+
+    fprintf(f, "# TYPE aws_uploader_child_processes_total counter\n");
+    fprintf(f, "aws_uploader_child_processes_total %d\n", children_.children);
+    fprintf(f, "# TYPE aws_uploader_child_cpu_seconds_total counter\n");
+    fprintf(f, "aws_uploader_child_cpu_seconds_total{mode=\"user\"} %.3f\n", children_.utime_ms / 1e3);
+    fprintf(f, "aws_uploader_child_cpu_seconds_total{mode=\"system\"} %.3f\n", children_.stime_ms / 1e3);
+    fprintf(f, "# TYPE aws_uploader_child_maxrss_bytes gauge\n");
+    fprintf(f, "aws_uploader_child_maxrss_bytes %llu\n", (unsigned long long) children_.maxrss_kb * 1024);
+    fprintf(f, "# TYPE aws_uploader_child_context_switches_total counter\n");
+    fprintf(f, "aws_uploader_child_context_switches_total{kind=\"voluntary\"} %llu\n",
+            (unsigned long long) children_.nvcsw);
+    fprintf(f, "aws_uploader_child_context_switches_total{kind=\"involuntary\"} %llu\n",
+            (unsigned long long) children_.nivcsw);
+
+    fprintf(f, "# TYPE aws_uploader_stage_duration_seconds histogram\n");
+    hash_seconds_.write_prometheus(f, "aws_uploader_stage_duration_seconds", "stage=\"hash\"");
+    stage_seconds_.write_prometheus(f, "aws_uploader_stage_duration_seconds", "stage=\"staging\"");
+    spawn_seconds_.write_prometheus(f, "aws_uploader_stage_duration_seconds", "stage=\"spawn\"");
+    transfer_seconds_.write_prometheus(f, "aws_uploader_stage_duration_seconds", "stage=\"transfer\"");
+    fprintf(f, "# TYPE aws_uploader_part_duration_seconds histogram\n");
+    part_seconds_.write_prometheus(f, "aws_uploader_part_duration_seconds", NULL);
+    fprintf(f, "# TYPE aws_uploader_part_bytes histogram\n");
+    part_bytes_.write_prometheus(f, "aws_uploader_part_bytes", NULL);
+    fprintf(f, "# TYPE aws_uploader_part_throughput_mbps histogram\n");
+    part_mbps_.write_prometheus(f, "aws_uploader_part_throughput_mbps", NULL);
+
+    return commit_temporary(f, tmp_path, path);
+}
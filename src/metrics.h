@@ -0,0 +1,90 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "awss3api.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <cstdio>
+#include <sys/types.h>
+
+// histogram with exponentially growing bucket bounds
+class Histogram
+{
+    std::vector<double> bounds_;
+    std::vector<uint64_t> counts_;   // bounds_.size() + 1 (the last is +Inf)
+    uint64_t count_ = 0;
+    double sum_ = 0;
+
+public:
+    Histogram(double first_bound, double factor, int bucket_count);
+
+    void observe(double value);
+
+    uint64_t count() const { return count_; }
+    double sum() const { return sum_; }
+
+    void write_json(FILE *f) const;
+    void write_prometheus(FILE *f, const char *name, const char *labels) const;
+};
+
+struct PartMetrics
+{
+    int part_number = 0;
+    off_t bytes = 0;
+    int attempts = 0;
+    bool success = false;
+    uint64_t total_us = 0;
+    aws::s3::CallStats stats;
+};
+
+// upload statistics, exported as JSON or as Prometheus textfile
+class Metrics
+{
+    mutable std::mutex mutex_;
+
+    uint64_t start_us_ = 0;
+    uint64_t finish_us_ = 0;
+    bool success_ = false;
+
+    uint64_t bytes_ = 0;
+    uint64_t parts_ = 0;
+    uint64_t parts_failed_ = 0;
+    uint64_t retries_ = 0;
+
+    // summed over all aws children, maxrss is the peak
+    aws::s3::CallStats children_;
+
+    Histogram hash_seconds_;
+    Histogram stage_seconds_;
+    Histogram spawn_seconds_;
+    Histogram transfer_seconds_;
+    Histogram part_seconds_;
+    Histogram part_bytes_;
+    Histogram part_mbps_;
+
+    std::vector<PartMetrics> part_list_;
+
+public:
+    Metrics();
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator= (const Metrics &) = delete;
+
+    void start();
+    void finish(bool success);
+
+    // account the final attempt of a part upload
+    void record_part(int part_number, off_t bytes, int attempts, uint64_t total_us, const aws::s3::Result &res);
+    // account a non-part call (create, complete, abort)
+    void record_call(const aws::s3::Result &res);
+    void add_retry();
+
+    double elapsed_seconds() const;
+    double throughput_mbps() const;
+
+    bool write_json(const std::string &path) const;
+    bool write_prometheus(const std::string &path) const;
+};
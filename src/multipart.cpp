@@ -0,0 +1,607 @@
+#include "multipart.h"
+#include "metrics.h"
+#include "staging.h"
+#include "aimd.h"
+#include "checksum_cache.h"
+#include "remote_index.h"
+#include "shard.h"
+#include "thread_pool.h"
+#include "timeutil.h"
+#include "trace.h"
+#include "log.h"
+#include "md5_base64_file.h"
+#include "direct_io.h"
+
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+void
+plan_parts(
+        std::vector<PartSource> &parts,
+        int fd,
+        const std::string &copy_source,
+        off_t beg,
+        off_t end)
+{
+    off_t cur_beg = beg;
+    while (cur_beg < end) {
+        off_t upload_size = 0;
+        if (cur_beg + part_size + min_part_size >= end) {
+            upload_size = end - cur_beg;
+        } else if (cur_beg + part_size >= end) {
+            upload_size = end - cur_beg;
+        } else {
+            upload_size = part_size;
+        }
+        PartSource ps;
+        ps.fd = fd;
+        ps.copy_source = copy_source;
+        ps.beg = cur_beg;
+        ps.end = cur_beg + upload_size;
+        parts.push_back(std::move(ps));
+        cur_beg += upload_size;
+    }
+}
+
+bool
+check_parts(const std::vector<PartSource> &parts)
+{
+    if (parts.empty()) {
+        log_error("nothing to upload");
+        return false;
+    }
+    if (parts.size() > 10000) {
+        log_error("too many parts: %zu", parts.size());
+        return false;
+    }
+    for (size_t i = 0; i < parts.size(); ++i) {
+        off_t size = parts[i].end - parts[i].beg;
+        if (size > s3_max_part_size) {
+            log_error("part %zu is too large: %lld", i + 1, (long long) size);
+            return false;
+        }
+        if (i + 1 < parts.size() && size < s3_min_part_size) {
+            log_error("part %zu is too small: %lld", i + 1, (long long) size);
+            return false;
+        }
+    }
+    return true;
+}
+
+// MD5 of a local part, read according to the cache mode; 'dropping' is set
+// when the part is not read again soon, so it can leave the cache in drop mode
+static bool
+hash_part(const PartSource &ps, CacheMode cache_mode, bool dropping, int part_number, std::string &md5)
+{
+    unsigned char digest[MD5_DIGEST_SIZE];
+    trace::Scope ts("md5_fd_offsets", part_number);
+    int r;
+    if (cache_mode == CacheMode::direct) {
+        r = md5_fd_offsets_direct(ps.fd, ps.beg, ps.end, digest);
+    } else {
+        r = md5_fd_offsets(ps.fd, ps.beg, ps.end, digest);
+        if (cache_mode == CacheMode::drop && dropping) cache_dont_need(ps.fd, ps.beg, ps.end);
+    }
+    if (r < 0) return false;
+    md5.assign((const char *) digest, sizeof(digest));
+    return true;
+}
+
+bool
+compute_part_md5s(std::vector<PartSource> &parts, int jobs, CacheMode cache_mode)
+{
+    std::atomic<bool> failed{false};
+    ThreadPool pool(jobs);
+    for (size_t i = 0; i < parts.size(); ++i) {
+        PartSource &ps = parts[i];
+        if (ps.fd < 0 || ps.md5.size() == MD5_DIGEST_SIZE) continue;
+        pool.submit([&ps, &failed, i, cache_mode] {
+            if (failed) return;
+            if (!hash_part(ps, cache_mode, true, i + 1, ps.md5)) failed = true;
+        });
+    }
+    pool.wait();
+    return !failed;
+}
+
+std::string
+composite_etag(const std::vector<PartSource> &parts)
+{
+    std::string digests;
+    digests.reserve(parts.size() * MD5_DIGEST_SIZE);
+    for (const PartSource &ps : parts) {
+        if (ps.md5.size() != MD5_DIGEST_SIZE) return std::string();
+        digests.append(ps.md5);
+    }
+    char buf[64];
+    if (md5_composite_etag((const unsigned char *) digests.data(), parts.size(), buf, sizeof(buf)) < 0) {
+        return std::string();
+    }
+    return std::string(buf);
+}
+
+bool
+remote_object_matches(
+        const std::string &bucket,
+        const std::string &key,
+        const std::vector<PartSource> &parts,
+        Metrics *metrics)
+{
+    std::string etag = composite_etag(parts);
+    if (!etag.length()) return false;
+    off_t size = 0;
+    for (const PartSource &ps : parts) {
+        size += ps.end - ps.beg;
+    }
+
+    // a missing object is reported as a failure of head-object
+    aws::s3::Result res = aws::s3::head_object(bucket, key);
+    if (metrics) metrics->record_call(res);
+    if (!res.success) return false;
+    log_info("local: size %lld, ETag %s; remote: size %lld, ETag %s",
+             (long long) size, etag.c_str(), (long long) res.content_length, res.etag.c_str());
+    return res.content_length == size && res.etag == etag;
+}
+
+MultipartUpload::MultipartUpload(const UploadOptions &options, const std::string &bucket, const std::string &key)
+    : options_(options), bucket_(bucket), key_(key)
+{
+}
+
+bool
+MultipartUpload::create(const aws::s3::Metadata &metadata)
+{
+    if (options_.prefix_rates) options_.prefix_rates->acquire(key_);
+    aws::s3::Result res = aws::s3::create_multipart_upload(bucket_, key_, metadata);
+    if (options_.metrics) options_.metrics->record_call(res);
+    if (options_.prefix_rates) options_.prefix_rates->record(key_, aws::s3::throttled(res));
+    printf("res.success: %d\n", res.success);
+    printf("res.bucket: %s\n", res.bucket.c_str());
+    printf("res.key: %s\n", res.key.c_str());
+    printf("res.upload_id: %s\n", res.upload_id.c_str());
+    if (!res.success) return false;
+    upload_id_ = std::move(res.upload_id);
+    return true;
+}
+
+aws::s3::Result
+MultipartUpload::upload_one(const PartSource &part, int part_number)
+{
+    if (part.copy_source.length()) {
+        return aws::s3::upload_part_copy(bucket_, key_, upload_id_, part_number,
+                                         part.copy_source, part.beg, part.end, part.copy_if_match);
+    }
+    // hashed here rather than in upload_part, so the MD5 is kept for the checksum cache
+    std::string md5 = part.md5;
+    if (part_md5s_[part_number - 1].size() == MD5_DIGEST_SIZE) {
+        md5 = part_md5s_[part_number - 1];      // hashed by a failed attempt
+    }
+    uint64_t hash_us = 0;
+    if (md5.size() != MD5_DIGEST_SIZE) {
+        uint64_t t0 = monotonic_us();
+        if (!hash_part(part, options_.cache_mode, false, part_number, md5)) {
+            aws::s3::Result res;
+            res.message = "md5 computation failed";
+            return res;
+        }
+        hash_us = monotonic_us() - t0;
+    }
+    part_md5s_[part_number - 1] = md5;
+    aws::s3::Result res = aws::s3::upload_part(bucket_, key_, upload_id_, *options_.staging,
+                                               part_number, part.fd, part.beg, part.end, md5);
+    res.stats.hash_us += hash_us;
+    return res;
+}
+
+std::string
+MultipartUpload::run_part(int part_number, off_t bytes, const std::function<aws::s3::Result()> &call)
+{
+    uint64_t part_start_us = monotonic_us();
+    int attempts = 0;
+    aws::s3::Result res2;
+    while (1) {
+        ++attempts;
+        trace::Scope ts("part", part_number);
+        // the prefix token is taken within the slot, so the pacing is not
+        // used up by the parts still waiting for a slot
+        uint64_t ticket = options_.limiter?options_.limiter->acquire():0;
+        if (options_.prefix_rates) options_.prefix_rates->acquire(key_);
+        uint64_t t0 = monotonic_us();
+        res2 = call();
+        if (options_.limiter) {
+            options_.limiter->release(ticket, bytes, monotonic_us() - t0, res2.success, aws::s3::throttled(res2));
+        }
+        if (options_.prefix_rates) options_.prefix_rates->record(key_, aws::s3::throttled(res2));
+        if (aws::s3::precondition_failed(res2)) {
+            // the copy source has changed, a retry fails the same way
+            source_changed_ = true;
+            break;
+        }
+        if (res2.success || attempts > (attached_?0:options_.retries) || failed_) break;
+        log_warning("part %d failed, retrying", part_number);
+        if (options_.metrics) {
+            options_.metrics->add_retry();
+            options_.metrics->record_call(res2);
+        }
+    }
+    if (options_.metrics) {
+        options_.metrics->record_part(part_number, bytes, attempts,
+                                      monotonic_us() - part_start_us, res2);
+    }
+    printf("res2.success: %d\n", res2.success);
+    printf("res2.ETag: %s\n", res2.etag.c_str());
+    if (!res2.success) {
+        if (!attached_) failed_ = true;
+        return std::string();
+    }
+    bytes_ += bytes;
+    return std::move(res2.etag);
+}
+
+bool
+MultipartUpload::upload_parts(const std::vector<PartSource> &parts)
+{
+    etags_.assign(parts.size(), std::string());
+    part_md5s_.assign(parts.size(), std::string());
+    failed_ = false;
+    source_changed_ = false;
+    bytes_ = 0;
+    {
+        ThreadPool pool(options_.jobs);
+        for (size_t i = 0; i < parts.size(); ++i) {
+            pool.submit([this, &parts, &pool, i] {
+                if (failed_) return;
+                const PartSource &ps = parts[i];
+                // the part to start when this one finishes is read in the background
+                size_t next = i + pool.size();
+                if (options_.cache_mode != CacheMode::direct && next < parts.size() && parts[next].fd >= 0) {
+                    cache_will_need(parts[next].fd, parts[next].beg, parts[next].end);
+                }
+                etags_[i] = run_part(i + 1, ps.end - ps.beg, [&] { return upload_one(ps, i + 1); });
+                if (options_.cache_mode == CacheMode::drop && ps.fd >= 0 && etags_[i].length()) {
+                    cache_dont_need(ps.fd, ps.beg, ps.end);
+                }
+            });
+        }
+        pool.wait();
+    }
+    return !failed_;
+}
+
+bool
+MultipartUpload::upload_stream(const PartProducer &next)
+{
+    etags_.clear();
+    failed_ = false;
+    bytes_ = 0;
+
+    // at most 'jobs' produced parts wait for the upload, so the staging
+    // area is not filled with the whole transformed input
+    std::mutex mutex;
+    std::condition_variable cond;
+    int in_flight = 0;
+    {
+        ThreadPool pool(options_.jobs);
+        for (int part_number = 1; !failed_; ++part_number) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&] { return in_flight < options_.jobs || failed_; });
+            }
+            if (failed_) break;
+
+            auto file = std::make_shared<StagedFile>();
+            std::string md5;
+            int r;
+            {
+                trace::Scope ts("produce", part_number);
+                r = next(*file, md5);
+            }
+            if (r < 0) {
+                failed_ = true;
+                break;
+            }
+            if (!r) break;
+            if (part_number > 10000) {
+                log_error("too many parts");
+                failed_ = true;
+                break;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                etags_.resize(part_number);
+                ++in_flight;
+            }
+            pool.submit([this, file, md5, part_number, &mutex, &cond, &in_flight] {
+                std::string etag;
+                if (!failed_) {
+                    etag = run_part(part_number, file->size(), [&] {
+                        return aws::s3::upload_part_file(bucket_, key_, upload_id_, part_number,
+                                                         file->path(), file->size(), md5);
+                    });
+                }
+                file->reset();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    etags_[part_number - 1] = std::move(etag);
+                    --in_flight;
+                }
+                cond.notify_one();
+            });
+        }
+        pool.wait();
+    }
+    if (etags_.empty()) {
+        log_error("nothing to upload");
+        return false;
+    }
+    return !failed_;
+}
+
+void
+MultipartUpload::start_parts(size_t count)
+{
+    etags_.assign(count, std::string());
+    part_md5s_.assign(count, std::string());
+    failed_ = false;
+    bytes_ = 0;
+}
+
+bool
+MultipartUpload::upload_prepared(int part_number, const std::string &path, off_t size, const std::string &md5)
+{
+    if (failed_) return false;
+    part_md5s_[part_number - 1] = md5;
+    etags_[part_number - 1] = run_part(part_number, size, [&] {
+        return aws::s3::upload_part_file(bucket_, key_, upload_id_, part_number, path, size, md5);
+    });
+    return !failed_;
+}
+
+void
+MultipartUpload::attach(const std::string &upload_id, size_t count)
+{
+    upload_id_ = upload_id;
+    attached_ = true;
+    start_parts(count);
+}
+
+std::string
+MultipartUpload::upload_part(int part_number, const PartSource &part)
+{
+    if (failed_) return std::string();
+    std::string etag = run_part(part_number, part.end - part.beg, [&] { return upload_one(part, part_number); });
+    etags_[part_number - 1] = etag;
+    return etag;
+}
+
+void
+MultipartUpload::set_part_etag(int part_number, const std::string &etag, off_t size)
+{
+    etags_[part_number - 1] = etag;
+    bytes_ += size;
+}
+
+bool
+MultipartUpload::complete()
+{
+    if (options_.prefix_rates) options_.prefix_rates->acquire(key_);
+    trace::begin("complete", -1);
+    aws::s3::Result res3 = aws::s3::complete_multipart_upload(bucket_, key_, upload_id_, etags_);
+    trace::end("complete", -1);
+    if (options_.metrics) options_.metrics->record_call(res3);
+    if (options_.prefix_rates) options_.prefix_rates->record(key_, aws::s3::throttled(res3));
+    printf("res3.success: %d\n", res3.success);
+    if (!res3.success) return false;
+    etag_ = std::move(res3.etag);
+    if (options_.remote_index) {
+        aws::s3::ObjectInfo info;
+        info.key = key_;
+        info.size = bytes_;
+        info.etag = etag_;
+        info.mtime = time(NULL);
+        options_.remote_index->put(bucket_, info);
+    }
+    return true;
+}
+
+void
+MultipartUpload::abort()
+{
+    aws::s3::Result res = aws::s3::abort_multipart_upload(bucket_, key_, upload_id_);
+    if (options_.metrics) options_.metrics->record_call(res);
+}
+
+bool
+upload_object(
+        const UploadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        std::vector<PartSource> &parts,
+        bool *pskipped)
+{
+    if (pskipped) *pskipped = false;
+    ChecksumCache::Snapshot snapshot;
+    if (options.checksum_cache) {
+        options.checksum_cache->load(parts, snapshot);
+    }
+    if (options.skip_identical) {
+        // the part MD5s are kept for the upload, so the data is hashed only once
+        if (!compute_part_md5s(parts, options.jobs, options.cache_mode)) {
+            return false;
+        }
+        if (options.checksum_cache) {
+            options.checksum_cache->store(parts, snapshot);
+        }
+        if (remote_object_matches(bucket, key, parts, options.metrics)) {
+            log_info("s3://%s/%s is identical, upload skipped", bucket.c_str(), key.c_str());
+            printf("skipped: 1\n");
+            if (pskipped) *pskipped = true;
+            return true;
+        }
+    }
+
+    MultipartUpload upload(options, bucket, key);
+    if (!upload.create()) {
+        return false;
+    }
+    if (!upload.upload_parts(parts) || !upload.complete()) {
+        upload.abort();
+        return false;
+    }
+    if (options.checksum_cache) {
+        const std::vector<std::string> &md5s = upload.part_md5s();
+        for (size_t i = 0; i < parts.size(); ++i) {
+            if (parts[i].fd >= 0 && parts[i].md5.size() != MD5_DIGEST_SIZE) parts[i].md5 = md5s[i];
+        }
+        options.checksum_cache->store(parts, snapshot);
+    }
+    return true;
+}
+
+bool
+upload_fanout(
+        const UploadOptions &options,
+        const std::vector<std::string> &buckets,
+        const std::string &key,
+        std::vector<PartSource> &parts)
+{
+    for (const PartSource &ps : parts) {
+        if (ps.fd < 0) {
+            log_error("fan-out supports local parts only");
+            return false;
+        }
+    }
+
+    ChecksumCache::Snapshot snapshot;
+    if (options.checksum_cache) {
+        options.checksum_cache->load(parts, snapshot);
+    }
+    // identical destinations are found before anything is uploaded
+    if (options.skip_identical) {
+        if (!compute_part_md5s(parts, options.jobs, options.cache_mode)) {
+            return false;
+        }
+        if (options.checksum_cache) {
+            options.checksum_cache->store(parts, snapshot);
+        }
+    }
+
+    bool ok = true;
+    std::vector<std::unique_ptr<MultipartUpload>> uploads;
+    for (const std::string &bucket : buckets) {
+        if (options.skip_identical && remote_object_matches(bucket, key, parts, options.metrics)) {
+            log_info("s3://%s/%s is identical, upload skipped", bucket.c_str(), key.c_str());
+            continue;
+        }
+        std::unique_ptr<MultipartUpload> upload(new MultipartUpload(options, bucket, key));
+        if (!upload->create()) {
+            log_error("s3://%s/%s: create failed", bucket.c_str(), key.c_str());
+            ok = false;
+            continue;
+        }
+        upload->start_parts(parts.size());
+        uploads.push_back(std::move(upload));
+    }
+    if (uploads.empty()) return ok;
+
+    {
+        ThreadPool pool(options.jobs);
+        for (size_t i = 0; i < parts.size(); ++i) {
+            pool.submit([&, i] {
+                std::vector<MultipartUpload *> live;
+                for (auto &u : uploads) {
+                    if (!u->failed()) live.push_back(u.get());
+                }
+                if (live.empty()) return;
+
+                PartSource &ps = parts[i];
+                int part_number = i + 1;
+                if (ps.md5.size() != MD5_DIGEST_SIZE
+                    && !hash_part(ps, options.cache_mode, false, part_number, ps.md5)) {
+                    log_error("part %d: md5 computation failed", part_number);
+                    for (MultipartUpload *u : live) u->fail();
+                    return;
+                }
+                StagedFile staged;
+                {
+                    trace::Scope ts("extract_file_fd", part_number);
+                    if (!options.staging->stage(staged, ps.fd, ps.beg, ps.end)) {
+                        log_error("part %d: staging failed", part_number);
+                        for (MultipartUpload *u : live) u->fail();
+                        return;
+                    }
+                }
+                // the staged copy is shared by the destinations
+                std::vector<std::thread> threads;
+                for (size_t j = 1; j < live.size(); ++j) {
+                    threads.emplace_back([&, j] {
+                        live[j]->upload_prepared(part_number, staged.path(), ps.end - ps.beg, ps.md5);
+                    });
+                }
+                live[0]->upload_prepared(part_number, staged.path(), ps.end - ps.beg, ps.md5);
+                for (auto &t : threads) t.join();
+
+                if (options.cache_mode == CacheMode::drop) {
+                    cache_dont_need(ps.fd, ps.beg, ps.end);
+                }
+            });
+        }
+        pool.wait();
+    }
+
+    if (options.checksum_cache) {
+        options.checksum_cache->store(parts, snapshot);
+    }
+    for (auto &u : uploads) {
+        bool done = !u->failed() && u->complete();
+        if (!done) {
+            u->abort();
+            ok = false;
+        }
+        log_info("s3://%s/%s: %s", u->bucket().c_str(), u->key().c_str(), done?"completed":"aborted");
+    }
+    return ok;
+}
+
+bool
+upload_file(
+        const UploadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &path,
+        bool *pskipped)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat stb;
+    if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode)) {
+        log_error("'%s' is not a regular file", path.c_str());
+        close(fd);
+        return false;
+    }
+    if (stb.st_size <= 0) {
+        log_error("'%s' is empty", path.c_str());
+        close(fd);
+        return false;
+    }
+
+    std::vector<PartSource> parts;
+    plan_parts(parts, fd, std::string(), 0, stb.st_size);
+    bool ok = check_parts(parts) && upload_object(options, bucket, key, parts, pskipped);
+    close(fd);
+    return ok;
+}
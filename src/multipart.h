@@ -0,0 +1,179 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "awss3api.h"
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <sys/types.h>
+
+class StagingArea;
+class Metrics;
+class StagedFile;
+class ConcurrencyLimiter;
+class ChecksumCache;
+class RemoteIndex;
+class KeySharder;
+class PrefixRates;
+
+constexpr off_t part_size = 512*1024*1024;
+constexpr off_t min_part_size = 128*1024*1024;
+
+// limits of S3 on the size of a part, except the last one
+constexpr off_t s3_min_part_size = 5*1024*1024;
+constexpr off_t s3_max_part_size = 5LL*1024*1024*1024;
+
+// a part of the multipart upload: a range of a local file,
+// or a range of an existing object for server-side copy
+struct PartSource
+{
+    int fd = -1;
+    std::string copy_source;    // "bucket/key"
+    std::string copy_if_match;  // ETag the copy source must still have, empty - any
+    off_t beg = 0;
+    off_t end = 0;
+    std::string md5;            // binary MD5 of a local part, if already known
+};
+
+// treatment of the page cache of the local files:
+// keep - read-ahead of upcoming parts only,
+// drop - read-ahead, and the ranges of uploaded parts are dropped from the cache,
+// direct - the data is read with O_DIRECT for hashing and staging
+enum class CacheMode { keep, drop, direct };
+
+struct UploadOptions
+{
+    int jobs = 1;
+    int retries = 0;
+    bool skip_identical = false;    // only for objects made of local parts
+    CacheMode cache_mode = CacheMode::keep;
+    StagingArea *staging = nullptr;
+    Metrics *metrics = nullptr;
+    ConcurrencyLimiter *limiter = nullptr;    // adaptive limit below 'jobs'
+    ChecksumCache *checksum_cache = nullptr;
+    RemoteIndex *remote_index = nullptr;      // completed objects are recorded
+    KeySharder *sharder = nullptr;            // batch modes store the keys under hash-derived prefixes
+    PrefixRates *prefix_rates = nullptr;      // requests are counted and paced per key prefix
+};
+
+// split [beg, end) into parts of part_size, a short tail is merged into the last part
+void
+plan_parts(
+        std::vector<PartSource> &parts,
+        int fd,
+        const std::string &copy_source,
+        off_t beg,
+        off_t end);
+
+// check that all parts but the last fit into the S3 limits
+bool
+check_parts(const std::vector<PartSource> &parts);
+
+// compute the MD5 of the local parts that do not have one yet
+bool
+compute_part_md5s(std::vector<PartSource> &parts, int jobs, CacheMode cache_mode = CacheMode::keep);
+
+// the ETag S3 assigns to a multipart object made of the parts, MD5s must be known
+std::string
+composite_etag(const std::vector<PartSource> &parts);
+
+// true if the object exists and has the size and the ETag the parts would produce
+bool
+remote_object_matches(
+        const std::string &bucket,
+        const std::string &key,
+        const std::vector<PartSource> &parts,
+        Metrics *metrics);
+
+// produce the next part of a stream into 'file' and store its binary MD5;
+// returns 1 if a part is produced, 0 at the end of the stream, -1 on error
+using PartProducer = std::function<int(StagedFile &file, std::string &md5)>;
+
+class MultipartUpload
+{
+    const UploadOptions &options_;
+    std::string bucket_;
+    std::string key_;
+    std::string upload_id_;
+    std::vector<std::string> etags_;
+    std::vector<std::string> part_md5s_;    // binary MD5s of the local parts
+    std::atomic<bool> failed_{false};
+    bool attached_ = false;                 // the coordinator retries and tracks failures
+    std::atomic<bool> source_changed_{false};  // a copy source failed its if-match
+    std::atomic<int64_t> bytes_{0};         // of the uploaded parts
+    std::string etag_;                      // of the completed object
+
+    aws::s3::Result upload_one(const PartSource &part, int part_number);
+    // run the upload of a part with retries, returns the ETag or an empty string
+    std::string run_part(int part_number, off_t bytes, const std::function<aws::s3::Result()> &call);
+
+public:
+    MultipartUpload(const UploadOptions &options, const std::string &bucket, const std::string &key);
+
+    MultipartUpload(const MultipartUpload &) = delete;
+    MultipartUpload &operator= (const MultipartUpload &) = delete;
+
+    const std::string &bucket() const { return bucket_; }
+    const std::string &key() const { return key_; }
+    const std::string &upload_id() const { return upload_id_; }
+    const std::vector<std::string> &etags() const { return etags_; }
+    const std::vector<std::string> &part_md5s() const { return part_md5s_; }
+    const std::string &etag() const { return etag_; }
+
+    bool create(const aws::s3::Metadata &metadata = aws::s3::Metadata());
+    // upload the parts concurrently, part numbers start from 1
+    bool upload_parts(const std::vector<PartSource> &parts);
+    // upload the produced parts while the next ones are being produced
+    bool upload_stream(const PartProducer &next);
+
+    // parts prepared by the caller (fan-out): set the number of parts, then
+    // upload each from a file holding its data
+    void start_parts(size_t count);
+    bool upload_prepared(int part_number, const std::string &path, off_t size, const std::string &md5);
+    bool failed() const { return failed_; }
+    // the last upload_parts() failed because a copy source had changed
+    bool source_changed() const { return source_changed_; }
+    void fail() { failed_ = true; }
+
+    // an upload created by another process (the coordinator): attach to it,
+    // then upload single parts, possibly from several threads;
+    // returns the ETag of the part or an empty string, a part is tried once
+    // and its failure does not fail the rest
+    void attach(const std::string &upload_id, size_t count);
+    std::string upload_part(int part_number, const PartSource &part);
+    // the ETag of a part uploaded by another process, after start_parts()
+    void set_part_etag(int part_number, const std::string &etag, off_t size);
+
+    bool complete();
+    void abort();
+};
+
+// upload an object made of the parts; with skip_identical the upload is
+// skipped if the remote object matches, which is reported in *pskipped
+bool
+upload_object(
+        const UploadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        std::vector<PartSource> &parts,
+        bool *pskipped = nullptr);
+
+// upload the same local parts to several buckets under the same key, every part is
+// read and hashed once; each destination is completed or aborted on its own
+bool
+upload_fanout(
+        const UploadOptions &options,
+        const std::vector<std::string> &buckets,
+        const std::string &key,
+        std::vector<PartSource> &parts);
+
+// upload a local file as a single object
+bool
+upload_file(
+        const UploadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &path,
+        bool *pskipped = nullptr);
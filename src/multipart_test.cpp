@@ -0,0 +1,82 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "multipart.h"
+
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <openssl/md5.h>
+
+static std::string
+md5_of(const std::string &data)
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5((const unsigned char *) data.data(), data.size(), digest);
+    return std::string((const char *) digest, sizeof(digest));
+}
+
+static std::vector<PartSource>
+plan(off_t beg, off_t end)
+{
+    std::vector<PartSource> parts;
+    plan_parts(parts, 3, std::string(), beg, end);
+    return parts;
+}
+
+int main()
+{
+    const off_t MB = 1024 * 1024;
+
+    // a tail shorter than min_part_size is merged into the last part
+    std::vector<PartSource> parts = plan(0, part_size + min_part_size);
+    assert(parts.size() == 1);
+    assert(parts[0].beg == 0 && parts[0].end == part_size + min_part_size);
+    assert(parts[0].fd == 3 && parts[0].copy_source.empty());
+
+    parts = plan(0, part_size + min_part_size + 1);
+    assert(parts.size() == 2);
+    assert(parts[0].end == part_size && parts[1].beg == part_size);
+    assert(parts[1].end == part_size + min_part_size + 1);
+
+    parts = plan(100, 100 + 3 * part_size);
+    assert(parts.size() == 3);
+    for (size_t i = 0; i < parts.size(); ++i) {
+        assert(parts[i].beg == 100 + (off_t) i * part_size);
+        assert(parts[i].end - parts[i].beg == part_size);
+    }
+    assert(check_parts(parts));
+
+    parts.clear();
+    plan_parts(parts, -1, "bucket/key", 0, 10 * MB);
+    assert(parts.size() == 1 && parts[0].fd == -1 && parts[0].copy_source == "bucket/key");
+    assert(check_parts(parts));
+
+    // only the last part may be short
+    parts = plan(0, 10 * MB);
+    plan_parts(parts, 3, std::string(), 10 * MB, 20 * MB);
+    assert(check_parts(parts));
+    parts = plan(0, 4 * MB);
+    plan_parts(parts, 3, std::string(), 4 * MB, 20 * MB);
+    assert(!check_parts(parts));
+    parts.clear();
+    assert(!check_parts(parts));
+    parts = plan(0, s3_max_part_size + 1);
+    parts.resize(1);
+    parts[0].end = s3_max_part_size + 1;
+    assert(!check_parts(parts));
+
+    // the ETag of an object made of the parts "a" and "b"
+    parts.assign(2, PartSource());
+    parts[0].md5 = md5_of("a");
+    parts[1].md5 = md5_of("b");
+    assert(composite_etag(parts) == "\"96e024ba2074fe77e8e965ba43a704be-2\"");
+    parts.resize(1);
+    assert(composite_etag(parts) == "\"b6ff9a06b7e20bcb2858c5b8ff744aea-1\"");
+    parts.emplace_back();
+    assert(composite_etag(parts).empty());
+
+    printf("multipart_test: ok\n");
+}
@@ -0,0 +1,370 @@
+#include "pack.h"
+#include "download.h"
+#include "metrics.h"
+#include "staging.h"
+#include "trace.h"
+#include "extent.h"
+#include "log.h"
+#include "md5_base64_file.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace {
+
+constexpr size_t pack_buffer_size = 1024*1024;
+
+}
+
+Packer::Packer(StagingArea &staging, off_t target)
+    : staging_(staging), target_(target)
+{
+}
+
+Packer::~Packer()
+{
+    if (fd_ >= 0) close(fd_);
+}
+
+bool
+Packer::add(const std::string &path, const std::string &name)
+{
+    struct stat stb;
+    if (lstat(path.c_str(), &stb) < 0) {
+        log_error("cannot stat '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    if (S_ISREG(stb.st_mode)) {
+        if (strchr(name.c_str(), '\n') || name.size() != strlen(name.c_str())) {
+            log_warning("'%s': unsupported name, skipped", path.c_str());
+            return true;
+        }
+        paths_.push_back(path);
+        PackEntry e;
+        e.name = name;
+        entries_.push_back(std::move(e));
+        return true;
+    }
+    if (!S_ISDIR(stb.st_mode)) return true;
+
+    // sorted, so that packing the same tree gives the same layout
+    DIR *d = opendir(path.c_str());
+    if (!d) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    std::vector<std::string> names;
+    struct dirent *dd;
+    while ((dd = readdir(d))) {
+        if (!strcmp(dd->d_name, ".") || !strcmp(dd->d_name, "..")) continue;
+        names.push_back(dd->d_name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (const std::string &n : names) {
+        if (!add(path + "/" + n, name + "/" + n)) return false;
+    }
+    return true;
+}
+
+void
+Packer::order_by_extent()
+{
+    // the files FIEMAP cannot locate keep their order after the located ones
+    std::vector<std::pair<std::pair<uint64_t, uint64_t>, size_t>> order;
+    order.reserve(paths_.size());
+    for (size_t i = 0; i < paths_.size(); ++i) {
+        std::pair<uint64_t, uint64_t> loc(0, UINT64_MAX);
+        int fd = open(paths_[i].c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd >= 0) {
+            struct stat stb;
+            if (fstat(fd, &stb) >= 0) loc.first = stb.st_dev;
+            file_physical_offset(fd, &loc.second);
+            close(fd);
+        }
+        order.emplace_back(loc, i);
+    }
+    std::stable_sort(order.begin(), order.end());
+    std::vector<std::string> paths;
+    std::vector<PackEntry> entries;
+    for (const auto &o : order) {
+        paths.push_back(std::move(paths_[o.second]));
+        entries.push_back(std::move(entries_[o.second]));
+    }
+    paths_.swap(paths);
+    entries_.swap(entries);
+}
+
+// a file which cannot be opened any more is left out of the index
+bool
+Packer::open_next()
+{
+    while (next_ < paths_.size()) {
+        const std::string &path = paths_[next_];
+        PackEntry &e = entries_[next_];
+        ++next_;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            log_warning("cannot open '%s': %s, skipped", path.c_str(), strerror(errno));
+            continue;
+        }
+        struct stat stb;
+        if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode)) {
+            log_warning("'%s' is not a regular file, skipped", path.c_str());
+            close(fd);
+            continue;
+        }
+        e.offset = total_;
+        e.size = stb.st_size;
+        MD5_Init(&member_ctx_);
+        if (!e.size) {
+            unsigned char digest[MD5_DIGEST_LENGTH];
+            MD5_Final(digest, &member_ctx_);
+            e.md5.assign((const char *) digest, sizeof(digest));
+            close(fd);
+            continue;
+        }
+        fd_ = fd;
+        left_ = e.size;
+        return true;
+    }
+    return false;
+}
+
+int
+Packer::next(StagedFile &file, std::string &md5)
+{
+    if (failed_) return -1;
+    if (fd_ < 0 && !open_next()) return 0;
+    if (!staging_.create(file, target_)) {
+        failed_ = true;
+        return -1;
+    }
+    if (buf_.empty()) buf_.resize(pack_buffer_size);
+
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    off_t written = 0;
+    while (written < target_) {
+        if (fd_ < 0 && !open_next()) break;
+        size_t n = std::min<uint64_t>(std::min<uint64_t>(buf_.size(), left_), target_ - written);
+        ssize_t r = read(fd_, &buf_[0], n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            // the bytes before are already in the stream
+            log_error("'%s': %s", paths_[next_ - 1].c_str(), r < 0?strerror(errno):"file truncated while packing");
+            failed_ = true;
+            return -1;
+        }
+        if (write_full(file.fd(), buf_.data(), r) < 0) {
+            failed_ = true;
+            return -1;
+        }
+        MD5_Update(&ctx, buf_.data(), r);
+        MD5_Update(&member_ctx_, buf_.data(), r);
+        written += r;
+        total_ += r;
+        left_ -= r;
+        if (!left_) {
+            unsigned char digest[MD5_DIGEST_LENGTH];
+            MD5_Final(digest, &member_ctx_);
+            entries_[next_ - 1].md5.assign((const char *) digest, sizeof(digest));
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+    if (!written) return 0;
+
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, &ctx);
+    md5.assign((const char *) digest, sizeof(digest));
+    file.shrink(written);
+    return 1;
+}
+
+std::string
+Packer::index() const
+{
+    std::string body;
+    size_t count = 0;
+    char buf[128];
+    for (const PackEntry &e : entries_) {
+        if (e.md5.size() != MD5_DIGEST_SIZE) continue;
+        snprintf(buf, sizeof(buf), "%llu %llu %s ", (unsigned long long) e.offset,
+                 (unsigned long long) e.size, to_hex(e.md5).c_str());
+        body += buf;
+        body += e.name;
+        body += '\n';
+        ++count;
+    }
+    snprintf(buf, sizeof(buf), "AWSUPACK1 %zu %llu\n", count, (unsigned long long) total_);
+    return buf + body;
+}
+
+bool
+upload_packed(
+        const UploadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &index_key,
+        Packer &packer)
+{
+    if (!packer.count()) {
+        log_error("nothing to pack");
+        return false;
+    }
+
+    aws::s3::Metadata metadata;
+    metadata.emplace_back("pack-index", index_key);
+    MultipartUpload upload(options, bucket, key);
+    if (!upload.create(metadata)) {
+        return false;
+    }
+    auto next = [&packer](StagedFile &file, std::string &md5) { return packer.next(file, md5); };
+    if (!upload.upload_stream(next) || !upload.complete()) {
+        upload.abort();
+        return false;
+    }
+    log_info("packed %zu files, %llu bytes into s3://%s/%s", packer.count(),
+             (unsigned long long) packer.total(), bucket.c_str(), key.c_str());
+
+    // the index is uploaded after the data, so it never refers to a missing object
+    std::string text = packer.index();
+    StagedFile file;
+    if (!options.staging->create(file, text.size()) || write_full(file.fd(), text.data(), text.size()) < 0) {
+        return false;
+    }
+    std::vector<PartSource> parts;
+    plan_parts(parts, file.fd(), std::string(), 0, text.size());
+    UploadOptions index_options = options;
+    index_options.skip_identical = false;
+    index_options.checksum_cache = nullptr;
+    return upload_object(index_options, bucket, index_key, parts);
+}
+
+bool
+find_pack_entry(const std::string &index, const std::string &member, PackEntry &entry)
+{
+    // the first line is the header
+    for (size_t pos = index.find('\n'); pos != std::string::npos && pos + 1 < index.size(); ) {
+        size_t eol = index.find('\n', pos + 1);
+        if (eol == std::string::npos) break;
+        std::string line = index.substr(pos + 1, eol - pos - 1);
+        pos = eol;
+        unsigned long long offset = 0, size = 0;
+        char hex[MD5_DIGEST_SIZE * 2 + 1];
+        int n = 0;
+        // the name is the rest of the line after one space, it may start with spaces
+        if (sscanf(line.c_str(), "%llu %llu %32s%n", &offset, &size, hex, &n) != 3 || line[n] != ' ') continue;
+        if (line.compare(n + 1, std::string::npos, member)) continue;
+        if (!from_hex(hex, entry.md5) || entry.md5.size() != MD5_DIGEST_SIZE) continue;
+        entry.name = member;
+        entry.offset = offset;
+        entry.size = size;
+        return true;
+    }
+    return false;
+}
+
+bool
+fetch_packed(
+        const DownloadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &index_key,
+        const std::string &member,
+        const std::string &path)
+{
+    aws::s3::Result head = aws::s3::head_object(bucket, index_key);
+    if (options.metrics) options.metrics->record_call(head);
+    if (!head.success) return false;
+    if (head.content_length <= 0) {
+        log_error("s3://%s/%s is not a pack index", bucket.c_str(), index_key.c_str());
+        return false;
+    }
+    std::string text;
+    aws::s3::Result res = aws::s3::get_object_range(bucket, index_key, head.etag, 0, head.content_length,
+        [&text](const char *data, size_t len) -> bool {
+            text.append(data, len);
+            return true;
+        });
+    if (options.metrics) options.metrics->record_call(res);
+    if (!res.success) return false;
+    if (text.compare(0, 10, "AWSUPACK1 ")) {
+        log_error("s3://%s/%s is not a pack index", bucket.c_str(), index_key.c_str());
+        return false;
+    }
+
+    PackEntry entry;
+    if (!find_pack_entry(text, member, entry)) {
+        log_error("'%s' is not in s3://%s/%s", member.c_str(), bucket.c_str(), index_key.c_str());
+        return false;
+    }
+
+    std::string tmp_path = path + ".part";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("cannot open '%s': %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    auto fail = [&]() -> bool {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    };
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    if (entry.size > 0) {
+        int attempts = 0;
+        while (1) {
+            ++attempts;
+            MD5_Init(&ctx);
+            if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+                log_error("cannot truncate '%s': %s", tmp_path.c_str(), strerror(errno));
+                return fail();
+            }
+            trace::Scope ts("part", 1);
+            aws::s3::Result r = aws::s3::get_object_range(bucket, key, std::string(),
+                entry.offset, entry.offset + entry.size,
+                [&](const char *data, size_t len) -> bool {
+                    if (write_full(fd, data, len) < 0) return false;
+                    MD5_Update(&ctx, data, len);
+                    return true;
+                });
+            if (options.metrics) options.metrics->record_call(r);
+            if (r.success) break;
+            if (attempts > options.retries) return fail();
+            log_warning("range of '%s' failed, retrying", member.c_str());
+            if (options.metrics) options.metrics->add_retry();
+        }
+    }
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, &ctx);
+    if (entry.md5 != std::string((const char *) digest, sizeof(digest))) {
+        log_error("'%s': MD5 mismatch", member.c_str());
+        return fail();
+    }
+    if (fsync(fd) < 0) {
+        log_error("fsync failed: %s", strerror(errno));
+        return fail();
+    }
+    close(fd);
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        log_error("cannot rename '%s': %s", tmp_path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    log_info("fetched '%s' (%llu bytes at %llu of s3://%s/%s) to %s", member.c_str(),
+             (unsigned long long) entry.size, (unsigned long long) entry.offset,
+             bucket.c_str(), key.c_str(), path.c_str());
+    return true;
+}
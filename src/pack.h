@@ -0,0 +1,91 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "multipart.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+#include <openssl/md5.h>
+
+class StagingArea;
+class StagedFile;
+struct DownloadOptions;
+
+// member of a packed object: the file data is stored at [offset, offset + size)
+// of the object, the members follow each other without gaps or headers
+struct PackEntry
+{
+    std::string name;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    std::string md5;        // binary
+};
+
+// concatenates files into a stream of parts of 'target' bytes, a file may span parts;
+// the MD5 of every member is computed while the part is produced
+class Packer
+{
+    StagingArea &staging_;
+    off_t target_;
+    std::vector<std::string> paths_;
+    std::vector<PackEntry> entries_;
+    size_t next_ = 0;
+    int fd_ = -1;                   // the member being read
+    uint64_t left_ = 0;
+    MD5_CTX member_ctx_;
+    uint64_t total_ = 0;
+    bool failed_ = false;
+    std::string buf_;
+
+    bool open_next();
+
+public:
+    Packer(StagingArea &staging, off_t target);
+    ~Packer();
+
+    Packer(const Packer &) = delete;
+    Packer &operator= (const Packer &) = delete;
+
+    // a regular file becomes a member named 'name', a directory is walked and
+    // adds its regular files as 'name/relative path'
+    bool add(const std::string &path, const std::string &name);
+    size_t count() const { return paths_.size(); }
+    // reorder the added members by the physical location of their data, so a
+    // batch on a spinning disk is read in one sweep; called before next()
+    void order_by_extent();
+
+    // a PartProducer
+    int next(StagedFile &file, std::string &md5);
+
+    const std::vector<PackEntry> &entries() const { return entries_; }
+    uint64_t total() const { return total_; }
+    // "AWSUPACK1 <count> <size>" followed by "<offset> <size> <md5 hex> <name>" lines
+    std::string index() const;
+};
+
+// look a member up in the text of an index made by Packer::index()
+bool
+find_pack_entry(const std::string &index, const std::string &member, PackEntry &entry);
+
+// upload the files as members of one object and the index as a second object
+bool
+upload_packed(
+        const UploadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &index_key,
+        Packer &packer);
+
+// fetch a single member of a packed object with one ranged GET, the data is
+// verified against the MD5 of the index
+bool
+fetch_packed(
+        const DownloadOptions &options,
+        const std::string &bucket,
+        const std::string &key,
+        const std::string &index_key,
+        const std::string &member,
+        const std::string &path);
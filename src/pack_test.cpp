@@ -0,0 +1,95 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "pack.h"
+#include "staging.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <openssl/md5.h>
+
+static void
+write_file(const std::string &path, const std::string &data)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    assert(f);
+    size_t n = fwrite(data.data(), 1, data.size(), f);
+    assert(n == data.size());
+    fclose(f);
+}
+
+int main()
+{
+    char dir[] = "/tmp/pack_test.XXXXXX";
+    char *dir_ok = mkdtemp(dir);
+    assert(dir_ok);
+    std::string base(dir);
+
+    std::string contents[] = { std::string(100000, 'a'), "", std::string(3000, 'c') };
+    const char *names[] = { "a", " a b ", "dir/a" };
+    StagingArea staging(base, 1 << 20);
+    Packer packer(staging, 64 * 1024);
+    for (int i = 0; i < 3; ++i) {
+        std::string path = base + "/" + std::to_string(i);
+        write_file(path, contents[i]);
+        bool added = packer.add(path, names[i]);
+        assert(added);
+    }
+
+    // the members are produced into parts of 64K
+    std::string stream;
+    int parts = 0;
+    while (1) {
+        StagedFile file;
+        std::string md5;
+        int r = packer.next(file, md5);
+        assert(r >= 0);
+        if (!r) break;
+        ++parts;
+        std::string data(file.size(), 0);
+        ssize_t n = pread(file.fd(), &data[0], data.size(), 0);
+        assert(n == (ssize_t) data.size());
+        stream += data;
+    }
+    assert(parts == 2);
+    assert(stream == contents[0] + contents[1] + contents[2]);
+    assert(packer.total() == stream.size());
+
+    std::string index = packer.index();
+    assert(index.compare(0, 19, "AWSUPACK1 3 103000\n") == 0);
+    for (int i = 0; i < 3; ++i) {
+        PackEntry e;
+        bool found = find_pack_entry(index, names[i], e);
+        assert(found);
+        assert(e.name == names[i]);
+        assert(e.size == contents[i].size());
+        assert(stream.compare(e.offset, e.size, contents[i]) == 0);
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        MD5((const unsigned char *) contents[i].data(), contents[i].size(), digest);
+        assert(e.md5 == std::string((const char *) digest, sizeof(digest)));
+    }
+    PackEntry e;
+    bool found = find_pack_entry(index, "b", e);
+    assert(!found);
+    found = find_pack_entry(index, "dir", e);
+    assert(!found);
+    found = find_pack_entry(index, "a b ", e);
+    assert(!found);
+    // a line with a damaged MD5 is skipped
+    found = find_pack_entry("AWSUPACK1 1 3\n0 3 0123456789abcdef0123456789abcdeX x\n", "x", e);
+    assert(!found);
+    // the header is not a member
+    found = find_pack_entry("0 3 0123456789abcdef0123456789abcdef x\n", "x", e);
+    assert(!found);
+
+    for (int i = 0; i < 3; ++i) {
+        unlink((base + "/" + std::to_string(i)).c_str());
+    }
+    rmdir(dir);
+    printf("pack_test: ok\n");
+}
@@ -0,0 +1,128 @@
+#include "qos.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+/* from linux/ioprio.h, which is not installed everywhere */
+enum { IOPRIO_WHO_PROCESS = 1, IOPRIO_CLASS_SHIFT = 13 };
+
+static struct qos_settings current;
+
+int
+qos_parse_io(const char *str, struct qos_settings *qos)
+{
+    if (!strcmp(str, "idle")) {
+        qos->io_class = QOS_IO_IDLE;
+        qos->io_level = 0;
+        return 0;
+    }
+    if (strncmp(str, "best-effort", 11)) return -1;
+    qos->io_class = QOS_IO_BEST_EFFORT;
+    qos->io_level = 4;          /* the default of the class */
+    if (!str[11]) return 0;
+    if (str[11] != ':' || str[12] < '0' || str[12] > '7' || str[13]) return -1;
+    qos->io_level = str[12] - '0';
+    return 0;
+}
+
+int
+qos_parse_cpus(const char *str, struct qos_settings *qos)
+{
+    CPU_ZERO(&qos->cpus);
+    const char *p = str;
+    while (1) {
+        char *eptr = NULL;
+        errno = 0;
+        long beg = strtol(p, &eptr, 10);
+        if (errno || eptr == p || beg < 0 || beg >= CPU_SETSIZE) return -1;
+        long end = beg;
+        p = eptr;
+        if (*p == '-') {
+            ++p;
+            end = strtol(p, &eptr, 10);
+            if (errno || eptr == p || end < beg || end >= CPU_SETSIZE) return -1;
+            p = eptr;
+        }
+        for (long cpu = beg; cpu <= end; ++cpu) {
+            CPU_SET(cpu, &qos->cpus);
+        }
+        if (!*p) break;
+        if (*p != ',') return -1;
+        ++p;
+    }
+    qos->cpus_set = 1;
+    return 0;
+}
+
+/* the calling thread only, on failure the name of the failed call is stored */
+static int
+apply(const struct qos_settings *qos, const char **pwhat)
+{
+    if (qos->io_class) {
+        int prio = (qos->io_class << IOPRIO_CLASS_SHIFT) | qos->io_level;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) < 0) {
+            *pwhat = "ioprio_set";
+            return -1;
+        }
+    }
+    if (qos->nice_set && setpriority(PRIO_PROCESS, 0, qos->nice) < 0) {
+        *pwhat = "setpriority";
+        return -1;
+    }
+    if (qos->cpus_set && sched_setaffinity(0, sizeof(qos->cpus), &qos->cpus) < 0) {
+        *pwhat = "sched_setaffinity";
+        return -1;
+    }
+    return 0;
+}
+
+int
+qos_set(const struct qos_settings *qos)
+{
+    const char *what = NULL;
+    current = *qos;
+    if (apply(qos, &what) < 0) {
+        log_error("%s: %s", what, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* the forking thread may have been started with other settings, or have
+   changed its own, so the child gets them explicitly */
+void
+qos_apply_child(void)
+{
+    const char *what;
+    apply(&current, &what);
+}
+
+int
+qos_enter_cgroup(const char *dir)
+{
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/cgroup.procs", dir) >= (int) sizeof(path)) {
+        log_error("cgroup path is too long");
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("cannot open '%s': %s", path, strerror(errno));
+        return -1;
+    }
+    /* "0" is the writing process, all its threads move with it */
+    if (write(fd, "0\n", 2) != 2) {
+        log_error("cannot join cgroup '%s': %s", dir, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef __QOS_H__
+#define __QOS_H__
+
+#include <sched.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* I/O and CPU priorities of the uploader and of its children */
+struct qos_settings
+{
+    int io_class;               /* 0 - unchanged, QOS_IO_BEST_EFFORT or QOS_IO_IDLE */
+    int io_level;               /* 0 (highest) - 7 of the best-effort class */
+    int nice_set;
+    int nice;
+    int cpus_set;
+    cpu_set_t cpus;
+};
+
+enum { QOS_IO_BEST_EFFORT = 2, QOS_IO_IDLE = 3 };
+
+/* "idle", "best-effort" or "best-effort:LEVEL", returns < 0 if invalid */
+int
+qos_parse_io(const char *str, struct qos_settings *qos);
+
+/* a CPU list as in cpuset(7): "0-3,8,10-11", returns < 0 if invalid */
+int
+qos_parse_cpus(const char *str, struct qos_settings *qos);
+
+/* remember the settings for the children and apply them to the calling
+   thread; the priorities and the affinity are per thread in Linux and
+   inherited by new threads, so this is called before starting any */
+int
+qos_set(const struct qos_settings *qos);
+
+/* apply the remembered settings in a child between fork and exec,
+   async-signal-safe, errors are ignored */
+void
+qos_apply_child(void);
+
+/* move the whole process to the cgroup v2 directory */
+int
+qos_enter_cgroup(const char *dir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "qos.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+int main()
+{
+    struct qos_settings qos;
+    memset(&qos, 0, sizeof(qos));
+
+    int r = qos_parse_cpus("0-3,8,10-11", &qos);
+    assert(r == 0);
+    assert(qos.cpus_set);
+    assert(CPU_COUNT(&qos.cpus) == 7);
+    const int cpus[] = { 0, 1, 2, 3, 8, 10, 11 };
+    for (int cpu : cpus) {
+        assert(CPU_ISSET(cpu, &qos.cpus));
+    }
+    assert(!CPU_ISSET(4, &qos.cpus) && !CPU_ISSET(9, &qos.cpus));
+
+    // the previous set is replaced
+    r = qos_parse_cpus("5", &qos);
+    assert(r == 0);
+    assert(CPU_COUNT(&qos.cpus) == 1 && CPU_ISSET(5, &qos.cpus));
+
+    const char *invalid[] = { "", ",", "1,", "3-1", "1-", "-1", "a", "1-2x", "0,,1", "99999" };
+    for (const char *str : invalid) {
+        memset(&qos, 0, sizeof(qos));
+        r = qos_parse_cpus(str, &qos);
+        assert(r < 0);
+        assert(!qos.cpus_set);
+    }
+
+    printf("qos_test: ok\n");
+}
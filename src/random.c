@@ -9,46 +9,49 @@
 #include <assert.h>
 
 #include "random.h"
+#include "log.h"
 
 static int urandom_fd = -1;
 
 static const char random_path[] = "/dev/urandom";
 
-void
+static int
 random_init(void)
 {
-    if (urandom_fd >= 0) return;
+    if (urandom_fd >= 0) return 0;
 
-    urandom_fd = open(random_path, O_RDONLY, 0);
+    urandom_fd = open(random_path, O_RDONLY | O_CLOEXEC, 0);
     if (urandom_fd < 0) {
-        fprintf(stderr, "random_init: open '%s' failed: %s\n",
-                random_path, strerror(errno));
-        exit(1);
+        log_error("random_init: open '%s' failed: %s",
+                  random_path, strerror(errno));
+        return -1;
     }
+    return 0;
 }
 
-void
+int
 random_bytes(unsigned char *data, size_t size)
 {
     assert((ssize_t) size > 0);
 
-    if (urandom_fd < 0) random_init();
+    if (urandom_fd < 0 && random_init() < 0) return -1;
 
     unsigned char *ptr = data;
     ssize_t sz = size;
     while (sz > 0) {
         ssize_t r = read(urandom_fd, ptr, sz);
         if (r < 0) {
-            fprintf(stderr, "random_bytes: read error: %s\n",
-                    strerror(errno));
-            exit(1);
+            log_error("random_bytes: read error: %s",
+                      strerror(errno));
+            return -1;
         }
         if (!r) {
-            fprintf(stderr, "random_bytes: EOF on random number source\n");
-            exit(1);
+            log_error("random_bytes: EOF on random number source");
+            return -1;
         }
         ptr += r;
         sz -= r;
     }
+    return 0;
 }
 
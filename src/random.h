@@ -5,7 +5,7 @@
 extern "C" {
 #endif
 
-void
+int
 random_bytes(
         unsigned char *data,
         size_t size);
@@ -0,0 +1,451 @@
+#include "remote_index.h"
+#include "metrics.h"
+#include "thread_pool.h"
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// the file is "Header, bucket, prefix, padding to 8, Record[count], key strings",
+// in the native byte order, it is a local cache
+struct RemoteIndex::Header
+{
+    char magic[8];
+    uint32_t record_size;
+    uint32_t bucket_len;
+    uint32_t prefix_len;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t strings_size;
+};
+
+struct RemoteIndex::Record
+{
+    uint64_t key_offset;        // in the key strings
+    uint32_t key_len;
+    uint32_t etag_len;          // 0 if the ETag does not fit
+    int64_t size;
+    int64_t mtime;
+    char etag[48];              // a multipart ETag with quotes is at most 40 characters
+};
+
+namespace {
+
+const char index_magic[8] = { 'A', 'W', 'S', 'U', 'I', 'D', 'X', '1' };
+
+// listing page size, the maximum of S3
+constexpr int list_page_keys = 1000;
+
+size_t
+align8(size_t size)
+{
+    return (size + 7) & ~(size_t) 7;
+}
+
+// byte order, as S3 lists the keys
+int
+compare_key(const char *key, size_t key_len, const std::string &str)
+{
+    int r = memcmp(key, str.data(), std::min(key_len, str.size()));
+    if (r) return r;
+    return key_len < str.size()?-1:(key_len > str.size()?1:0);
+}
+
+bool
+in_prefix(const std::string &key, const std::string &prefix)
+{
+    return !key.compare(0, prefix.size(), prefix);
+}
+
+}
+
+RemoteIndex::~RemoteIndex()
+{
+    unmap_file();
+    if (journal_) fclose(journal_);
+}
+
+bool
+RemoteIndex::map_file()
+{
+    int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        if (errno == ENOENT) return true;
+        log_error("cannot open '%s': %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat stb;
+    if (fstat(fd, &stb) < 0) {
+        log_error("fstat failed: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    if ((size_t) stb.st_size < sizeof(Header)) {
+        log_error("'%s' is not an index file", path_.c_str());
+        close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, stb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        log_error("mmap of '%s' failed: %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    map_ = (const char *) p;
+    map_size_ = stb.st_size;
+
+    const Header *h = (const Header *) map_;
+    size_t records_offset = align8(sizeof(Header) + (uint64_t) h->bucket_len + h->prefix_len);
+    if (memcmp(h->magic, index_magic, sizeof(index_magic)) || h->record_size != sizeof(Record)
+        || records_offset > map_size_
+        || h->count > (map_size_ - records_offset) / sizeof(Record)
+        || h->strings_size != map_size_ - records_offset - h->count * sizeof(Record)) {
+        log_error("'%s' is not an index file", path_.c_str());
+        unmap_file();
+        return false;
+    }
+    bucket_.assign(map_ + sizeof(Header), h->bucket_len);
+    prefix_.assign(map_ + sizeof(Header) + h->bucket_len, h->prefix_len);
+    records_ = (const Record *) (map_ + records_offset);
+    count_ = h->count;
+    strings_ = map_ + records_offset + count_ * sizeof(Record);
+    return true;
+}
+
+void
+RemoteIndex::unmap_file()
+{
+    if (map_) munmap((void *) map_, map_size_);
+    map_ = nullptr;
+    map_size_ = 0;
+    records_ = nullptr;
+    count_ = 0;
+    strings_ = nullptr;
+}
+
+// a journal record is "P <key length> <size> <mtime> <etag>\n<key>\n",
+// the length prefix allows any characters in the keys
+bool
+RemoteIndex::load_journal()
+{
+    std::string path = path_ + ".journal";
+    FILE *f = fopen(path.c_str(), "re");
+    if (!f) {
+        if (errno == ENOENT) return true;
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, f)) > 0) {
+        size_t key_len = 0;
+        long long obj_size = 0, mtime = 0;
+        char etag[64];
+        if (line[len - 1] != '\n'
+            || sscanf(line, "P %zu %lld %lld %63s", &key_len, &obj_size, &mtime, etag) != 4
+            || key_len > 4096) {
+            break;      // torn last record
+        }
+        std::string key(key_len, 0);
+        if (fread(&key[0], 1, key_len, f) != key_len || getc(f) != '\n') break;
+        if (!in_prefix(key, prefix_)) continue;
+        aws::s3::ObjectInfo &info = journaled_[key];
+        info.key = key;
+        info.size = obj_size;
+        info.etag = etag;
+        info.mtime = mtime;
+    }
+    free(line);
+    fclose(f);
+    return true;
+}
+
+bool
+RemoteIndex::open_journal(bool truncate)
+{
+    if (journal_) fclose(journal_);
+    std::string path = path_ + ".journal";
+    journal_ = fopen(path.c_str(), truncate?"we":"ae");
+    if (!journal_) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool
+RemoteIndex::open(const std::string &path)
+{
+    path_ = path;
+    if (!map_file() || !load_journal() || !open_journal(false)) return false;
+    // a long journal slows down the start, it is merged into the file
+    if (journaled_.size() > std::max<uint64_t>(65536, count_ / 8)) {
+        return compact();
+    }
+    return true;
+}
+
+void
+RemoteIndex::record_info(const Record &rec, aws::s3::ObjectInfo &info) const
+{
+    info.key.assign(strings_ + rec.key_offset, rec.key_len);
+    info.size = rec.size;
+    info.etag.assign(rec.etag, std::min<size_t>(rec.etag_len, sizeof(rec.etag)));
+    info.mtime = rec.mtime;
+}
+
+const RemoteIndex::Record *
+RemoteIndex::find(const std::string &key) const
+{
+    const Record *end = records_ + count_;
+    const Record *r = std::lower_bound(records_, end, key, [this](const Record &rec, const std::string &k) {
+        return compare_key(strings_ + rec.key_offset, rec.key_len, k) < 0;
+    });
+    if (r == end || compare_key(strings_ + r->key_offset, r->key_len, key)) return nullptr;
+    return r;
+}
+
+size_t
+RemoteIndex::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n = count_;
+    for (const auto &p : journaled_) {
+        if (!find(p.first)) ++n;
+    }
+    return n;
+}
+
+bool
+RemoteIndex::lookup(const std::string &key, aws::s3::ObjectInfo &info) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = journaled_.find(key);
+    if (it != journaled_.end()) {
+        info = it->second;
+        return true;
+    }
+    const Record *r = find(key);
+    if (!r) return false;
+    record_info(*r, info);
+    return true;
+}
+
+bool
+RemoteIndex::put(const std::string &bucket, const aws::s3::ObjectInfo &info)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!bucket_.length() || bucket != bucket_ || !in_prefix(info.key, prefix_)) return true;
+    if (!info.etag.length() || strpbrk(info.etag.c_str(), " \t\n") || info.key.size() > 4096) return true;
+    if (!journal_) return false;
+    // not synced: a lost record only makes the object look changed
+    fprintf(journal_, "P %zu %lld %lld %s\n", info.key.size(), (long long) info.size,
+            (long long) info.mtime, info.etag.c_str());
+    fwrite(info.key.data(), 1, info.key.size(), journal_);
+    putc('\n', journal_);
+    if (fflush(journal_)) {
+        log_error("cannot write '%s.journal': %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    journaled_[info.key] = info;
+    return true;
+}
+
+bool
+RemoteIndex::write(const std::vector<aws::s3::ObjectInfo> &objects)
+{
+    std::string tmp_path = path_ + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "we");
+    if (!f) {
+        log_error("cannot open '%s': %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, index_magic, sizeof(h.magic));
+    h.record_size = sizeof(Record);
+    h.bucket_len = bucket_.size();
+    h.prefix_len = prefix_.size();
+    h.count = objects.size();
+    for (const aws::s3::ObjectInfo &info : objects) {
+        h.strings_size += info.key.size();
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(bucket_.data(), 1, bucket_.size(), f);
+    fwrite(prefix_.data(), 1, prefix_.size(), f);
+    size_t header_size = sizeof(h) + bucket_.size() + prefix_.size();
+    for (size_t i = header_size; i < align8(header_size); ++i) {
+        putc(0, f);
+    }
+
+    uint64_t offset = 0;
+    for (const aws::s3::ObjectInfo &info : objects) {
+        Record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.key_offset = offset;
+        rec.key_len = info.key.size();
+        rec.size = info.size;
+        rec.mtime = info.mtime;
+        if (info.etag.size() <= sizeof(rec.etag)) {
+            rec.etag_len = info.etag.size();
+            memcpy(rec.etag, info.etag.data(), info.etag.size());
+        }
+        fwrite(&rec, sizeof(rec), 1, f);
+        offset += info.key.size();
+    }
+    for (const aws::s3::ObjectInfo &info : objects) {
+        fwrite(info.key.data(), 1, info.key.size(), f);
+    }
+
+    if (fflush(f) || fdatasync(fileno(f)) < 0 || ferror(f)) {
+        log_error("write error on '%s'", tmp_path.c_str());
+        fclose(f);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    fclose(f);
+    if (rename(tmp_path.c_str(), path_.c_str()) < 0) {
+        log_error("rename to '%s' failed: %s", path_.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    // the journal is obsolete once the new file is in place
+    unmap_file();
+    journaled_.clear();
+    return map_file() && open_journal(true);
+}
+
+bool
+RemoteIndex::compact()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!bucket_.length()) return true;
+
+    std::vector<aws::s3::ObjectInfo> objects;
+    objects.reserve(count_ + journaled_.size());
+    auto it = journaled_.begin();
+    for (uint64_t i = 0; i < count_; ++i) {
+        const Record &rec = records_[i];
+        int c = 1;
+        while (it != journaled_.end()
+               && (c = compare_key(strings_ + rec.key_offset, rec.key_len, it->first)) > 0) {
+            objects.push_back(it->second);
+            ++it;
+        }
+        if (!c) {
+            objects.push_back(it->second);
+            ++it;
+            continue;
+        }
+        objects.emplace_back();
+        record_info(rec, objects.back());
+    }
+    for (; it != journaled_.end(); ++it) {
+        objects.push_back(it->second);
+    }
+    log_info("index: %zu objects after merging %zu journal records", objects.size(), journaled_.size());
+    return write(objects);
+}
+
+bool
+RemoteIndex::refresh(
+        const std::string &bucket,
+        const std::string &prefix,
+        int jobs,
+        int retries,
+        Metrics *metrics)
+{
+    // the key space is split at characters following the prefix, a range
+    // is (lower, upper], so that --start-after can start it exactly; the
+    // split points are where keys usually begin
+    static const char alphabet[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    int alphabet_size = sizeof(alphabet) - 1;
+    int ranges = jobs > 1?std::min(jobs * 4, alphabet_size):1;
+    std::vector<std::string> bounds;    // ranges + 1, empty at both ends means unbounded
+    bounds.emplace_back();
+    for (int i = 1; i < ranges; ++i) {
+        bounds.push_back(prefix + alphabet[i * alphabet_size / ranges]);
+    }
+    bounds.emplace_back();
+
+    std::vector<std::vector<aws::s3::ObjectInfo>> listed(ranges);
+    std::atomic<bool> failed{false};
+    {
+        ThreadPool pool(jobs);
+        for (int r = 0; r < ranges; ++r) {
+            pool.submit([&, r] {
+                const std::string &upper = bounds[r + 1];
+                std::vector<aws::s3::ObjectInfo> &out = listed[r];
+                std::string start_after = bounds[r];
+                while (!failed) {
+                    std::vector<aws::s3::ObjectInfo> page;
+                    bool truncated = false;
+                    aws::s3::Result res;
+                    for (int attempt = 0; ; ++attempt) {
+                        page.clear();
+                        res = aws::s3::list_objects_page(bucket, prefix, start_after, list_page_keys, page, &truncated);
+                        if (metrics) metrics->record_call(res);
+                        if (res.success || attempt >= retries || failed) break;
+                        log_warning("listing after '%s' failed, retrying", start_after.c_str());
+                    }
+                    if (!res.success) {
+                        failed = true;
+                        break;
+                    }
+                    bool done = !truncated || page.empty();
+                    for (aws::s3::ObjectInfo &info : page) {
+                        if (upper.length() && info.key > upper) {
+                            done = true;
+                            break;
+                        }
+                        out.push_back(std::move(info));
+                    }
+                    if (done) break;
+                    start_after = out.back().key;
+                }
+            });
+        }
+        pool.wait();
+    }
+    if (failed) {
+        log_error("listing of s3://%s/%s failed", bucket.c_str(), prefix.c_str());
+        return false;
+    }
+
+    // the ranges are in key order
+    std::vector<aws::s3::ObjectInfo> objects;
+    size_t total = 0;
+    for (const auto &l : listed) total += l.size();
+    objects.reserve(total);
+    for (auto &l : listed) {
+        std::move(l.begin(), l.end(), std::back_inserter(objects));
+        std::vector<aws::s3::ObjectInfo>().swap(l);
+    }
+    log_info("index: %zu objects listed in s3://%s/%s", objects.size(), bucket.c_str(), prefix.c_str());
+    return replace(bucket, prefix, objects);
+}
+
+bool
+RemoteIndex::replace(
+        const std::string &bucket,
+        const std::string &prefix,
+        const std::vector<aws::s3::ObjectInfo> &objects)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    bucket_ = bucket;
+    prefix_ = prefix;
+    return write(objects);
+}
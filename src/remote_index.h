@@ -0,0 +1,80 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "awss3api.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
+
+class Metrics;
+
+// local copy of the listing of a bucket under a prefix: a file of fixed-size
+// records sorted by key followed by the key strings, mapped into memory and
+// searched in place; objects uploaded since the last refresh are appended to
+// a journal ("<path>.journal") and merged into the file by compact()
+class RemoteIndex
+{
+    struct Header;
+    struct Record;
+
+    std::string path_;
+    std::string bucket_;
+    std::string prefix_;
+
+    const char *map_ = nullptr;
+    size_t map_size_ = 0;
+    const Record *records_ = nullptr;
+    uint64_t count_ = 0;
+    const char *strings_ = nullptr;
+
+    FILE *journal_ = nullptr;
+    std::map<std::string, aws::s3::ObjectInfo> journaled_;
+    mutable std::mutex mutex_;
+
+    bool map_file();
+    void unmap_file();
+    bool load_journal();
+    bool open_journal(bool truncate);
+    // replace the file with the sorted objects and start an empty journal
+    bool write(const std::vector<aws::s3::ObjectInfo> &objects);
+    void record_info(const Record &rec, aws::s3::ObjectInfo &info) const;
+    const Record *find(const std::string &key) const;
+
+public:
+    RemoteIndex() = default;
+    ~RemoteIndex();
+
+    RemoteIndex(const RemoteIndex &) = delete;
+    RemoteIndex &operator= (const RemoteIndex &) = delete;
+
+    // a missing file is an empty index without a bucket, to be refreshed
+    bool open(const std::string &path);
+
+    const std::string &bucket() const { return bucket_; }
+    const std::string &prefix() const { return prefix_; }
+    size_t size() const;
+
+    bool lookup(const std::string &key, aws::s3::ObjectInfo &info) const;
+    // record an uploaded object, objects outside the bucket and the prefix are ignored
+    bool put(const std::string &bucket, const aws::s3::ObjectInfo &info);
+    bool compact();
+    // replace the contents with a listing of the bucket under the prefix,
+    // the objects are sorted by key
+    bool replace(
+            const std::string &bucket,
+            const std::string &prefix,
+            const std::vector<aws::s3::ObjectInfo> &objects);
+
+    // list the bucket under the prefix with 'jobs' concurrent key ranges and
+    // replace the contents of the index
+    bool refresh(
+            const std::string &bucket,
+            const std::string &prefix,
+            int jobs,
+            int retries,
+            Metrics *metrics);
+};
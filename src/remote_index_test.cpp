@@ -0,0 +1,117 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "remote_index.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+static aws::s3::ObjectInfo
+object(const std::string &key, int64_t size, const std::string &etag)
+{
+    aws::s3::ObjectInfo info;
+    info.key = key;
+    info.size = size;
+    info.etag = etag;
+    info.mtime = 1600000000 + size;
+    return info;
+}
+
+static bool
+has(const RemoteIndex &index, const std::string &key, int64_t size, const std::string &etag)
+{
+    aws::s3::ObjectInfo info;
+    return index.lookup(key, info) && info.key == key && info.size == size && info.etag == etag
+        && info.mtime == 1600000000 + size;
+}
+
+int main()
+{
+    char dir[] = "/tmp/remote_index_test.XXXXXX";
+    char *dir_ok = mkdtemp(dir);
+    assert(dir_ok);
+    std::string path = std::string(dir) + "/index";
+    bool ok;
+
+    {
+        RemoteIndex index;
+        ok = index.open(path);
+        assert(ok);
+        assert(index.bucket().empty() && index.size() == 0);
+        // not refreshed yet, nothing is recorded
+        ok = index.put("bucket", object("p/x", 1, "\"e\""));
+        assert(ok);
+        assert(index.size() == 0);
+
+        std::vector<aws::s3::ObjectInfo> objects;
+        objects.push_back(object("p/a", 10, "\"a\""));
+        objects.push_back(object("p/c", 30, "\"c\""));
+        objects.push_back(object("p/e", 50, "\"e\""));
+        ok = index.replace("bucket", "p/", objects);
+        assert(ok);
+        assert(index.size() == 3);
+        assert(has(index, "p/a", 10, "\"a\"") && has(index, "p/c", 30, "\"c\"") && has(index, "p/e", 50, "\"e\""));
+        aws::s3::ObjectInfo info;
+        assert(!index.lookup("p/b", info) && !index.lookup("p/f", info) && !index.lookup("p/", info));
+    }
+
+    {
+        // the mapped file is read back, uploads go to the journal
+        RemoteIndex index;
+        ok = index.open(path);
+        assert(ok);
+        assert(index.bucket() == "bucket" && index.prefix() == "p/");
+        assert(index.size() == 3 && has(index, "p/c", 30, "\"c\""));
+        ok = index.put("bucket", object("p/b", 20, "\"b\""));
+        assert(ok);
+        ok = index.put("bucket", object("p/c", 31, "\"c2\""));
+        assert(ok);
+        ok = index.put("bucket", object("p/f", 60, "\"f\""));
+        assert(ok);
+        // other buckets and prefixes are ignored
+        ok = index.put("other", object("p/g", 70, "\"g\""));
+        assert(ok);
+        ok = index.put("bucket", object("q/g", 70, "\"g\""));
+        assert(ok);
+        assert(index.size() == 5);
+        assert(has(index, "p/b", 20, "\"b\"") && has(index, "p/c", 31, "\"c2\""));
+    }
+
+    {
+        RemoteIndex index;
+        ok = index.open(path);
+        assert(ok);
+        assert(index.size() == 5);
+        assert(has(index, "p/b", 20, "\"b\"") && has(index, "p/c", 31, "\"c2\"") && has(index, "p/f", 60, "\"f\""));
+        aws::s3::ObjectInfo info;
+        assert(!index.lookup("q/g", info));
+        ok = index.compact();
+        assert(ok);
+        assert(index.size() == 5);
+    }
+
+    {
+        // after the merge the journal is empty and the records are sorted
+        RemoteIndex index;
+        ok = index.open(path);
+        assert(ok);
+        assert(index.size() == 5);
+        assert(has(index, "p/a", 10, "\"a\"") && has(index, "p/b", 20, "\"b\"") && has(index, "p/c", 31, "\"c2\"")
+               && has(index, "p/e", 50, "\"e\"") && has(index, "p/f", 60, "\"f\""));
+        FILE *f = fopen((path + ".journal").c_str(), "r");
+        assert(f);
+        int c = fgetc(f);
+        assert(c == EOF);
+        fclose(f);
+    }
+
+    unlink(path.c_str());
+    unlink((path + ".journal").c_str());
+    rmdir(dir);
+    printf("remote_index_test: ok\n");
+}
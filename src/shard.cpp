@@ -0,0 +1,160 @@
+#include "shard.h"
+#include "timeutil.h"
+#include "log.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+namespace {
+
+// FNV-1a, stable across builds, so the same key always goes to the same shard
+uint64_t
+key_hash(const std::string &key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+std::string
+key_prefix_of(const std::string &key)
+{
+    size_t slash = key.find('/');
+    return slash == std::string::npos?std::string():key.substr(0, slash + 1);
+}
+
+}
+
+KeySharder::KeySharder(int count)
+    : count_(count), width_(1)
+{
+    for (int n = count - 1; n >= 16; n /= 16) ++width_;
+}
+
+KeySharder::~KeySharder()
+{
+    if (manifest_) fclose(manifest_);
+}
+
+bool
+KeySharder::open_manifest(const std::string &path)
+{
+    manifest_path_ = path;
+    manifest_ = fopen(path.c_str(), "ae");
+    if (!manifest_) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+std::string
+KeySharder::map(const std::string &key) const
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%0*x/", width_, (unsigned) (key_hash(key) % count_));
+    return buf + key;
+}
+
+bool
+KeySharder::record(const std::string &key)
+{
+    if (!manifest_) return true;
+    std::string shard = map(key);
+    shard.erase(width_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    fprintf(manifest_, "%s %s\n", shard.c_str(), key.c_str());
+    if (fflush(manifest_) || fdatasync(fileno(manifest_)) < 0) {
+        log_error("cannot write '%s': %s", manifest_path_.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+PrefixRates::PrefixRates(double max_rate)
+    : max_rate_(max_rate)
+{
+}
+
+// a token bucket holding at most one second of requests; a request
+// may take a token ahead, and then waits until it is earned
+void
+PrefixRates::acquire(const std::string &key)
+{
+    uint64_t wait_us = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Prefix &p = prefixes_[key_prefix_of(key)];
+        ++p.requests;
+        if (max_rate_ <= 0) return;
+        uint64_t now_us = monotonic_us();
+        if (!p.last_us) {
+            p.rate = max_rate_;
+            p.tokens = max_rate_;
+            p.adjusted_us = now_us;
+        } else {
+            p.tokens = std::min(p.rate, p.tokens + p.rate * (now_us - p.last_us) / 1e6);
+        }
+        p.last_us = now_us;
+        p.tokens -= 1;
+        if (p.tokens < 0) wait_us = -p.tokens / p.rate * 1e6;
+    }
+    if (wait_us) usleep(wait_us);
+}
+
+void
+PrefixRates::record(const std::string &key, bool throttled)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Prefix &p = prefixes_[key_prefix_of(key)];
+    if (throttled) ++p.throttled;
+    if (max_rate_ <= 0 || !p.last_us) return;
+    uint64_t now_us = monotonic_us();
+    if (throttled) {
+        p.rate = std::max(1.0, p.rate / 2);
+        p.adjusted_us = now_us;
+        log_warning("prefix '%s' is throttled, rate lowered to %.0f/s", key_prefix_of(key).c_str(), p.rate);
+    } else {
+        // the rate grows with time, not with the number of requests,
+        // so a burst of successes cannot restore it at once
+        p.rate = std::min(max_rate_, p.rate + (now_us - p.adjusted_us) / 1e6);
+        p.adjusted_us = now_us;
+    }
+}
+
+double
+PrefixRates::rate(const std::string &key) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = prefixes_.find(key_prefix_of(key));
+    return it == prefixes_.end()?0:it->second.rate;
+}
+
+uint64_t
+PrefixRates::requests(const std::string &key) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = prefixes_.find(key_prefix_of(key));
+    return it == prefixes_.end()?0:it->second.requests;
+}
+
+void
+PrefixRates::report() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> names;
+    for (const auto &p : prefixes_) names.push_back(p.first);
+    std::sort(names.begin(), names.end());
+    for (const std::string &name : names) {
+        const Prefix &p = prefixes_.at(name);
+        log_info("prefix '%s': %llu requests, %llu throttled", name.c_str(),
+                 (unsigned long long) p.requests, (unsigned long long) p.throttled);
+    }
+}
@@ -0,0 +1,73 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
+
+// spreads the keys of a batch over 'count' prefixes derived from a hash of
+// the key, so the request rate limit of S3 applies to each prefix separately;
+// the manifest is an append-only file of "<shard> <original key>" lines,
+// the object is stored as "<shard>/<original key>"
+class KeySharder
+{
+    int count_;
+    int width_;                 // hex digits of the shard names
+    std::string manifest_path_;
+    FILE *manifest_ = nullptr;
+    std::mutex mutex_;
+
+public:
+    explicit KeySharder(int count);
+    ~KeySharder();
+
+    KeySharder(const KeySharder &) = delete;
+    KeySharder &operator= (const KeySharder &) = delete;
+
+    bool open_manifest(const std::string &path);
+
+    // the key the object is stored under
+    std::string map(const std::string &key) const;
+    // record an uploaded object in the manifest
+    bool record(const std::string &key);
+};
+
+// requests and throttled responses per key prefix (the key up to the first
+// '/'); with a positive rate the requests to a prefix are paced to at most
+// that many per second, the rate of a prefix is halved when it is throttled
+// and regained by one request per second for every second without throttling
+class PrefixRates
+{
+    struct Prefix
+    {
+        double rate = 0;
+        double tokens = 0;
+        uint64_t last_us = 0;
+        uint64_t adjusted_us = 0;   // the last change of the rate
+        uint64_t requests = 0;
+        uint64_t throttled = 0;
+    };
+
+    mutable std::mutex mutex_;
+    double max_rate_;
+    std::unordered_map<std::string, Prefix> prefixes_;
+
+public:
+    explicit PrefixRates(double max_rate);
+
+    PrefixRates(const PrefixRates &) = delete;
+    PrefixRates &operator= (const PrefixRates &) = delete;
+
+    // wait until a request to the key may be sent
+    void acquire(const std::string &key);
+    void record(const std::string &key, bool throttled);
+
+    // the current rate and the request count of the prefix of the key
+    double rate(const std::string &key) const;
+    uint64_t requests(const std::string &key) const;
+
+    // log the counts of every prefix
+    void report() const;
+};
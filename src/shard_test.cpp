@@ -0,0 +1,215 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "shard.h"
+#include "multipart.h"
+#include "aimd.h"
+#include "staging.h"
+#include "timeutil.h"
+#include "util.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// stands in for the aws CLI: logs the operations, a part upload takes 0.3 s
+static const char fake_aws[] = R"sh(#!/bin/sh
+echo "$2" >> "$FAKE_AWS_DIR/log"
+case $2 in
+create-multipart-upload)
+    echo '{"Bucket": "bucket", "Key": "p/key", "UploadId": "upload-1"}';;
+upload-part)
+    sleep 0.3
+    echo '{"ETag": "\"0123456789abcdef0123456789abcdef\""}';;
+complete-multipart-upload)
+    cat > /dev/null
+    echo '{"Bucket": "bucket", "Key": "p/key", "Location": "here", "ETag": "\"e-2\""}';;
+esac
+)sh";
+
+static std::string
+read_file(const std::string &path)
+{
+    std::ifstream in(path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static void
+write_file(const std::string &path, const std::string &text, mode_t mode)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    assert(fd >= 0);
+    int written = write_full(fd, text.data(), text.size());
+    assert(written == 0);
+    close(fd);
+}
+
+static double
+elapsed_s(uint64_t start_us)
+{
+    return (monotonic_us() - start_us) / 1e6;
+}
+
+static void
+test_prefix_rates()
+{
+    // counting only
+    {
+        PrefixRates rates(0);
+        uint64_t t0 = monotonic_us();
+        for (int i = 0; i < 100; ++i) rates.acquire("a/" + std::to_string(i));
+        rates.acquire("b/x");
+        rates.acquire("top");
+        assert(elapsed_s(t0) < 0.1);
+        assert(rates.requests("a/") == 100 && rates.requests("b/y") == 1 && rates.requests("other") == 1);
+        assert(rates.requests("c/") == 0);
+    }
+
+    // a full bucket lets a second of requests through, then they are paced
+    {
+        PrefixRates rates(20);
+        uint64_t t0 = monotonic_us();
+        for (int i = 0; i < 20; ++i) rates.acquire("a/x");
+        assert(elapsed_s(t0) < 0.1);
+        for (int i = 0; i < 5; ++i) rates.acquire("a/x");
+        double s = elapsed_s(t0);
+        assert(s > 0.2 && s < 1.0);
+        // another prefix has its own bucket
+        t0 = monotonic_us();
+        rates.acquire("b/x");
+        assert(elapsed_s(t0) < 0.05);
+    }
+
+    // the rate is halved on throttling down to 1/s, and regained with time
+    {
+        PrefixRates rates(100);
+        rates.record("a/x", true);
+        assert(rates.rate("a/x") == 0);     // no requests yet
+        rates.acquire("a/x");
+        assert(rates.rate("a/x") == 100);
+        rates.record("a/x", true);
+        assert(rates.rate("a/y") == 50);
+        rates.record("a/x", true);
+        assert(rates.rate("a/x") == 25);
+        assert(rates.rate("b/x") == 0);
+        for (int i = 0; i < 10; ++i) rates.record("a/x", true);
+        assert(rates.rate("a/x") == 1);
+
+        // a burst of successes does not restore the rate at once
+        for (int i = 0; i < 100; ++i) rates.record("a/x", false);
+        assert(rates.rate("a/x") < 1.1);
+        usleep(300000);
+        rates.record("a/x", false);
+        double rate = rates.rate("a/x");
+        assert(rate > 1.25 && rate < 1.6);
+    }
+    {
+        PrefixRates rates(1.5);
+        rates.acquire("a/x");
+        rates.record("a/x", true);
+        assert(rates.rate("a/x") == 1);
+        usleep(700000);
+        rates.record("a/x", false);
+        assert(rates.rate("a/x") == 1.5);
+    }
+}
+
+// a part waiting for a concurrency slot does not take a prefix token yet
+static void
+test_token_in_slot()
+{
+    char dir[] = "/tmp/shard_test.XXXXXX";
+    char *dir_ok = mkdtemp(dir);
+    assert(dir_ok);
+    std::string base = dir;
+    std::string bin = base + "/bin";
+    int r = mkdir(bin.c_str(), 0700);
+    assert(r == 0);
+    write_file(bin + "/aws", fake_aws, 0700);
+    setenv("PATH", (bin + ":" + getenv("PATH")).c_str(), 1);
+    setenv("FAKE_AWS_DIR", base.c_str(), 1);
+
+    std::string data_path = base + "/data";
+    write_file(data_path, std::string(2000, 'd'), 0600);
+    int fd = open(data_path.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    std::vector<PartSource> parts(2);
+    for (int i = 0; i < 2; ++i) {
+        parts[i].fd = fd;
+        parts[i].beg = i * 1000;
+        parts[i].end = (i + 1) * 1000;
+    }
+
+    StagingArea staging(base, 0);
+    ConcurrencyLimiter limiter(1, 1);
+    PrefixRates rates(1000);
+    UploadOptions options;
+    options.jobs = 2;
+    options.staging = &staging;
+    options.limiter = &limiter;
+    options.prefix_rates = &rates;
+    bool ok = false;
+    std::thread upload([&] { ok = upload_object(options, "bucket", "p/key", parts); });
+
+    // the create request and the first part are counted while the
+    // second part waits for the slot
+    std::string log_path = base + "/log";
+    for (int i = 0; i < 2000 && read_file(log_path) != "create-multipart-upload\nupload-part\n"; ++i) usleep(1000);
+    assert(read_file(log_path) == "create-multipart-upload\nupload-part\n");
+    usleep(100000);
+    assert(rates.requests("p/key") == 2);
+    upload.join();
+    assert(ok);
+    assert(rates.requests("p/key") == 4);
+    assert(read_file(log_path) == "create-multipart-upload\nupload-part\nupload-part\ncomplete-multipart-upload\n");
+
+    close(fd);
+    unlink((bin + "/aws").c_str());
+    rmdir(bin.c_str());
+    unlink(data_path.c_str());
+    unlink(log_path.c_str());
+    rmdir(dir);
+}
+
+int main()
+{
+    // the mapping is stable: FNV-1a of the key modulo the count
+    KeySharder one(1);
+    assert(one.map("a/b") == "0/a/b");
+
+    KeySharder sharder(16);
+    assert(sharder.map("") == "5/");
+    assert(sharder.map("a") == "c/a");
+    assert(sharder.map("a") == sharder.map("a"));
+
+    // 256 shards take two hex digits, 4096 take three
+    KeySharder wide(256);
+    assert(wide.map("a") == "8c/a");
+    KeySharder wider(4096);
+    assert(wider.map("a") == "c8c/a");
+
+    std::set<std::string> shards;
+    for (int i = 0; i < 1000; ++i) {
+        std::string key = "logs/" + std::to_string(i);
+        std::string mapped = sharder.map(key);
+        assert(mapped.size() == key.size() + 2 && mapped[1] == '/' && !mapped.compare(2, std::string::npos, key));
+        shards.insert(mapped.substr(0, 1));
+    }
+    assert(shards.size() == 16);
+
+    test_prefix_rates();
+    test_token_in_slot();
+
+    printf("shard_test: ok\n");
+}
@@ -0,0 +1,371 @@
+#include "spool.h"
+#include "thread_pool.h"
+#include "shard.h"
+#include "timeutil.h"
+#include "log.h"
+
+#include <atomic>
+#include <map>
+#include <algorithm>
+#include <functional>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+
+WorkQueue::~WorkQueue()
+{
+    if (journal_) fclose(journal_);
+}
+
+bool
+WorkQueue::open(const std::string &path, std::vector<std::string> &pending)
+{
+    path_ = path;
+    pending.clear();
+
+    std::vector<std::string> order;
+    FILE *f = fopen(path.c_str(), "re");
+    if (f) {
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t len;
+        while ((len = getline(&line, &size, f)) > 0) {
+            if (line[len - 1] != '\n') break;   // torn last record
+            line[len - 1] = 0;
+            if (len < 3 || line[1] != ' ') continue;
+            std::string file(line + 2);
+            if (line[0] == 'A') {
+                if (pending_.insert(file).second) order.push_back(file);
+            } else if (line[0] == 'D') {
+                pending_.erase(file);
+            }
+        }
+        free(line);
+        fclose(f);
+    } else if (errno != ENOENT) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    for (const std::string &file : order) {
+        if (pending_.count(file)) pending.push_back(file);
+    }
+
+    // the compacted journal holds only the pending files
+    std::string tmp_path = path + ".tmp";
+    FILE *t = fopen(tmp_path.c_str(), "we");
+    if (!t) {
+        log_error("cannot open '%s': %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    for (const std::string &file : pending) {
+        fprintf(t, "A %s\n", file.c_str());
+    }
+    if (fflush(t) || fdatasync(fileno(t)) < 0 || ferror(t)) {
+        log_error("write error on '%s'", tmp_path.c_str());
+        fclose(t);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    fclose(t);
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        log_error("rename to '%s' failed: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    journal_ = fopen(path.c_str(), "ae");
+    if (!journal_) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// the record is on disk before the caller proceeds
+bool
+WorkQueue::append(char op, const std::string &path)
+{
+    fprintf(journal_, "%c %s\n", op, path.c_str());
+    if (fflush(journal_) || fdatasync(fileno(journal_)) < 0) {
+        log_error("cannot write '%s': %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool
+WorkQueue::add(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.count(path)) return false;
+    if (!append('A', path)) return false;
+    pending_.insert(path);
+    return true;
+}
+
+void
+WorkQueue::done(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!pending_.erase(path)) return;
+    append('D', path);
+}
+
+namespace {
+
+// names starting with a dot are temporary files of rsync and similar tools
+bool
+spool_name(const char *name)
+{
+    return name[0] != '.' && !strchr(name, '\n');
+}
+
+// a failed upload is retried after 1s, 2s, 4s... up to 5 minutes
+uint64_t
+retry_delay_us(int failures)
+{
+    int shift = std::min(failures - 1, 9);
+    return std::min<uint64_t>(1000000ULL << shift, 300000000ULL);
+}
+
+const char *
+base_name(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    return path.c_str() + (slash == std::string::npos?0:slash + 1);
+}
+
+}
+
+int
+run_spool_daemon(
+        const SpoolOptions &spool,
+        const UploadOptions &options,
+        const std::string &bucket)
+{
+    // the signals are blocked by the caller before any thread is started
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGINT);
+    sigaddset(&ss, SIGTERM);
+    sigprocmask(SIG_BLOCK, &ss, NULL);
+    int sfd = signalfd(-1, &ss, SFD_CLOEXEC);
+    if (sfd < 0) {
+        log_error("signalfd failed: %s", strerror(errno));
+        return 1;
+    }
+
+    int ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (ifd < 0) {
+        log_error("inotify_init1 failed: %s", strerror(errno));
+        close(sfd);
+        return 1;
+    }
+    std::map<int, std::string> watches;
+    for (const std::string &dir : spool.dirs) {
+        int wd = inotify_add_watch(ifd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR);
+        if (wd < 0) {
+            log_error("cannot watch '%s': %s", dir.c_str(), strerror(errno));
+            close(ifd);
+            close(sfd);
+            return 1;
+        }
+        watches[wd] = dir;
+    }
+
+    WorkQueue queue;
+    std::vector<std::string> pending;
+    if (!queue.open(spool.queue_file, pending)) {
+        close(ifd);
+        close(sfd);
+        return 1;
+    }
+
+    std::atomic<bool> stopping{false};
+    std::atomic<unsigned> uploaded{0}, failed{0};
+    ThreadPool pool(spool.workers);
+
+    // failed uploads stay queued and are retried with a growing delay,
+    // the main loop is woken through the eventfd to pick up a new deadline
+    int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd < 0) {
+        log_error("eventfd failed: %s", strerror(errno));
+        close(ifd);
+        close(sfd);
+        return 1;
+    }
+    std::mutex retry_mutex;
+    std::map<std::string, int> failures;
+    std::multimap<uint64_t, std::string> retries;
+
+    std::function<void(const std::string &)> process;
+    auto retry_later = [&](const std::string &path) {
+        {
+            std::lock_guard<std::mutex> lock(retry_mutex);
+            uint64_t delay_us = retry_delay_us(++failures[path]);
+            retries.emplace(monotonic_us() + delay_us, path);
+            log_info("%s is retried in %llu s", path.c_str(), (unsigned long long) (delay_us / 1000000));
+        }
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) < 0) {}
+    };
+    process = [&](const std::string &path) {
+        if (stopping) return;   // stays in the journal for the next run
+        // the file is uploaded from this descriptor, and removed only if the
+        // name still refers to it: a file of the same name may arrive meanwhile
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0 && errno == ENOENT) {
+            log_warning("%s disappeared, dropped from the queue", path.c_str());
+            queue.done(path);
+            return;
+        }
+        struct stat stb;
+        if (fd < 0 || fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode) || stb.st_size <= 0) {
+            log_error("cannot upload '%s': %s", path.c_str(), fd < 0?strerror(errno):"not a non-empty regular file");
+            if (fd >= 0) close(fd);
+            ++failed;
+            retry_later(path);
+            return;
+        }
+        std::string original_key = spool.key_prefix + base_name(path);
+        std::string key = options.sharder?options.sharder->map(original_key):original_key;
+        log_info("uploading %s to s3://%s/%s", path.c_str(), bucket.c_str(), key.c_str());
+        std::vector<PartSource> parts;
+        plan_parts(parts, fd, std::string(), 0, stb.st_size);
+        bool ok = check_parts(parts) && upload_object(options, bucket, key, parts);
+        close(fd);
+        if (!ok) {
+            log_error("upload of %s failed", path.c_str());
+            ++failed;
+            retry_later(path);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(retry_mutex);
+            failures.erase(path);
+        }
+        // the shard is a function of the key, a lost manifest line can be recomputed
+        if (options.sharder) options.sharder->record(original_key);
+        ++uploaded;
+
+        struct stat cur;
+        if (stat(path.c_str(), &cur) < 0 && errno == ENOENT) {
+            queue.done(path);
+            return;
+        }
+        if (cur.st_dev != stb.st_dev || cur.st_ino != stb.st_ino) {
+            // replaced while uploading, the new file is still queued under the name
+            log_info("%s was replaced during the upload, uploading it again", path.c_str());
+            pool.submit([&process, path] { process(path); });
+            return;
+        }
+        if (spool.done_dir.length()) {
+            std::string target = spool.done_dir + "/" + base_name(path);
+            if (rename(path.c_str(), target.c_str()) < 0) {
+                log_error("cannot move %s to %s: %s", path.c_str(), target.c_str(), strerror(errno));
+            }
+        } else if (unlink(path.c_str()) < 0) {
+            log_error("cannot remove %s: %s", path.c_str(), strerror(errno));
+        }
+        queue.done(path);
+    };
+    auto enqueue = [&](const std::string &path) {
+        if (queue.add(path)) {
+            pool.submit([&process, path] { process(path); });
+        }
+    };
+    // files which arrived while the daemon was not running
+    auto scan = [&] {
+        for (const std::string &dir : spool.dirs) {
+            DIR *d = opendir(dir.c_str());
+            if (!d) {
+                log_error("cannot open '%s': %s", dir.c_str(), strerror(errno));
+                continue;
+            }
+            struct dirent *dd;
+            while ((dd = readdir(d))) {
+                if (!spool_name(dd->d_name)) continue;
+                std::string path = dir + "/" + dd->d_name;
+                struct stat stb;
+                if (stat(path.c_str(), &stb) < 0 || !S_ISREG(stb.st_mode)) continue;
+                enqueue(path);
+            }
+            closedir(d);
+        }
+    };
+
+    for (const std::string &path : pending) {
+        pool.submit([&process, path] { process(path); });
+    }
+    scan();
+    log_info("spool daemon started: %zu directories, %zu files pending", spool.dirs.size(), pending.size());
+
+    struct pollfd pfds[3] = { { ifd, POLLIN, 0 }, { sfd, POLLIN, 0 }, { efd, POLLIN, 0 } };
+    while (1) {
+        int timeout_ms = -1;
+        {
+            std::lock_guard<std::mutex> lock(retry_mutex);
+            uint64_t now_us = monotonic_us();
+            while (!retries.empty() && retries.begin()->first <= now_us) {
+                std::string path = std::move(retries.begin()->second);
+                retries.erase(retries.begin());
+                pool.submit([&process, path] { process(path); });
+            }
+            if (!retries.empty()) timeout_ms = (retries.begin()->first - now_us + 999) / 1000;
+        }
+        int n = poll(pfds, 3, timeout_ms);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            log_error("poll failed: %s", strerror(errno));
+            break;
+        }
+        if (pfds[1].revents) {
+            struct signalfd_siginfo sif;
+            if (read(sfd, &sif, sizeof(sif)) == sizeof(sif)) {
+                log_info("signal %d, stopping", (int) sif.ssi_signo);
+            }
+            break;
+        }
+        if (pfds[2].revents) {
+            uint64_t count;
+            if (read(efd, &count, sizeof(count)) < 0) {}
+        }
+        if (!pfds[0].revents) continue;
+
+        alignas(struct inotify_event) char buf[65536];
+        ssize_t len;
+        while ((len = read(ifd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                const struct inotify_event *ev = (const struct inotify_event *) p;
+                p += sizeof(*ev) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    log_warning("inotify queue overflow, rescanning");
+                    scan();
+                    continue;
+                }
+                if ((ev->mask & IN_ISDIR) || !ev->len || !spool_name(ev->name)) continue;
+                auto it = watches.find(ev->wd);
+                if (it == watches.end()) continue;
+                enqueue(it->second + "/" + ev->name);
+            }
+        }
+    }
+
+    // uploads in progress are finished, the queued ones are left to the next run
+    stopping = true;
+    pool.wait();
+    close(efd);
+    close(ifd);
+    close(sfd);
+    log_info("spool daemon stopped: %u uploaded, %u failed", (unsigned) uploaded, (unsigned) failed);
+    return 0;
+}
@@ -0,0 +1,56 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "multipart.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <mutex>
+#include <cstdio>
+
+// persistent queue of files to upload, kept as an append-only journal of
+// "A path" (added) and "D path" (done) lines, compacted when opened
+class WorkQueue
+{
+    std::string path_;
+    FILE *journal_ = nullptr;
+    std::set<std::string> pending_;
+    std::mutex mutex_;
+
+    bool append(char op, const std::string &path);
+
+public:
+    WorkQueue() = default;
+    ~WorkQueue();
+
+    WorkQueue(const WorkQueue &) = delete;
+    WorkQueue &operator= (const WorkQueue &) = delete;
+
+    // load the journal, the pending files are returned in journal order
+    bool open(const std::string &path, std::vector<std::string> &pending);
+
+    // returns false if the file is already queued or the journal cannot be written
+    bool add(const std::string &path);
+    void done(const std::string &path);
+};
+
+struct SpoolOptions
+{
+    std::vector<std::string> dirs;
+    std::string queue_file;
+    std::string done_dir;       // empty: delete the uploaded files
+    std::string key_prefix;
+    int workers = 1;            // files uploaded concurrently
+};
+
+// watches the spool directories and uploads every file that is closed
+// after writing or moved into them, runs until SIGINT or SIGTERM;
+// a failed upload is retried with a growing delay, a file replaced by
+// another one of the same name during its upload is uploaded again
+int
+run_spool_daemon(
+        const SpoolOptions &spool,
+        const UploadOptions &options,
+        const std::string &bucket);
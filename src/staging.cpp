@@ -0,0 +1,124 @@
+#include "staging.h"
+#include "extract_file.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+void
+StagedFile::reset()
+{
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    if (area_) {
+        area_->release(size_);
+        area_ = nullptr;
+    }
+    size_ = 0;
+    path_.clear();
+}
+
+void
+StagedFile::shrink(off_t size)
+{
+    if (size >= size_) return;
+    if (area_) area_->release(size_ - size);
+    size_ = size;
+}
+
+StagingArea::StagingArea(const std::string &dir, uint64_t budget)
+    : dir_(dir), budget_(budget)
+{
+    const char *s;
+    if (!dir_.length() && (s = getenv("TMPDIR")) && *s) {
+        dir_.assign(s);
+    }
+    if (!dir_.length()) {
+        dir_.assign("/tmp");
+    }
+}
+
+void
+StagingArea::reserve(uint64_t size)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!budget_) {
+        used_ += size;
+        return;
+    }
+    // a file larger than the whole budget waits until the area is empty
+    cond_.wait(lock, [this, size] { return !used_ || used_ + size <= budget_; });
+    used_ += size;
+}
+
+void
+StagingArea::release(uint64_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ -= size;
+    }
+    cond_.notify_all();
+}
+
+int
+StagingArea::open_anonymous()
+{
+    if (use_tmpfile_) {
+        int fd = open(dir_.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd >= 0) return fd;
+        if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+            log_error("StagingArea: open(%s, O_TMPFILE) failed: %s",
+                      dir_.c_str(), strerror(errno));
+            return -1;
+        }
+        // the file system does not support O_TMPFILE
+        use_tmpfile_ = false;
+    }
+
+    char path_buf[PATH_MAX];
+    int fd = create_temporary_fd(path_buf, sizeof(path_buf), dir_.c_str());
+    if (fd < 0) return -1;
+    unlink(path_buf);
+    return fd;
+}
+
+bool
+StagingArea::create(StagedFile &file, off_t size)
+{
+    file.reset();
+    reserve(size);
+    file.area_ = this;
+    file.size_ = size;
+
+    file.fd_ = open_anonymous();
+    if (file.fd_ < 0) {
+        file.reset();
+        return false;
+    }
+
+    // the file has no name, children open it through our descriptor table
+    char path_buf[64];
+    snprintf(path_buf, sizeof(path_buf), "/proc/%d/fd/%d", (int) getpid(), file.fd_);
+    file.path_.assign(path_buf);
+    return true;
+}
+
+bool
+StagingArea::stage(StagedFile &file, int srcfd, off_t beg, off_t end)
+{
+    if (!create(file, end - beg)) return false;
+    int r = direct_?copy_file_fd_direct(file.fd(), srcfd, beg, end):clone_file_fd(file.fd(), srcfd, beg, end);
+    if (r < 0) {
+        file.reset();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,76 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <sys/types.h>
+
+class StagingArea;
+
+// anonymous file in the staging area, the space reserved for it is
+// returned to the area when the object is destroyed
+class StagedFile
+{
+    StagingArea *area_ = nullptr;
+    int fd_ = -1;
+    off_t size_ = 0;
+    std::string path_;
+
+    friend class StagingArea;
+
+public:
+    StagedFile() = default;
+    ~StagedFile() { reset(); }
+
+    StagedFile(const StagedFile &) = delete;
+    StagedFile &operator= (const StagedFile &) = delete;
+
+    int fd() const { return fd_; }
+    off_t size() const { return size_; }
+    // path under which the file can be opened by the child processes
+    const std::string &path() const { return path_; }
+
+    void reset();
+    // the actual size became known, return the rest of the reservation
+    void shrink(off_t size);
+};
+
+// directory for temporary copies of parts with a limit on the total size,
+// creation of staged files blocks while the limit is exhausted
+class StagingArea
+{
+    std::string dir_;
+    uint64_t budget_;
+    uint64_t used_ = 0;
+    std::atomic<bool> use_tmpfile_{true};
+    bool direct_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+
+    void reserve(uint64_t size);
+    void release(uint64_t size);
+    int open_anonymous();
+
+    friend class StagedFile;
+
+public:
+    // budget of 0 means no limit
+    StagingArea(const std::string &dir, uint64_t budget);
+
+    StagingArea(const StagingArea &) = delete;
+    StagingArea &operator= (const StagingArea &) = delete;
+
+    const std::string &dir() const { return dir_; }
+    uint64_t budget() const { return budget_; }
+
+    // read the sources of the copies with O_DIRECT, bypassing the page cache
+    void set_direct(bool direct) { direct_ = direct; }
+
+    bool create(StagedFile &file, off_t size);
+    // copy [beg, end) of srcfd to a new staged file, reflinking when possible
+    bool stage(StagedFile &file, int srcfd, off_t beg, off_t end);
+};
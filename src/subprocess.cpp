@@ -1,6 +1,11 @@
 #include "subprocess.h"
+#include "timeutil.h"
+#include "trace.h"
+#include "qos.h"
+#include "log.h"
 
 #include <sstream>
+#include <algorithm>
 
 #include <stdio.h>
 #include <string.h>
@@ -21,25 +26,38 @@ Subprocess::run_and_wait()
 {
     signal(SIGPIPE, SIG_IGN);
 
-    if (pipe(in_pipe) < 0) {
-        fprintf(stderr, "Subprocess::run_and_wait: pipe: %s\n",
-                strerror(errno));
+    if (pipe2(in_pipe, O_CLOEXEC) < 0) {
+        log_error("Subprocess::run_and_wait: pipe: %s",
+                  strerror(errno));
         return false;
     }
-    if (pipe(out_pipe) < 0) {
-        fprintf(stderr, "Subprocess::run_and_wait: pipe: %s\n",
-                strerror(errno));
+    if (pipe2(out_pipe, O_CLOEXEC) < 0) {
+        log_error("Subprocess::run_and_wait: pipe: %s",
+                  strerror(errno));
         return false;
     }
-    if (pipe(err_pipe) < 0) {
-        fprintf(stderr, "Subprocess::run_and_wait: pipe: %s\n",
-                strerror(errno));
+    if (pipe2(err_pipe, O_CLOEXEC) < 0) {
+        log_error("Subprocess::run_and_wait: pipe: %s",
+                  strerror(errno));
         return false;
     }
+    // the argument vector is prepared before fork, as other threads may hold the allocator locks
+    std::vector<char *> argv;
+    argv.reserve(args_.size() + 2);
+    argv.push_back((char*) cmd_.c_str());
+    for (size_t i = 0; i < args_.size(); ++i) {
+        argv.push_back((char*) args_[i].c_str());
+    }
+    argv.push_back(nullptr);
+
+    uint64_t start_us = monotonic_us();
+    trace::begin("fork", -1);
     pid = fork();
+    if (pid) trace::end("fork", -1);
+    spawn_time_us = monotonic_us() - start_us;
     if (pid < 0) {
-        fprintf(stderr, "Subprocess::run_and_wait: fork: %s\n",
-                strerror(errno));
+        log_error("Subprocess::run_and_wait: fork: %s",
+                  strerror(errno));
         return false;
     }
     if (!pid) {
@@ -49,13 +67,9 @@ Subprocess::run_and_wait()
         close(out_pipe[0]); close(out_pipe[1]);
         dup2(err_pipe[1], 2);
         close(err_pipe[0]); close(err_pipe[1]);
+        qos_apply_child();
 
-        char **aaa = (char**) calloc(args_.size() + 2, sizeof(aaa[0]));
-        aaa[0] = (char*) cmd_.c_str();
-        for (size_t i = 0; i < args_.size(); ++i) {
-            aaa[i + 1] = (char*) args_[i].c_str();
-        }
-        execvp(aaa[0], aaa);
+        execvp(argv[0], argv.data());
         fprintf(stderr, "Subprocess::run_and_wait: execvp: %s\n",
                 strerror(errno));
         _exit(1);
@@ -75,15 +89,15 @@ Subprocess::run_and_wait()
     sigprocmask(SIG_BLOCK, &ss, &olds);
     signal_fd = signalfd(-1, &ss, 0);
     if (signal_fd < 0) {
-        fprintf(stderr, "Subprocess::run_and_wait: signalfd: %s\n",
-                strerror(errno));
+        log_error("Subprocess::run_and_wait: signalfd: %s",
+                  strerror(errno));
         return false;
     }
 
     epoll_fd = epoll_create1(0);
     if (epoll_fd < 0) {
-        fprintf(stderr, "Subprocess::run_and_wait: epoll: %s\n",
-                strerror(errno));
+        log_error("Subprocess::run_and_wait: epoll: %s",
+                  strerror(errno));
         return false;
     }
 
@@ -119,8 +133,8 @@ Subprocess::run_and_wait()
         struct epoll_event evs[EVENT_SIZE];
         int n = epoll_wait(epoll_fd, evs, EVENT_SIZE, -1);
         if (n < 0) {
-            fprintf(stderr, "Subprocess::run_and_wait: epoll_wait: %s\n",
-                    strerror(errno));
+            log_error("Subprocess::run_and_wait: epoll_wait: %s",
+                      strerror(errno));
             return false;
         }
         if (!n) {
@@ -165,14 +179,14 @@ Subprocess::run_and_wait()
                             break;
                         } else if (ww < 0) {
                             // report error
-                            fprintf(stderr, "Subprocess::run_and_wait: splice: %s\n",
-                                    strerror(errno));
+                            log_error("Subprocess::run_and_wait: splice: %s",
+                                      strerror(errno));
                             epoll_ctl(epoll_fd, EPOLL_CTL_DEL, in_pipe[1], NULL);
                             close(in_pipe[1]); in_pipe[1] = -1;
                             --fd_count;
                             break;
                         } else if (!ww) {
-                            fprintf(stderr, "Subprocess::run_and_wait: splice returned 0!\n");
+                            log_error("Subprocess::run_and_wait: splice returned 0!");
                             epoll_ctl(epoll_fd, EPOLL_CTL_DEL, in_pipe[1], NULL);
                             close(in_pipe[1]); in_pipe[1] = -1;
                             --fd_count;
@@ -202,14 +216,14 @@ Subprocess::run_and_wait()
                             break;
                         } else if (ww < 0) {
                             // report error
-                            fprintf(stderr, "Subprocess::run_and_wait: write: %s\n",
-                                    strerror(errno));
+                            log_error("Subprocess::run_and_wait: write: %s",
+                                      strerror(errno));
                             epoll_ctl(epoll_fd, EPOLL_CTL_DEL, in_pipe[1], NULL);
                             close(in_pipe[1]); in_pipe[1] = -1;
                             --fd_count;
                             break;
                         } else if (!ww) {
-                            fprintf(stderr, "Subprocess::run_and_wait: write returned 0!\n");
+                            log_error("Subprocess::run_and_wait: write returned 0!");
                             epoll_ctl(epoll_fd, EPOLL_CTL_DEL, in_pipe[1], NULL);
                             close(in_pipe[1]); in_pipe[1] = -1;
                             --fd_count;
@@ -230,24 +244,24 @@ Subprocess::run_and_wait()
                 struct signalfd_siginfo sif;
                 ssize_t rr = read(signal_fd, &sif, sizeof(sif));
                 if (rr < 0) {
-                    fprintf(stderr, "Subprocess::run_and_wait: read signalfd: %s\n",
-                            strerror(errno));
+                    log_error("Subprocess::run_and_wait: read signalfd: %s",
+                              strerror(errno));
                     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, signal_fd, NULL);
                     close(signal_fd); signal_fd = -1;
                 } else if (!rr) {
-                    fprintf(stderr, "Subprocess::run_and_wait: signalfd EOF\n");
+                    log_error("Subprocess::run_and_wait: signalfd EOF");
                     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, signal_fd, NULL);
                     close(signal_fd); signal_fd = -1;
                 } else if (rr != sizeof(sif)) {
-                    fprintf(stderr, "Subprocess::run_and_wait: short read\n");
+                    log_error("Subprocess::run_and_wait: short read");
                     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, signal_fd, NULL);
                     close(signal_fd); signal_fd = -1;
                 } else if (sif.ssi_signo != SIGCHLD) {
-                    fprintf(stderr, "Subprocess::run_and_wait: signal %d\n",
-                            sif.ssi_signo);
+                    log_debug("Subprocess::run_and_wait: signal %d",
+                              sif.ssi_signo);
                 } else if ((int) sif.ssi_pid != pid) {
-                    fprintf(stderr, "Subprocess::run_and_wait: pid %d\n",
-                            sif.ssi_pid);
+                    log_debug("Subprocess::run_and_wait: pid %d",
+                              sif.ssi_pid);
                 } else {
                     //process_finished = true;
                 }
@@ -259,8 +273,8 @@ Subprocess::run_and_wait()
                     if (rr < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
                         break;
                     } else if (rr < 0) {
-                        fprintf(stderr, "Subprocess::run_and_wait: read: %s\n",
-                                strerror(errno));
+                        log_error("Subprocess::run_and_wait: read: %s",
+                                  strerror(errno));
                         epoll_ctl(epoll_fd, EPOLL_CTL_DEL, out_pipe[0], NULL);
                         close(out_pipe[0]); out_pipe[0] = -1;
                         --fd_count;
@@ -271,7 +285,18 @@ Subprocess::run_and_wait()
                         --fd_count;
                         break;
                     } else {
-                        output_.append(buf, rr);
+                        const char *data = buf;
+                        size_t size = rr;
+                        if (output_sink_left > 0) {
+                            size_t n = std::min<off_t>(size, output_sink_left);
+                            if (!output_sink_failed && !output_sink(data, n)) {
+                                output_sink_failed = true;
+                            }
+                            output_sink_left -= n;
+                            data += n;
+                            size -= n;
+                        }
+                        output_.append(data, size);
                     }
                 }
             } else if (err_pipe[0] >= 0 && (pev->events & (EPOLLIN | EPOLLHUP))
@@ -282,8 +307,8 @@ Subprocess::run_and_wait()
                     if (rr < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
                         break;
                     } else if (rr < 0) {
-                        fprintf(stderr, "Subprocess::run_and_wait: read: %s\n",
-                                strerror(errno));
+                        log_error("Subprocess::run_and_wait: read: %s",
+                                  strerror(errno));
                         epoll_ctl(epoll_fd, EPOLL_CTL_DEL, err_pipe[0], NULL);
                         close(err_pipe[0]); err_pipe[0] = -1;
                         --fd_count;
@@ -298,29 +323,29 @@ Subprocess::run_and_wait()
                     }
                 }
             } else {
-                fprintf(stderr, "Subprocess::run_and_wait: epoll event %d on fd %d\n",
-                        pev->events, pev->data.fd);
+                log_warning("Subprocess::run_and_wait: epoll event %d on fd %d",
+                            pev->events, pev->data.fd);
                 if (in_pipe[1] >= 0 && pev->data.fd == in_pipe[1]) {
-                    fprintf(stderr, "Subprocess::run_and_wait: closing stdin pipe\n");
+                    log_warning("Subprocess::run_and_wait: closing stdin pipe");
                     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pev->data.fd, NULL);
                     close(in_pipe[1]); in_pipe[1] = -1;
                     --fd_count;
                 } else if (signal_fd >= 0 && pev->data.fd == signal_fd) {
-                    fprintf(stderr, "Subprocess::run_and_wait: closing signalfd\n");
+                    log_warning("Subprocess::run_and_wait: closing signalfd");
                     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pev->data.fd, NULL);
                     close(signal_fd); signal_fd = -1;
                 } else if (out_pipe[0] >= 0 && pev->data.fd == out_pipe[0]) {
-                    fprintf(stderr, "Subprocess::run_and_wait: closing stdout pipe\n");
+                    log_warning("Subprocess::run_and_wait: closing stdout pipe");
                     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pev->data.fd, NULL);
                     close(out_pipe[0]); out_pipe[0] = -1;
                     --fd_count;
                 } else if (err_pipe[0] >= 0 && pev->data.fd == err_pipe[0]) {
-                    fprintf(stderr, "Subprocess::run_and_wait: closing stderr pipe\n");
+                    log_warning("Subprocess::run_and_wait: closing stderr pipe");
                     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pev->data.fd, NULL);
                     close(err_pipe[0]); err_pipe[0] = -1;
                     --fd_count;
                 } else {
-                    fprintf(stderr, "Subprocess::run_and_wait: removing unexpected fd\n");
+                    log_warning("Subprocess::run_and_wait: removing unexpected fd");
                     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pev->data.fd, NULL);
                 }
             }
@@ -348,10 +373,10 @@ Subprocess::run_and_wait()
         int status = 0;
         int res = wait4(pid, &status, 0, &ru);
         if (res < 0) {
-            fprintf(stderr, "Subprocess::run_and_wait: wait4: %s\n",
-                    strerror(errno));
+            log_error("Subprocess::run_and_wait: wait4: %s",
+                      strerror(errno));
         } else if (res != pid) {
-            fprintf(stderr, "Subprocess::run_and_wait: wrong PID\n");
+            log_error("Subprocess::run_and_wait: wrong PID");
         } else {
             proc_status = status;
             ru_utime = ru.ru_utime.tv_sec * 1000ULL + ru.ru_utime.tv_usec / 1000ULL;
@@ -362,6 +387,7 @@ Subprocess::run_and_wait()
         }
     }
     pid = -1;
+    run_time_us = monotonic_us() - start_us;
 
     return WIFEXITED(proc_status) && !WEXITSTATUS(proc_status);
 }
@@ -391,7 +417,8 @@ Subprocess::stats() const
     std::ostringstream oss;
     oss << " utime=" << ru_utime << " stime=" << ru_stime
         << " maxrss=" << ru_maxrss << " nvcsw=" << ru_nvcsw
-        << " nivcsw=" << ru_nivcsw;
+        << " nivcsw=" << ru_nivcsw
+        << " spawn_us=" << spawn_time_us << " run_us=" << run_time_us;
     return oss.str();
 }
 
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <functional>
 #include <initializer_list>
 
 class Subprocess
@@ -15,6 +16,11 @@ class Subprocess
     off_t input_beg = 0;
     off_t input_end = 0;
 
+    // the first output_sink_left bytes of the output are passed to the sink
+    std::function<bool(const char *, size_t)> output_sink;
+    off_t output_sink_left = 0;
+    bool output_sink_failed = false;
+
     // state
     int pid = -1;
     int in_pipe[2] = { -1, -1 };
@@ -34,6 +40,8 @@ class Subprocess
     uint64_t ru_maxrss = 0;
     uint64_t ru_nvcsw = 0;
     uint64_t ru_nivcsw = 0;
+    uint64_t spawn_time_us = 0;
+    uint64_t run_time_us = 0;
 
 public:
     Subprocess() noexcept {}
@@ -61,7 +69,7 @@ public:
     }
 
     void set_input(const std::string &input) { input_.assign(input); }
-    void set_input(std::string &&input) { input_.assign(input); }
+    void set_input(std::string &&input) { input_ = std::move(input); }
     void set_input_file_range(int fd, off_t beg, off_t end)
     {
         input_fd = fd;
@@ -69,6 +77,14 @@ public:
         input_end = end;
     }
 
+    void set_output_sink(std::function<bool(const char *, size_t)> sink, off_t size)
+    {
+        output_sink = std::move(sink);
+        output_sink_left = size;
+    }
+    // all the bytes expected by the sink are received and accepted
+    bool output_sink_complete() const { return !output_sink_left && !output_sink_failed; }
+
     bool run_and_wait();
     bool successful() const;
 
@@ -81,4 +97,14 @@ public:
     std::string &&move_error() { return std::move(error_); }
 
     std::string stats() const;
+
+    // resource usage of the finished child
+    uint64_t utime_ms() const { return ru_utime; }
+    uint64_t stime_ms() const { return ru_stime; }
+    uint64_t maxrss_kb() const { return ru_maxrss; }
+    uint64_t nvcsw() const { return ru_nvcsw; }
+    uint64_t nivcsw() const { return ru_nivcsw; }
+    // time spent in fork and total time until the child is reaped
+    uint64_t spawn_us() const { return spawn_time_us; }
+    uint64_t run_us() const { return run_time_us; }
 };
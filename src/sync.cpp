@@ -0,0 +1,389 @@
+#include "sync.h"
+#include "remote_index.h"
+#include "thread_pool.h"
+#include "extent.h"
+#include "shard.h"
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <thread>
+#include <condition_variable>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+SyncState::~SyncState()
+{
+    if (journal_) fclose(journal_);
+}
+
+bool
+SyncState::open(const std::string &path)
+{
+    path_ = path;
+    FILE *f = fopen(path.c_str(), "re");
+    if (f) {
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t len;
+        while ((len = getline(&line, &size, f)) > 0) {
+            size_t path_len = 0;
+            long long file_size = 0, mtime_ns = 0;
+            if (line[len - 1] != '\n'
+                || sscanf(line, "S %zu %lld %lld", &path_len, &file_size, &mtime_ns) != 3
+                || path_len > PATH_MAX) {
+                break;      // torn last record
+            }
+            std::string file(path_len, 0);
+            if (fread(&file[0], 1, path_len, f) != path_len || getc(f) != '\n') break;
+            entries_[file] = Entry{ file_size, mtime_ns };
+        }
+        free(line);
+        fclose(f);
+    } else if (errno != ENOENT) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string tmp_path = path + ".tmp";
+    FILE *t = fopen(tmp_path.c_str(), "we");
+    if (!t) {
+        log_error("cannot open '%s': %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    for (const auto &p : entries_) {
+        fprintf(t, "S %zu %lld %lld\n", p.first.size(), (long long) p.second.size, (long long) p.second.mtime_ns);
+        fwrite(p.first.data(), 1, p.first.size(), t);
+        putc('\n', t);
+    }
+    if (fflush(t) || fdatasync(fileno(t)) < 0 || ferror(t)) {
+        log_error("write error on '%s'", tmp_path.c_str());
+        fclose(t);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    fclose(t);
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        log_error("rename to '%s' failed: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    journal_ = fopen(path.c_str(), "ae");
+    if (!journal_) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int
+SyncState::check(const std::string &path, int64_t size, int64_t mtime_ns) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(path);
+    if (it == entries_.end()) return -1;
+    return it->second.size == size && it->second.mtime_ns == mtime_ns;
+}
+
+// not synced: a lost record only causes the file to be uploaded again
+bool
+SyncState::put(const std::string &path, int64_t size, int64_t mtime_ns)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    fprintf(journal_, "S %zu %lld %lld\n", path.size(), (long long) size, (long long) mtime_ns);
+    fwrite(path.data(), 1, path.size(), journal_);
+    putc('\n', journal_);
+    if (fflush(journal_)) {
+        log_error("cannot write '%s': %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    entries_[path] = Entry{ size, mtime_ns };
+    return true;
+}
+
+namespace {
+
+class TreeSync
+{
+    const SyncOptions &sync_;
+    const UploadOptions &options_;
+    SyncState *state_;
+    RemoteIndex *index_;
+    std::string prefix_;
+
+    // directories to read, relative to the root
+    std::mutex walk_mutex_;
+    std::condition_variable walk_cond_;
+    std::deque<std::string> dirs_;
+    int busy_ = 0;
+
+    // uploads queued or running, bounded so the walk does not run far ahead
+    ThreadPool pool_;
+    std::mutex upload_mutex_;
+    std::condition_variable upload_cond_;
+    int in_flight_ = 0;
+    int max_in_flight_;
+
+    struct QueuedFile
+    {
+        std::string rel;
+        std::string key;
+        int64_t size;
+        int64_t mtime_ns;
+    };
+    // with extent_order, the queued files by device and physical offset
+    using Location = std::pair<uint64_t, uint64_t>;
+    std::multimap<Location, QueuedFile> queued_;
+    Location head_{0, 0};
+
+    std::atomic<uint64_t> scanned_{0}, uploaded_{0}, unchanged_{0}, empty_{0}, failed_{0};
+
+    void walk();
+    void read_dir(const std::string &rel);
+    void add_dir(const std::string &rel);
+    void add_file(int dfd, const char *name, const std::string &rel, const struct statx &stx);
+    void upload(const QueuedFile &f);
+    bool changed(const std::string &rel, const std::string &key, int64_t size, int64_t mtime_ns) const;
+
+public:
+    TreeSync(const SyncOptions &sync, const UploadOptions &options, SyncState *state, RemoteIndex *index,
+             const std::string &prefix);
+    bool run();
+};
+
+TreeSync::TreeSync(const SyncOptions &sync, const UploadOptions &options, SyncState *state, RemoteIndex *index,
+                   const std::string &prefix)
+    : sync_(sync), options_(options), state_(state), index_(index), prefix_(prefix),
+      pool_(sync.workers), max_in_flight_(sync.workers * 16)
+{
+}
+
+void
+TreeSync::add_dir(const std::string &rel)
+{
+    {
+        std::lock_guard<std::mutex> lock(walk_mutex_);
+        dirs_.push_back(rel);
+    }
+    walk_cond_.notify_one();
+}
+
+// the walk ends when no directory is queued and no walker may queue more
+void
+TreeSync::walk()
+{
+    std::unique_lock<std::mutex> lock(walk_mutex_);
+    while (1) {
+        walk_cond_.wait(lock, [this] { return !dirs_.empty() || !busy_; });
+        if (dirs_.empty()) break;
+        std::string rel = std::move(dirs_.front());
+        dirs_.pop_front();
+        ++busy_;
+        lock.unlock();
+        read_dir(rel);
+        lock.lock();
+        --busy_;
+    }
+    walk_cond_.notify_all();
+}
+
+// the entries of a getdents64 batch are stat'ed in inode order relative
+// to the directory descriptor, which avoids resolving the whole path
+void
+TreeSync::read_dir(const std::string &rel)
+{
+    std::string path = rel.length()?sync_.dir + "/" + rel:sync_.dir;
+    int dfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC, 0);
+    if (dfd < 0) {
+        log_error("cannot open '%s': %s", path.c_str(), strerror(errno));
+        ++failed_;
+        return;
+    }
+
+    alignas(struct dirent64) char buf[65536];
+    std::vector<const struct dirent64 *> batch;
+    ssize_t len;
+    while ((len = getdents64(dfd, buf, sizeof(buf))) > 0) {
+        batch.clear();
+        for (char *p = buf; p < buf + len; ) {
+            const struct dirent64 *de = (const struct dirent64 *) p;
+            p += de->d_reclen;
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+            if (de->d_type == DT_DIR) {
+                add_dir(rel.length()?rel + "/" + de->d_name:std::string(de->d_name));
+            } else if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN) {
+                batch.push_back(de);
+            }
+        }
+        std::sort(batch.begin(), batch.end(), [](const struct dirent64 *a, const struct dirent64 *b) {
+            return a->d_ino < b->d_ino;
+        });
+        for (const struct dirent64 *de : batch) {
+            struct statx stx;
+            if (statx(dfd, de->d_name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                      STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) < 0) {
+                if (errno != ENOENT) {
+                    log_error("statx of '%s/%s' failed: %s", path.c_str(), de->d_name, strerror(errno));
+                    ++failed_;
+                }
+                continue;
+            }
+            std::string child = rel.length()?rel + "/" + de->d_name:std::string(de->d_name);
+            if (S_ISDIR(stx.stx_mode)) {
+                add_dir(child);
+            } else if (S_ISREG(stx.stx_mode)) {
+                add_file(dfd, de->d_name, child, stx);
+            }
+        }
+    }
+    if (len < 0) {
+        log_error("getdents64 on '%s' failed: %s", path.c_str(), strerror(errno));
+        ++failed_;
+    }
+    close(dfd);
+}
+
+bool
+TreeSync::changed(const std::string &rel, const std::string &key, int64_t size, int64_t mtime_ns) const
+{
+    if (state_) {
+        int r = state_->check(rel, size, mtime_ns);
+        if (r >= 0) return !r;
+    }
+    if (index_) {
+        // the remote mtime is the upload time, a file modified later has changed
+        aws::s3::ObjectInfo info;
+        if (index_->lookup(key, info)) {
+            return info.size != size || mtime_ns / 1000000000 > info.mtime;
+        }
+    }
+    return true;
+}
+
+void
+TreeSync::add_file(int dfd, const char *name, const std::string &rel, const struct statx &stx)
+{
+    ++scanned_;
+    int64_t size = stx.stx_size;
+    int64_t mtime_ns = (int64_t) stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+    std::string key = prefix_ + rel;
+    if (options_.sharder) key = options_.sharder->map(key);
+    if (!changed(rel, key, size, mtime_ns)) {
+        ++unchanged_;
+        return;
+    }
+    if (!size) {
+        // an object needs at least one part
+        log_warning("%s/%s is empty, not uploaded", sync_.dir.c_str(), rel.c_str());
+        ++empty_;
+        return;
+    }
+
+    QueuedFile f{ rel, key, size, mtime_ns };
+    if (!sync_.extent_order) {
+        {
+            std::unique_lock<std::mutex> lock(upload_mutex_);
+            upload_cond_.wait(lock, [this] { return in_flight_ < max_in_flight_; });
+            ++in_flight_;
+        }
+        pool_.submit([this, f] { upload(f); });
+        return;
+    }
+
+    // the files FIEMAP cannot locate go after the located ones of the device
+    Location loc{ ((uint64_t) stx.stx_dev_major << 32) | stx.stx_dev_minor, UINT64_MAX };
+    int fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC, 0);
+    if (fd >= 0) {
+        file_physical_offset(fd, &loc.second);
+        close(fd);
+    }
+    {
+        std::unique_lock<std::mutex> lock(upload_mutex_);
+        upload_cond_.wait(lock, [this] { return in_flight_ < max_in_flight_; });
+        ++in_flight_;
+        queued_.emplace(loc, std::move(f));
+    }
+    // every task takes the queued file next to the head at the time it starts,
+    // wrapping around to the lowest location at the end
+    pool_.submit([this] {
+        QueuedFile next;
+        {
+            std::lock_guard<std::mutex> lock(upload_mutex_);
+            auto it = queued_.lower_bound(head_);
+            if (it == queued_.end()) it = queued_.begin();
+            head_ = it->first;
+            next = std::move(it->second);
+            queued_.erase(it);
+        }
+        upload(next);
+    });
+}
+
+void
+TreeSync::upload(const QueuedFile &f)
+{
+    std::string path = sync_.dir + "/" + f.rel;
+    log_info("uploading %s to s3://%s/%s", path.c_str(), sync_.bucket.c_str(), f.key.c_str());
+    if (upload_file(options_, sync_.bucket, f.key, path)) {
+        if (options_.sharder && !options_.sharder->record(prefix_ + f.rel)) ++failed_;
+        if (state_) state_->put(f.rel, f.size, f.mtime_ns);
+        ++uploaded_;
+    } else {
+        log_error("upload of %s failed", path.c_str());
+        ++failed_;
+    }
+    {
+        std::lock_guard<std::mutex> lock(upload_mutex_);
+        --in_flight_;
+    }
+    upload_cond_.notify_one();
+}
+
+bool
+TreeSync::run()
+{
+    dirs_.push_back(std::string());
+    std::vector<std::thread> walkers;
+    for (int i = 0; i < sync_.walkers; ++i) {
+        walkers.emplace_back([this] { walk(); });
+    }
+    for (auto &t : walkers) t.join();
+    log_info("sync: walk finished, %llu files, %llu unchanged",
+             (unsigned long long) scanned_, (unsigned long long) unchanged_);
+    pool_.wait();
+    log_info("sync: %llu files uploaded, %llu unchanged, %llu empty, %llu failed",
+             (unsigned long long) uploaded_, (unsigned long long) unchanged_,
+             (unsigned long long) empty_, (unsigned long long) failed_);
+    return !failed_;
+}
+
+}
+
+bool
+run_sync(
+        const SyncOptions &sync,
+        const UploadOptions &options,
+        SyncState *state,
+        RemoteIndex *index)
+{
+    std::string prefix = sync.prefix;
+    if (prefix.length() && prefix.back() != '/') prefix += '/';
+    // the sharded keys start with the shard
+    std::string key_start = options.sharder?std::string():prefix;
+    if (index && index->bucket().length()
+        && (index->bucket() != sync.bucket || key_start.compare(0, index->prefix().size(), index->prefix()))) {
+        log_warning("index covers s3://%s/%s, not used", index->bucket().c_str(), index->prefix().c_str());
+        index = nullptr;
+    }
+    TreeSync ts(sync, options, state, index, prefix);
+    return ts.run();
+}
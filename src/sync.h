@@ -0,0 +1,65 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "multipart.h"
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
+
+class RemoteIndex;
+
+// sizes and modification times of the files uploaded by the previous runs,
+// an append-only journal of "S <path length> <size> <mtime ns>\n<path>\n"
+// records, compacted when opened
+class SyncState
+{
+    struct Entry
+    {
+        int64_t size;
+        int64_t mtime_ns;
+    };
+
+    std::string path_;
+    FILE *journal_ = nullptr;
+    std::unordered_map<std::string, Entry> entries_;
+    mutable std::mutex mutex_;
+
+public:
+    SyncState() = default;
+    ~SyncState();
+
+    SyncState(const SyncState &) = delete;
+    SyncState &operator= (const SyncState &) = delete;
+
+    bool open(const std::string &path);
+
+    // returns 1 if the file was uploaded with this size and mtime,
+    // 0 if it was uploaded with different ones, -1 if it is unknown
+    int check(const std::string &path, int64_t size, int64_t mtime_ns) const;
+    bool put(const std::string &path, int64_t size, int64_t mtime_ns);
+};
+
+struct SyncOptions
+{
+    std::string dir;
+    std::string bucket;
+    std::string prefix;         // the key is the prefix followed by the relative path
+    int walkers = 4;            // threads reading the directories
+    int workers = 1;            // files uploaded concurrently
+    bool extent_order = false;  // the queued files are read in the order of their data on the disk
+};
+
+// upload the new and changed regular files of the tree, a file is compared
+// with the state of the previous runs, or else with the index of the remote
+// objects; the uploads start while the tree is being walked;
+// with extent_order a free worker takes the queued file whose data follows
+// the data of the previous one on the device, sweeping the disk in one direction
+bool
+run_sync(
+        const SyncOptions &sync,
+        const UploadOptions &options,
+        SyncState *state,
+        RemoteIndex *index);
@@ -0,0 +1,102 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "sync.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <unistd.h>
+
+static std::string
+read_file(const std::string &path)
+{
+    std::ifstream in(path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static void
+append_file(const std::string &path, const std::string &data)
+{
+    std::ofstream out(path, std::ios::app);
+    out << data;
+}
+
+int main()
+{
+    char dir[] = "/tmp/sync_test.XXXXXX";
+    char *dir_ok = mkdtemp(dir);
+    assert(dir_ok);
+    std::string path = std::string(dir) + "/state";
+    bool ok;
+
+    {
+        SyncState state;
+        ok = state.open(path);
+        assert(ok);
+        assert(state.check("a", 1, 1) == -1);
+        ok = state.put("a", 10, 100);
+        assert(ok);
+        ok = state.put("dir/with space\nand newline", 20, 200);
+        assert(ok);
+        ok = state.put("a", 11, 110);
+        assert(ok);
+        assert(state.check("a", 11, 110) == 1);
+    }
+
+    {
+        // the journal is read back and compacted to one record per file
+        SyncState state;
+        ok = state.open(path);
+        assert(ok);
+        assert(state.check("a", 11, 110) == 1);
+        assert(state.check("a", 10, 100) == 0);
+        assert(state.check("a", 11, 111) == 0);
+        assert(state.check("dir/with space\nand newline", 20, 200) == 1);
+        assert(state.check("dir/with space", 20, 200) == -1);
+    }
+    std::string compacted = read_file(path);
+    assert(compacted.size() == std::string("S 1 11 110\na\nS 26 20 200\ndir/with space\nand newline\n").size());
+
+    // torn last records are dropped, the records before them are kept
+    const char *torn[] = {
+        "S 1 30",
+        "S 1 30 300\n",
+        "S 3 30 300\nbc",
+        "S 1 30 300\nbX",
+    };
+    for (const char *t : torn) {
+        append_file(path, t);
+        SyncState state;
+        ok = state.open(path);
+        assert(ok);
+        assert(state.check("a", 11, 110) == 1);
+        assert(state.check("dir/with space\nand newline", 20, 200) == 1);
+        assert(state.check("b", 30, 300) == -1 && state.check("bc", 30, 300) == -1);
+        assert(read_file(path).size() == compacted.size());
+    }
+
+    {
+        SyncState state;
+        ok = state.open(path);
+        assert(ok);
+        ok = state.put("b", 30, 300);
+        assert(ok);
+    }
+    {
+        SyncState state;
+        ok = state.open(path);
+        assert(ok);
+        assert(state.check("b", 30, 300) == 1 && state.check("a", 11, 110) == 1);
+    }
+
+    unlink(path.c_str());
+    rmdir(dir);
+    printf("sync_test: ok\n");
+}
@@ -0,0 +1,58 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int thread_count)
+{
+    if (thread_count < 1) thread_count = 1;
+    for (int i = 0; i < thread_count; ++i) {
+        threads_.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    task_cond_.notify_all();
+    for (auto &t : threads_) {
+        t.join();
+    }
+}
+
+void
+ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    task_cond_.notify_one();
+}
+
+void
+ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cond_.wait(lock, [this] { return tasks_.empty() && !running_; });
+}
+
+void
+ThreadPool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (1) {
+        task_cond_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+        if (tasks_.empty()) break;
+        std::function<void()> task = std::move(tasks_.front());
+        tasks_.pop_front();
+        ++running_;
+        lock.unlock();
+        task();
+        lock.lock();
+        --running_;
+        if (tasks_.empty() && !running_) {
+            idle_cond_.notify_all();
+        }
+    }
+}
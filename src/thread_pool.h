@@ -0,0 +1,36 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// fixed-size pool of worker threads executing submitted tasks in FIFO order
+class ThreadPool
+{
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable task_cond_;
+    std::condition_variable idle_cond_;
+    int running_ = 0;
+    bool stopping_ = false;
+
+    void work();
+
+public:
+    explicit ThreadPool(int thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator= (const ThreadPool &) = delete;
+
+    int size() const { return threads_.size(); }
+
+    void submit(std::function<void()> task);
+    // wait until the queue is empty and all tasks are finished
+    void wait();
+};
@@ -0,0 +1,16 @@
+#ifndef __TIMEUTIL_H__
+#define __TIMEUTIL_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/* monotonic time in microseconds, for measuring intervals */
+static inline uint64_t
+monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+#endif
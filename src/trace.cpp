@@ -0,0 +1,119 @@
+#include "trace.h"
+#include "timeutil.h"
+#include "log.h"
+
+#include <vector>
+#include <mutex>
+#include <memory>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+namespace {
+
+struct Event
+{
+    const char *name;
+    uint64_t ts_us;
+    int part;
+    char phase;
+};
+
+struct ThreadBuffer
+{
+    int tid;
+    std::vector<Event> events;
+};
+
+std::mutex buffers_mutex;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+std::string trace_path;
+uint64_t base_us;
+
+thread_local ThreadBuffer *local_buffer;
+
+ThreadBuffer *
+get_buffer()
+{
+    if (local_buffer) return local_buffer;
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    buffers.emplace_back(new ThreadBuffer);
+    local_buffer = buffers.back().get();
+    local_buffer->tid = buffers.size();
+    local_buffer->events.reserve(1024);
+    return local_buffer;
+}
+
+void
+add_event(const char *name, int part, char phase)
+{
+    ThreadBuffer *tb = get_buffer();
+    tb->events.push_back(Event{ name, monotonic_us(), part, phase });
+}
+
+}
+
+std::atomic<bool> trace::enabled_flag{false};
+
+bool
+trace::open(const std::string &path)
+{
+    trace_path = path;
+    base_us = monotonic_us();
+    enabled_flag.store(true);
+    return true;
+}
+
+void
+trace::begin(const char *name, int part)
+{
+    if (!enabled()) return;
+    add_event(name, part, 'B');
+}
+
+void
+trace::end(const char *name, int part)
+{
+    if (!enabled()) return;
+    add_event(name, part, 'E');
+}
+
+bool
+trace::write()
+{
+    if (!enabled()) return true;
+    enabled_flag.store(false);
+
+    FILE *f = fopen(trace_path.c_str(), "w");
+    if (!f) {
+        log_error("trace: cannot open '%s': %s", trace_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    int pid = getpid();
+    bool first = true;
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (const auto &tb : buffers) {
+        for (const Event &ev : tb->events) {
+            fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"upload\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d",
+                    first?"":",\n", ev.name, ev.phase,
+                    (unsigned long long) (ev.ts_us - base_us), pid, tb->tid);
+            if (ev.part >= 0) {
+                fprintf(f, ",\"args\":{\"part\":%d}", ev.part);
+            }
+            fprintf(f, "}");
+            first = false;
+        }
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fflush(f);
+    bool ok = !ferror(f);
+    fclose(f);
+    if (!ok) {
+        log_error("trace: write error on '%s'", trace_path.c_str());
+    }
+    return ok;
+}
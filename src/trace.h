@@ -0,0 +1,42 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include <string>
+#include <atomic>
+
+// Chrome trace-event (about://tracing, Perfetto) timeline of the upload
+// pipeline. Events are appended to per-thread buffers without locking
+// and written out once at the end of the run.
+namespace trace {
+
+extern std::atomic<bool> enabled_flag;
+
+inline bool enabled() { return enabled_flag.load(std::memory_order_relaxed); }
+
+bool open(const std::string &path);
+bool write();
+
+void begin(const char *name, int part);
+void end(const char *name, int part);
+
+// begin/end pair for a lexical scope, name must be a string literal
+class Scope
+{
+    const char *name_;
+    int part_;
+
+public:
+    explicit Scope(const char *name, int part = -1) : name_(name), part_(part)
+    {
+        if (enabled()) begin(name_, part_);
+    }
+    ~Scope()
+    {
+        if (enabled()) end(name_, part_);
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator= (const Scope &) = delete;
+};
+
+}
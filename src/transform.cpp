@@ -0,0 +1,172 @@
+#include "transform.h"
+#include "staging.h"
+#include "trace.h"
+#include "log.h"
+#include "direct_io.h"
+#include "util.h"
+
+#include <future>
+
+#include <openssl/md5.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+struct TransformPipeline::Chunk
+{
+    uint64_t index = 0;
+    off_t beg = 0;
+    size_t size = 0;
+    std::string out;
+    std::promise<bool> promise;
+    std::future<bool> result;
+};
+
+namespace {
+
+bool
+read_range(int fd, char *buf, size_t size, off_t offset)
+{
+    while (size > 0) {
+        ssize_t r = pread(fd, buf, size, offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) {
+            log_error("read failed: %s", strerror(errno));
+            return false;
+        }
+        if (!r) {
+            log_error("unexpected end of file");
+            return false;
+        }
+        buf += r;
+        size -= r;
+        offset += r;
+    }
+    return true;
+}
+
+}
+
+TransformPipeline::TransformPipeline(
+        StagingArea &staging,
+        int fd,
+        off_t beg,
+        off_t end,
+        const std::vector<ChunkTransform *> &transforms,
+        size_t chunk_size,
+        off_t target,
+        int threads)
+    : staging_(staging), fd_(fd), pos_(beg), end_(end), transforms_(transforms),
+      chunk_size_(chunk_size), target_(target), window_(threads * 2), pool_(threads)
+{
+}
+
+TransformPipeline::~TransformPipeline()
+{
+    pool_.wait();
+}
+
+size_t
+TransformPipeline::output_bound(size_t size) const
+{
+    for (ChunkTransform *t : transforms_) {
+        size = t->bound(size);
+    }
+    return size;
+}
+
+// keep 'window_' chunks in flight, so that the workers are busy
+// while the results are written in order
+void
+TransformPipeline::fill_window()
+{
+    while (queue_.size() < window_ && pos_ < end_) {
+        auto c = std::make_shared<Chunk>();
+        c->index = next_index_++;
+        c->beg = pos_;
+        c->size = std::min<off_t>(chunk_size_, end_ - pos_);
+        c->result = c->promise.get_future();
+        pos_ += c->size;
+        queue_.push_back(c);
+
+        pool_.submit([this, c] {
+            thread_local std::string in, tmp;
+            trace::Scope ts("transform_chunk", (int) c->index);
+            in.resize(c->size);
+            if (!read_range(fd_, &in[0], c->size, c->beg)) {
+                c->promise.set_value(false);
+                return;
+            }
+            if (drop_behind_) cache_dont_need(fd_, c->beg, c->beg + c->size);
+            size_t size = c->size;
+            for (ChunkTransform *t : transforms_) {
+                tmp.resize(t->bound(size));
+                ssize_t r = t->apply(c->index, in.data(), size, &tmp[0], tmp.size());
+                if (r < 0) {
+                    log_error("%s failed on chunk %llu", t->name(), (unsigned long long) c->index);
+                    c->promise.set_value(false);
+                    return;
+                }
+                size = r;
+                in.swap(tmp);
+            }
+            c->out.assign(in.data(), size);
+            c->promise.set_value(true);
+        });
+    }
+}
+
+int
+TransformPipeline::next(StagedFile &file, std::string &md5)
+{
+    if (failed_) return -1;
+    fill_window();
+    if (queue_.empty()) return 0;
+
+    std::string header;
+    if (!header_written_) {
+        for (ChunkTransform *t : transforms_) {
+            header += t->header();
+        }
+        header_written_ = true;
+    }
+
+    // a part is closed after the chunk that reaches the target size
+    if (!staging_.create(file, header.size() + target_ + output_bound(chunk_size_))) {
+        failed_ = true;
+        return -1;
+    }
+
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    off_t written = 0;
+    auto put = [&](const std::string &data) -> bool {
+        if (write_full(file.fd(), data.data(), data.size()) < 0) return false;
+        MD5_Update(&ctx, data.data(), data.size());
+        written += data.size();
+        return true;
+    };
+
+    if (!put(header)) {
+        failed_ = true;
+        return -1;
+    }
+    while (!queue_.empty() && written < target_) {
+        std::shared_ptr<Chunk> c = queue_.front();
+        queue_.pop_front();
+        if (!c->result.get() || !put(c->out)) {
+            failed_ = true;
+            return -1;
+        }
+        input_bytes_ += c->size;
+        fill_window();
+    }
+
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5_Final(digest, &ctx);
+    md5.assign((const char *) digest, sizeof(digest));
+    file.shrink(written);
+    output_bytes_ += written;
+    return 1;
+}
@@ -0,0 +1,86 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "thread_pool.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <cstdint>
+#include <sys/types.h>
+
+class StagingArea;
+class StagedFile;
+
+// unit of parallel work, every chunk is transformed independently
+constexpr size_t transform_chunk_size = 16*1024*1024;
+
+// transformation of independent chunks of the input (compression, encryption),
+// apply() is called concurrently for different chunks
+class ChunkTransform
+{
+public:
+    virtual ~ChunkTransform() = default;
+
+    virtual const char *name() const = 0;
+    // upper bound of the output size for an input chunk of 'size' bytes
+    virtual size_t bound(size_t size) const = 0;
+    // returns the size of the output or -1 on error
+    virtual ssize_t apply(uint64_t chunk_index, const char *in, size_t in_size, char *out, size_t out_size) = 0;
+    // written once at the beginning of the output stream
+    virtual std::string header() const { return std::string(); }
+};
+
+// reads a range of a file in chunks, transforms the chunks on a thread pool
+// and writes the results in order into staged files of about 'target' bytes
+class TransformPipeline
+{
+    struct Chunk;
+
+    StagingArea &staging_;
+    int fd_;
+    off_t pos_;
+    off_t end_;
+    std::vector<ChunkTransform *> transforms_;
+    size_t chunk_size_;
+    off_t target_;
+    size_t window_;
+    bool drop_behind_ = false;
+
+    ThreadPool pool_;
+    std::deque<std::shared_ptr<Chunk>> queue_;
+    uint64_t next_index_ = 0;
+    bool header_written_ = false;
+    bool failed_ = false;
+    uint64_t input_bytes_ = 0;
+    uint64_t output_bytes_ = 0;
+
+    void fill_window();
+    size_t output_bound(size_t size) const;
+
+public:
+    TransformPipeline(
+            StagingArea &staging,
+            int fd,
+            off_t beg,
+            off_t end,
+            const std::vector<ChunkTransform *> &transforms,
+            size_t chunk_size,
+            off_t target,
+            int threads);
+    ~TransformPipeline();
+
+    TransformPipeline(const TransformPipeline &) = delete;
+    TransformPipeline &operator= (const TransformPipeline &) = delete;
+
+    // drop the input chunks from the page cache once they are read
+    void set_drop_behind(bool drop_behind) { drop_behind_ = drop_behind; }
+
+    // produce the next part into 'file' and store its binary MD5;
+    // returns 1 if a part is produced, 0 at the end of the input, -1 on error
+    int next(StagedFile &file, std::string &md5);
+
+    uint64_t input_bytes() const { return input_bytes_; }
+    uint64_t output_bytes() const { return output_bytes_; }
+};
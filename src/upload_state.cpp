@@ -1,5 +1,112 @@
 #include "upload_state.h"
+#include "log.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 UploadState::UploadState() noexcept
 {
 }
+
+// "AWSUSTATE1" followed by "name value" lines, the parts are "part beg end md5"
+bool
+UploadState::load()
+{
+    FILE *f = fopen(file_.c_str(), "re");
+    if (!f) {
+        if (errno != ENOENT) log_error("cannot open '%s': %s", file_.c_str(), strerror(errno));
+        return false;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len = getline(&line, &line_size, f);
+    bool ok = len > 0 && !strcmp(line, "AWSUSTATE1\n");
+    parts.clear();
+    while (ok && (len = getline(&line, &line_size, f)) > 0) {
+        if (line[len - 1] != '\n') {
+            ok = false;
+            break;
+        }
+        line[len - 1] = 0;
+        char *value = strchr(line, ' ');
+        if (!value) {
+            ok = false;
+            break;
+        }
+        *value++ = 0;
+        long long a = 0, b = 0;
+        unsigned long long u = 0, v = 0;
+        char hex[64];
+        if (!strcmp(line, "bucket")) {
+            bucket = value;
+        } else if (!strcmp(line, "key")) {
+            key = value;
+        } else if (!strcmp(line, "etag")) {
+            etag = value;
+        } else if (!strcmp(line, "file")) {
+            ok = sscanf(value, "%llu:%llu", &u, &v) == 2;
+            dev = u;
+            ino = v;
+        } else if (!strcmp(line, "size")) {
+            ok = sscanf(value, "%lld", &a) == 1;
+            size = a;
+        } else if (!strcmp(line, "tail")) {
+            ok = sscanf(value, "%lld %63s", &a, hex) == 2 && from_hex(hex, tail_md5);
+            tail_beg = a;
+        } else if (!strcmp(line, "midstate")) {
+            ok = from_hex(value, midstate);
+        } else if (!strcmp(line, "part")) {
+            Part p;
+            ok = sscanf(value, "%lld %lld %63s", &a, &b, hex) == 3 && from_hex(hex, p.md5);
+            p.beg = a;
+            p.end = b;
+            parts.push_back(std::move(p));
+        }
+    }
+    free(line);
+    fclose(f);
+    if (!ok) {
+        log_warning("'%s' is not a valid upload state", file_.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool
+UploadState::save() const
+{
+    std::string tmp_path = file_ + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "we");
+    if (!f) {
+        log_error("cannot open '%s': %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(f, "AWSUSTATE1\n");
+    fprintf(f, "bucket %s\n", bucket.c_str());
+    fprintf(f, "key %s\n", key.c_str());
+    fprintf(f, "etag %s\n", etag.c_str());
+    fprintf(f, "file %llu:%llu\n", (unsigned long long) dev, (unsigned long long) ino);
+    fprintf(f, "size %lld\n", (long long) size);
+    fprintf(f, "tail %lld %s\n", (long long) tail_beg, to_hex(tail_md5).c_str());
+    fprintf(f, "midstate %s\n", to_hex(midstate).c_str());
+    for (const Part &p : parts) {
+        fprintf(f, "part %lld %lld %s\n", (long long) p.beg, (long long) p.end, to_hex(p.md5).c_str());
+    }
+    if (fflush(f) || fdatasync(fileno(f)) < 0 || ferror(f)) {
+        log_error("write error on '%s'", tmp_path.c_str());
+        fclose(f);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    fclose(f);
+    if (rename(tmp_path.c_str(), file_.c_str()) < 0) {
+        log_error("rename to '%s' failed: %s", file_.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -1,12 +1,35 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
 
+// what is known about an object uploaded from a local file, kept between
+// runs so that a grown file can be uploaded by reusing the uploaded prefix
 class UploadState
 {
     std::string file_;
 
 public:
+    struct Part
+    {
+        off_t beg = 0;
+        off_t end = 0;
+        std::string md5;            // binary
+    };
+
+    std::string bucket;
+    std::string key;
+    std::string etag;               // of the completed object
+    uint64_t dev = 0;               // identity of the local file
+    uint64_t ino = 0;
+    off_t size = 0;                 // of the object, a prefix of the file
+    off_t tail_beg = 0;             // [tail_beg, size) is hashed to check the prefix cheaply
+    std::string tail_md5;
+    std::string midstate;           // MD5 context of the whole file after 'size' bytes
+    std::vector<Part> parts;
+
     UploadState() noexcept;
 
     UploadState(const UploadState &) = delete;
@@ -24,4 +47,9 @@ public:
     {
         file_.assign(file);
     }
+
+    // load from the file set by set_file(), false if it is missing or invalid
+    bool load();
+    // replaced atomically
+    bool save() const;
 };
@@ -0,0 +1,71 @@
+// the checks must run in every build
+#undef NDEBUG
+
+#include "upload_state.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <unistd.h>
+
+int main()
+{
+    char dir[] = "/tmp/upload_state_test.XXXXXX";
+    char *dir_ok = mkdtemp(dir);
+    assert(dir_ok);
+    std::string path = std::string(dir) + "/state";
+
+    UploadState s;
+    s.set_file(path);
+    bool ok = s.load();
+    assert(!ok);
+
+    s.bucket = "bucket";
+    s.key = "dir/a key with spaces";
+    s.etag = "\"0123456789abcdef0123456789abcdef-2\"";
+    s.dev = 2049;
+    s.ino = 123456789012ULL;
+    s.size = 6LL * 1024 * 1024 * 1024;
+    s.tail_beg = s.size - 1024 * 1024;
+    s.tail_md5 = std::string(16, '\x5a');
+    s.midstate = std::string("\x00\x01\xfe\xff", 4) + std::string(88, '\x7f');
+    for (int i = 0; i < 3; ++i) {
+        UploadState::Part p;
+        p.beg = i * 2LL * 1024 * 1024 * 1024;
+        p.end = p.beg + 2LL * 1024 * 1024 * 1024;
+        p.md5 = std::string(16, (char) (0xf0 + i));
+        s.parts.push_back(p);
+    }
+    ok = s.save();
+    assert(ok);
+
+    UploadState t;
+    t.set_file(path);
+    ok = t.load();
+    assert(ok);
+    assert(t.bucket == s.bucket && t.key == s.key && t.etag == s.etag);
+    assert(t.dev == s.dev && t.ino == s.ino && t.size == s.size);
+    assert(t.tail_beg == s.tail_beg && t.tail_md5 == s.tail_md5);
+    assert(t.midstate == s.midstate);
+    assert(t.parts.size() == s.parts.size());
+    for (size_t i = 0; i < s.parts.size(); ++i) {
+        assert(t.parts[i].beg == s.parts[i].beg && t.parts[i].end == s.parts[i].end);
+        assert(t.parts[i].md5 == s.parts[i].md5);
+    }
+
+    // a damaged file is not loaded
+    FILE *f = fopen(path.c_str(), "a");
+    assert(f);
+    fputs("part 0 10 not-hex\n", f);
+    fclose(f);
+    UploadState u;
+    u.set_file(path);
+    ok = u.load();
+    assert(!ok);
+
+    unlink(path.c_str());
+    rmdir(dir);
+    printf("upload_state_test: ok\n");
+}
@@ -0,0 +1,75 @@
+#include "util.h"
+#include "log.h"
+
+#include <string.h>
+#include <errno.h>
+
+int
+write_full(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+    while (size > 0) {
+        ssize_t w = write(fd, p, size);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            log_error("write failed: %s", strerror(errno));
+            return -1;
+        }
+        p += w;
+        size -= w;
+    }
+    return 0;
+}
+
+int
+pwrite_full(int fd, const void *data, size_t size, off_t offset)
+{
+    const char *p = data;
+    while (size > 0) {
+        ssize_t w = pwrite(fd, p, size, offset);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            log_error("write failed: %s", strerror(errno));
+            return -1;
+        }
+        p += w;
+        size -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+void
+hex_encode(char *out, const void *data, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; ++i) {
+        *out++ = digits[p[i] >> 4];
+        *out++ = digits[p[i] & 15];
+    }
+    *out = 0;
+}
+
+static int
+hex_digit(int c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int
+hex_decode(void *out, size_t size, const char *str)
+{
+    unsigned char *p = out;
+    for (size_t i = 0; i < size; ++i) {
+        int hi = hex_digit((unsigned char) str[i * 2]);
+        if (hi < 0) return -1;
+        int lo = hex_digit((unsigned char) str[i * 2 + 1]);
+        if (lo < 0) return -1;
+        p[i] = hi << 4 | lo;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef __UTIL_H__
+#define __UTIL_H__
+
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* write all the data, retrying short writes and EINTR;
+   returns 0 or -1, the error is logged */
+int
+write_full(int fd, const void *data, size_t size);
+
+int
+pwrite_full(int fd, const void *data, size_t size, off_t offset);
+
+/* 2 * size lowercase hex digits and '\0' into out */
+void
+hex_encode(char *out, const void *data, size_t size);
+
+/* decode the first 2 * size characters of str, which all must be
+   hex digits; returns 0 or -1 */
+int
+hex_decode(void *out, size_t size, const char *str);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+
+inline std::string
+to_hex(const std::string &bin)
+{
+    std::string out(bin.size() * 2 + 1, 0);
+    hex_encode(&out[0], bin.data(), bin.size());
+    out.pop_back();
+    return out;
+}
+
+// the whole string must be an even number of hex digits
+inline bool
+from_hex(const char *str, std::string &bin)
+{
+    size_t len = 0;
+    while (str[len]) ++len;
+    bin.assign(len / 2, 0);
+    if (len % 2 || hex_decode(&bin[0], bin.size(), str) < 0) {
+        bin.clear();
+        return false;
+    }
+    return true;
+}
+#endif
+
+#endif
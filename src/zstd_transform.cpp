@@ -0,0 +1,46 @@
+#include "zstd_transform.h"
+#include "log.h"
+
+#include <memory>
+
+#include <zstd.h>
+
+namespace {
+
+struct CCtxDeleter
+{
+    void operator()(ZSTD_CCtx *cctx) const { ZSTD_freeCCtx(cctx); }
+};
+
+// compression contexts are reused by the worker threads
+thread_local std::unique_ptr<ZSTD_CCtx, CCtxDeleter> local_cctx;
+
+}
+
+size_t
+ZstdTransform::bound(size_t size) const
+{
+    return ZSTD_compressBound(size);
+}
+
+ssize_t
+ZstdTransform::apply(uint64_t, const char *in, size_t in_size, char *out, size_t out_size)
+{
+    if (!local_cctx) {
+        local_cctx.reset(ZSTD_createCCtx());
+        if (!local_cctx) {
+            log_error("ZSTD_createCCtx failed");
+            return -1;
+        }
+    }
+    ZSTD_CCtx *cctx = local_cctx.get();
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level_);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    size_t r = ZSTD_compress2(cctx, out, out_size, in, in_size);
+    if (ZSTD_isError(r)) {
+        log_error("zstd compression failed: %s", ZSTD_getErrorName(r));
+        return -1;
+    }
+    return r;
+}
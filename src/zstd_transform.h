@@ -0,0 +1,18 @@
+// -*- mode: c++ -*-
+#pragma once
+
+#include "transform.h"
+
+// compresses every chunk into an independent zstd frame,
+// the concatenation of the frames is a valid zstd stream
+class ZstdTransform : public ChunkTransform
+{
+    int level_;
+
+public:
+    explicit ZstdTransform(int level) : level_(level) {}
+
+    const char *name() const override { return "zstd"; }
+    size_t bound(size_t size) const override;
+    ssize_t apply(uint64_t chunk_index, const char *in, size_t in_size, char *out, size_t out_size) override;
+};